@@ -17,10 +17,21 @@ OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHE
 
 #define _GNU_SOURCE
 #include "multicoresql.h"
+#include <sqlite3.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* The error buffer is per-thread.  Worker threads of the in-process engine */
+/* copy their errors out before exiting so the calling thread can report them. */
 
 const size_t mu_error_len = 8191;
-char mu_error_buf[8192];
-size_t mu_error_cursor = 0;
+__thread char mu_error_buf[8192];
+__thread size_t mu_error_cursor = 0;
 
 const char *mu_error_oom =
   "Out of memory\n";
@@ -79,6 +90,31 @@ static char * mu_cat(const char *s1, const char *s2){
   return s;
 }
 
+struct mu_STRBUF {
+  char *s;
+  size_t len;
+  size_t cap;
+};
+
+static int mu_strbuf_add(struct mu_STRBUF *b, const char *s, size_t n){
+  if ((b->len+n+1)>(b->cap)){
+    size_t cap = (b->cap)? b->cap: 4096;
+    while (cap<(b->len+n+1))
+      cap *= 2;
+    char *p = realloc(b->s, cap);
+    if (NULL==p){
+      MU_WARN_OOM();
+      return -1;
+    }
+    b->s = p;
+    b->cap = cap;
+  }
+  memcpy(b->s+b->len, s, n);
+  b->len += n;
+  b->s[b->len] = 0;
+  return 0;
+}
+
 static FILE* mu_fopen(const char *fname, const char *mode){
   FILE *f = fopen(fname, mode);
   if (NULL==f){
@@ -88,25 +124,154 @@ static FILE* mu_fopen(const char *fname, const char *mode){
   return f;
 }
 
-static int mu_getcoreshardc(int i, int n, int c){
-  int each = c/n;
-  int extras = (i<(c%n))? 1: 0;
-  return each+extras;
+/* Shard scheduling.  Shards are sorted largest file first and dealt to the
+ * core with the fewest bytes assigned so far, so each core's queue is also
+ * largest first.  The process engine runs each core's queue as dealt.
+ * Threads of the in-process engine take from the head of their own queue
+ * and, when it is empty, steal the head of the queue with the most bytes left,
+ * so no core sits idle while another still has a backlog.
+ */
+
+struct mu_SCHEDULE {
+  pthread_mutex_t lock;
+  int ncores;
+  size_t shardc;
+  const char **shardv; /* all queues, core i's queue is shardv[head[i]] .. shardv[end[i]-1] */
+  size_t *shardnum; /* position of each queued shard in the shardv the schedule was created from */
+  long long *shardsize;
+  size_t *head;
+  size_t *end;
+  long long *remaining; /* bytes left in each core's queue */
+  int failed; /* set when a worker fails, so the others stop taking shards */
+};
+
+struct mu_SHARDSIZE {
+  long long size;
+  size_t idx;
+};
+
+static int mu_cmp_shardsize(const void *a, const void *b){
+  const struct mu_SHARDSIZE *x = (const struct mu_SHARDSIZE *) a;
+  const struct mu_SHARDSIZE *y = (const struct mu_SHARDSIZE *) b;
+  if (x->size != y->size)
+    return (x->size > y->size)? -1: 1;
+  return (x->idx < y->idx)? -1: ((x->idx > y->idx)? 1: 0);
+}
+
+static void mu_schedule_free(struct mu_SCHEDULE *s){
+  if (s){
+    pthread_mutex_destroy(&(s->lock));
+    free((void *) s->shardv);
+    free(s->shardnum);
+    free(s->shardsize);
+    free(s->head);
+    free(s->end);
+    free(s->remaining);
+    free(s);
+  }
 }
 
-static const char ** mu_getcoreshardv(int i, int n, int c, const char ** v){
-  typedef char * pchar;
-  int shardc = mu_getcoreshardc(i,n,c);
-  const char ** result = malloc(shardc*sizeof(pchar));
-  if (NULL == result){
+/* schedules the shards marked in use[], or all of them when use is NULL.  Sizes come from info, the manifest, when there is one */
+static struct mu_SCHEDULE * mu_schedule_create(int ncores, size_t shardc, const char **shardv, const struct mu_SHARDINFO *info, const char *use){
+  struct mu_SCHEDULE *s = calloc(1, sizeof(struct mu_SCHEDULE));
+  struct mu_SHARDSIZE *sizes = malloc(shardc*sizeof(struct mu_SHARDSIZE));
+  int *owner = malloc(shardc*sizeof(int));
+  if ((NULL==s) || (NULL==sizes) || (NULL==owner)){
+    MU_WARN_OOM();
+    free(s);
+    free(sizes);
+    free(owner);
+    return NULL;
+  }
+  pthread_mutex_init(&(s->lock), NULL);
+  s->ncores = ncores;
+  s->shardc = shardc;
+  s->shardv = malloc(shardc*sizeof(const char *));
+  s->shardnum = malloc(shardc*sizeof(size_t));
+  s->shardsize = malloc(shardc*sizeof(long long));
+  s->head = calloc(ncores, sizeof(size_t));
+  s->end = calloc(ncores, sizeof(size_t));
+  s->remaining = calloc(ncores, sizeof(long long));
+  if ((NULL==s->shardv) || (NULL==s->shardnum) || (NULL==s->shardsize) || (NULL==s->head) || (NULL==s->end) || (NULL==s->remaining)){
     MU_WARN_OOM();
+    mu_schedule_free(s);
+    free(sizes);
+    free(owner);
     return NULL;
   }
-  int idx;
-  for(idx=0; (idx*n+i)<c; ++idx){
-    result[idx] = v[(idx*n+i)];
+  size_t i;
+  int icore;
+  size_t n = 0;
+  for(i=0;i<shardc;++i){
+    if ((use) && (!use[i]))
+      continue;
+    struct stat fstats;
+    if (info)
+      sizes[n].size = info[i].bytes;
+    else
+      sizes[n].size = (0==stat(shardv[i], &fstats))? (long long) fstats.st_size: 0;
+    sizes[n].idx = i;
+    ++n;
+  }
+  shardc = n;
+  s->shardc = n;
+  qsort(sizes, shardc, sizeof(struct mu_SHARDSIZE), mu_cmp_shardsize);
+  /* deal largest first to the least loaded core, counting queue lengths in end[] */
+  for(i=0;i<shardc;++i){
+    int least = 0;
+    for(icore=1;icore<ncores;++icore){
+      if (s->remaining[icore] < s->remaining[least])
+	least = icore;
+    }
+    owner[i] = least;
+    s->remaining[least] += sizes[i].size;
+    s->end[least]++;
   }
-  return result;
+  /* lay the queues out one after another */
+  size_t offset = 0;
+  for(icore=0;icore<ncores;++icore){
+    s->head[icore] = offset;
+    offset += s->end[icore];
+    s->end[icore] = s->head[icore];
+  }
+  for(i=0;i<shardc;++i){
+    size_t slot = s->end[owner[i]]++;
+    s->shardv[slot] = shardv[sizes[i].idx];
+    s->shardnum[slot] = sizes[i].idx;
+    s->shardsize[slot] = sizes[i].size;
+  }
+  free(sizes);
+  free(owner);
+  return s;
+}
+
+/* returns the next shard for core icore, stealing if necessary, or NULL when all shards are taken */
+static const char * mu_schedule_next(struct mu_SCHEDULE *s, int icore, size_t *shardnum){
+  const char *shard = NULL;
+  pthread_mutex_lock(&(s->lock));
+  int victim = icore;
+  if ((s->head[icore]) >= (s->end[icore])){
+    int i;
+    for(i=0;i<s->ncores;++i){
+      if ( ((s->head[i]) < (s->end[i])) &&
+	   ( (victim==icore) || (s->remaining[i] > s->remaining[victim]) ) )
+	victim = i;
+    }
+  }
+  if ( (!s->failed) && ((s->head[victim]) < (s->end[victim])) ){
+    size_t slot = s->head[victim]++;
+    s->remaining[victim] -= s->shardsize[slot];
+    shard = s->shardv[slot];
+    *shardnum = s->shardnum[slot];
+  }
+  pthread_mutex_unlock(&(s->lock));
+  return shard;
+}
+
+static void mu_schedule_fail(struct mu_SCHEDULE *s){
+  pthread_mutex_lock(&(s->lock));
+  s->failed = 1;
+  pthread_mutex_unlock(&(s->lock));
 }
 
 static int is_mu_temp(const char *fname){
@@ -233,6 +398,7 @@ char * mu_read_small_file(const char *fname){
   size_t buflimit = (size_t) (100*1024*1024);  // 100MB self-imposed limit
 
   if (buflen>buflimit){
+    MU_WARN("mu_read_small_file %s is larger than 100MB and was not read.  mu_run_query_cb() passes results of any size row by row\n", fname);
     return NULL;
   }
 
@@ -298,6 +464,7 @@ static struct mu_SQLITE3_TASK * mu_define_task(const char *dirname, const char *
   }
   task->pid=0;
   task->status=0;
+  task->reaped=0;
   task->dirname = strdup(dirname);
   task->taskname = strdup(taskname);
   if ((NULL==task->dirname) || (NULL==task->taskname)){
@@ -422,7 +589,9 @@ static int mu_finish_task(struct mu_SQLITE3_TASK *task, const char *errormsg){
     MU_WARN("%s\n", "An unusual error occurred. NULL task pointer in mu_finish_task()");
     return -1;
   }
-  waitpid(task->pid, &(task->status), 0);
+  if (!task->reaped)
+    waitpid(task->pid, &(task->status), 0);
+  task->reaped = 1;
   const char *errs = NULL;
   if (task->ename)
     errs = mu_read_small_file(task->ename);
@@ -465,86 +634,39 @@ static void mu_free_task(struct mu_SQLITE3_TASK *task){
   }
 }
 
+static int mu_split_sqlite_table(const char *dbname, const char *tablename, const char *dbdir, int append);
+static int mu_catalog_forget(const char *dbdir, const char *tablename);
+static void mu_manifest_forget(const char *dbdir);
+static int mu_shards_from_sqlite_table(const char *dbname, const char *tablename, const char *dbdir, int append);
+
 int mu_create_shards_from_sqlite_table(const char *dbname, const char *tablename, const char *dbdir){
-  typedef const char * pchar;
-  const char *shard_setup_fmt =
-    "create temporary table shardids as select distinct shardid from %s where (shardid is not null) and (shardid!='');\n"
-    "select count(*) from shardids;\n"
-    "select shardid from shardids order by shardid;\n";
-  int i;
-  int shardc;
-  char **shardv;
-  const char *shard_data_each_fmt =
-    "attach database '%s/%s' as 'shard';\n"
-    "create table shard.%s as select * from %s where shardid='%s';\n"
-    "detach database shard;\n";
-  const char *tmpdir = mu_create_temp_dir();
-  if (NULL==tmpdir)
-    return -1;
-  struct mu_SQLITE3_TASK *getshardnames_task =
-    mu_define_task(tmpdir, dbname, "getshardnames", 0);
-  if (NULL==getshardnames_task)
-    return -1;
-  FILE *getcmdf = mu_fopen(getshardnames_task->iname, "w");
-  if (NULL==getcmdf)
-    return -1;
-  MU_FPRINTF(getshardnames_task->iname, -1, getcmdf, shard_setup_fmt, dbname, tablename);
-  MU_FCLOSE_W(getshardnames_task->iname, -1, getcmdf);
-  int runstatus=0;
-  if (mu_start_task(getshardnames_task, "Fatal Error in mu_create_shards_from_sqlite_table() while trying to start sqlite3 for a read-only operation. Check that sqlite3 is properly installed on your system and if sqlite3 is not on the PATH set environment variable MULTICORE_SQLITE3_BIN \n"))
-    return -1;
-  runstatus = mu_finish_task(getshardnames_task, "Fatal Error in mu_create_shards_from_sqlite_table().  Errors occurred while reading the shardid column.  Check that the named database exists and the selected table has a shardid column. \n");
-  if (runstatus)
-    return -1;
-  char *cmdout = mu_read_small_file(getshardnames_task->oname);
-  if (cmdout==NULL){
-    MU_WARN("%s\n", "Fatal Error in mu_create_shards_from_sqlite_table().  While reading the shardid column of the table, there were no usable values. All values read were either NULL or blank string. Before calling mu_create_shards_from_sqlite_table() make sure that the shardid column exists and has values to indicate a shardid for each row of the table.");
-    return -1;
-  }
-  char *tok0 = strtok(cmdout, "\n");
-  if (tok0==NULL){
-    MU_WARN("%s\n", "An unusual error occurred in mu_create_shards_from_sqlite_table().  strtok() was unable to parse the data returned from examining the shardid column of the database table.");
-    return -1;
-  }
-  shardc = (int) strtol(tok0, NULL, 10);
-  if (shardc<=0){
-    MU_WARN("An unusual error occurred in mu_create_shards_from_sqlite_table() while parsing the data returned from examining the shardid column of the database table. On the first line of data I expected to get the number of shards, but instead received: %s\n", tok0);
-    return -1;
-  }
-  shardv = malloc((1+shardc)*sizeof(pchar));
-  if (NULL==shardv){
-    MU_WARN_OOM();
+  return mu_shards_from_sqlite_table(dbname, tablename, dbdir, 0);
+}
+
+int mu_append_shards_from_sqlite_table(const char *dbname, const char *tablename, const char *dbdir){
+  return mu_shards_from_sqlite_table(dbname, tablename, dbdir, 1);
+}
+
+static int mu_shards_from_sqlite_table(const char *dbname, const char *tablename, const char *dbdir, int append){
+  if ((NULL==dbname) || (NULL==tablename) || (NULL==dbdir)){
+    MU_WARN("%s\n", "mu_create_shards_from_sqlite_table() received a NULL database name, table name or shard directory");
     return -1;
   }
-  for(i=0;i<shardc;++i){
-    shardv[i] = strtok(NULL, "\n");
-  }
-  shardv[shardc] = NULL;
-  struct mu_SQLITE3_TASK *makeshards_task =
-    mu_define_task(tmpdir, dbname, "makeshards",0);
-  if (NULL==makeshards_task)
-    return -1;
-  FILE *makeshardsf = mu_fopen(makeshards_task->iname, "w");
-  if (NULL==makeshardsf)
-    return -1;
-  for(i=0;i<shardc;++i){
-    if (ok_mu_shard_name(shardv[i])){
-      MU_FPRINTF(makeshards_task->iname, -1, makeshardsf, shard_data_each_fmt, dbdir, shardv[i], tablename, tablename, shardv[i]);
-    } else {
-      MU_WARN("Warning: mu_create_shards_from_sqlite_table() will ignore all data rows tagged with shardid %s .  Valid shard names may contain 0-9,a-z,A-Z,-,_, or . but may not begin with . \n", shardv[i]);
+  if (mkdir(dbdir, 0700)){
+    if (errno != EEXIST){
+      MU_WARN("mu_create_shards_from_sqlite_table() could not create requested directory %s\n", dbdir);
+      MU_WARN_IF_ERRNO();
+      return -1;
     }
   }
-  MU_FCLOSE_W(makeshards_task->iname, -1, makeshardsf);
-  if (mu_start_task(makeshards_task, "mu_create_shards_from_sqlite_table() was unable to begin the creating the shard databases."))
-    return -1;
-  if (mu_finish_task(makeshards_task, "Fatal Error detected by mu_create_shards_from_sqlite_table() while running sqlite3 to create the shard databases.  You should probably delete the newly created shard databases and run this creation task again after reviewing the messages below and fixing any correctable errors. \n"))
+  /* the shards are about to be rewritten, so any earlier zone maps or manifest no longer hold. */
+  /* Appended rows leave the zone maps to be checked against the shards' new sizes and times.  */
+  if (append)
+    mu_manifest_forget(dbdir);
+  else if (mu_catalog_forget(dbdir, tablename))
     return -1;
-  mu_free_task(getshardnames_task);
-  mu_free_task(makeshards_task);
-  free((void *) cmdout);
-  mu_remove_temp_dir(tmpdir);
-  free((void *) tmpdir);
-  return 0;
+  int status = mu_split_sqlite_table(dbname, tablename, dbdir, append);
+  return (status)? status: mu_write_manifest(dbdir);
 }
 
 static unsigned int mu_get_random_seed(void){
@@ -564,7 +686,25 @@ static unsigned int mu_get_random_seed(void){
   return result;
 }
 
+static int mu_csv_schema(const char *schema, char *sep, struct mu_STRBUF *sql);
+static int mu_import_csv(const char *csvname, int skip, const char *createsql, char sep, const char *tablename, const char *dbDir, int shardc, const char *keycols, char **names);
+static int mu_append_targets(const char *dbDir, const char *tablename, int shardc, long long maxbytes, char ***names, char **keycols);
+static void mu_free_names(char **names);
+static int mu_shards_from_csv(const char *csvname, int skip, const char *schema, const char *tablename, const char *dbDir, int shardc, const char *keycols, int append, long long maxbytes);
+
 int mu_create_shards_from_csv(const char *csvname, int skip, const char *schema, const char *tablename, const char *dbDir, int shardc){
+  return mu_shards_from_csv(csvname, skip, schema, tablename, dbDir, shardc, NULL, 0, 0);
+}
+
+int mu_create_partitioned_shards_from_csv(const char *csvname, int skip, const char *schema, const char *tablename, const char *dbDir, int shardc, const char *keycols){
+  return mu_shards_from_csv(csvname, skip, schema, tablename, dbDir, shardc, keycols, 0, 0);
+}
+
+int mu_append_shards_from_csv(const char *csvname, int skip, const char *schema, const char *tablename, const char *dbDir, int shardc, long long maxbytes){
+  return mu_shards_from_csv(csvname, skip, schema, tablename, dbDir, shardc, NULL, 1, maxbytes);
+}
+
+static int mu_shards_from_csv(const char *csvname, int skip, const char *schema, const char *tablename, const char *dbDir, int shardc, const char *keycols, int append, long long maxbytes){
   /* inquire as to the maximum number of permissible open files */
   /* if we get back a number that is greater than 20, take it seriously. */
   /* and check the sharding request against this system limit */
@@ -595,11 +735,6 @@ int mu_create_shards_from_csv(const char *csvname, int skip, const char *schema,
     return -1;
   }
 
-  srand(mu_get_random_seed());
-
-  const char *tmpdir = mu_create_temp_dir();
-  if (NULL==tmpdir)
-    return -1;
   if (mkdir(dbDir, 0700)){
     if (errno != EEXIST){
       MU_WARN("mu_create_shards_from_csv could not create requested directory %s\n", dbDir);
@@ -607,6 +742,49 @@ int mu_create_shards_from_csv(const char *csvname, int skip, const char *schema,
       return -1;
     }
   }
+
+  char **names = NULL;
+  char *appendkeys = NULL;
+  if (append){
+    /* rows are added to the shards as they are, so only the manifest is out of date */
+    shardc = mu_append_targets(dbDir, tablename, shardc, maxbytes, &names, &appendkeys);
+    if (shardc<0){
+      free((void *) createsql);
+      return -1;
+    }
+    keycols = appendkeys;
+    mu_manifest_forget(dbDir);
+  } else if (mu_catalog_forget(dbDir, tablename)){
+    /* the shards are about to be rewritten, so any earlier partition key or manifest no longer holds */
+    free((void *) createsql);
+    return -1;
+  }
+
+  /* Unless the schema needs the sqlite3 shell, import on all cores straight into the shards */
+  char sep = '|';
+  struct mu_STRBUF schemasql = { NULL, 0, 0 };
+  if (0==mu_csv_schema(createsql, &sep, &schemasql)){
+    free((void *) createsql);
+    int status = mu_import_csv(csvname, skip, schemasql.s, sep, tablename, dbDir, shardc, keycols, names);
+    free(schemasql.s);
+    mu_free_names(names);
+    free(appendkeys);
+    return (status)? status: mu_write_manifest(dbDir);
+  }
+  free(schemasql.s);
+  mu_free_names(names);
+  free(appendkeys);
+  if ((keycols) || (append)){
+    MU_WARN("%s\n", "mu_create_shards_from_csv():  partitioning by key or appending needs a schema whose only sqlite3 dot commands are .mode csv, .mode tabs, .mode list or .separator.  No shard databases were changed.");
+    free((void *) createsql);
+    return -1;
+  }
+
+  srand(mu_get_random_seed());
+
+  const char *tmpdir = mu_create_temp_dir();
+  if (NULL==tmpdir)
+    return -1;
   FILE *csvf = mu_fopen(csvname,"r");
   if (NULL==csvf)
     return -1;
@@ -686,7 +864,7 @@ int mu_create_shards_from_csv(const char *csvname, int skip, const char *schema,
   mu_remove_temp_dir(tmpdir);
   mu_free_task(createdb_task);
   free((void *) tmpdir);
-  return 0;
+  return mu_write_manifest(dbDir);
 }
 
 static const char *mu_sqlite3_extensions(void){
@@ -733,6 +911,12 @@ static int mu_fLoadExtensions(FILE *f){
 
 
 
+const char *mu_error_null_dbconf =
+  "Error:  Can not determine a database directory for this query. \nReceived a null pointer instead of a pointer to a database configuration. \nThe query will not run. \n";
+
+const char *mu_error_null_query =
+  "Error: Did not receive a query to execute.\n";
+
 struct mu_QUERY * mu_create_query(const char *mapsql_or_fname,
 				const char *createtablesql_or_fname,
 				const char *reducesql_or_fname)
@@ -797,316 +981,6846 @@ struct mu_QUERY * mu_create_query(const char *mapsql_or_fname,
   q->mapsql = mapsql;
   q->reducesql = reducesql;
   q->createtablesql = createtablesql;
+  q->combinesql = NULL;
+  q->timeout = 0;
+  q->partial = 0;
+  q->cancelled = 0;
+  q->nshards = 0;
+  q->nmapped = 0;
 
   return q;
 
 }
 
-const char *mu_error_null_dbconf =
-  "Error:  Can not determine a database directory for this query. \nReceived a null pointer instead of a pointer to a database configuration. \nThe query will not run. \n";
-
-const char *mu_error_null_query =
-  "Error: Did not receive a query to execute.\n";
-
-
-
-struct mu_DBCONF * mu_opendb(const char *dbdir){
-  typedef struct mu_DBCONF conftype;
-  if (NULL==dbdir){
-    MU_WARN("%s\n","Fatal: mu_opendb received a NULL instead of the /path/to/shards directory ");
-    return NULL;
-  }
-  struct mu_DBCONF * c = malloc(sizeof(conftype));
-  if (NULL==c)
-    return NULL;
-  c->db = NULL;
-  c->otablename = "maptable";
-  c->isopen = 0;
-  c->ncores = (int) sysconf(_SC_NPROCESSORS_ONLN);
-  if ((c->ncores<=0) || (c->ncores>255)){
-    /* number of cores not detected properly by sysconf.  This should not be fatal */
-    /* So we specify 2 cores in this situation and a developer can change it in the returned mu_DBCONF if they know better. */
-    c->ncores = 2;
-  }
-  c->shardc = 0;
-  c->shardv = NULL;
-  c->isopen=0;
-  char *glob = mu_cat(dbdir,"/*");
-  if (NULL==glob)
-    return NULL;
-  wordexp_t p;
-  int flags = WRDE_NOCMD; // do not run commands in shells like "$(evil)"
-  int w = wordexp(glob, &p, flags);
-  if (w || (p.we_wordc<2) ){
-    MU_WARN("mu_opendb() failed to find any shard database files in %s\n", glob);
-    free(c);
-    return NULL;
-  }
-  c->shardc = p.we_wordc;
-  // fprintf(stderr,"found %zd shards \n",c->shardc);
-  c->shardv = (const char **) p.we_wordv;
-  // mark c as open if return values make sense
-  if ((c->shardc>1) &&
-      (c->shardv[0]) &&
-      (NULL==c->shardv[c->shardc])
-      ){
-        c->isopen=1;
-        if ((c->ncores)>(c->shardc)) c->ncores = c->shardc;  // can use at most shardc cores -- pragmatic fix for issue #1
+int mu_query_set_combinesql(struct mu_QUERY *q, const char *combinesql_or_fname){
+  if (NULL==q){
+    MU_WARN("%s\n", mu_error_null_query);
+    return -1;
   }
-  free(glob);
-  if (c->isopen==0){
-    free(c);
-    MU_WARN("mu_opendb() failed to open the database directory %s.\nCheck that the directory is non-empty at contains at least 2 files. \n", dbdir);
-    return NULL;
+  const char *combinesql = NULL;
+  if (combinesql_or_fname){
+    combinesql = mu_dup_sql_or_read_file(combinesql_or_fname);
+    if (NULL==combinesql){
+      MU_WARN("%s\n", "Error:  Could not read the sqlite statements or commands for the combine stage. \nThe query will not run.");
+      return -1;
+    }
   }
-  return c;
+  free((void *) q->combinesql);
+  q->combinesql = combinesql;
+  return 0;
 }
 
-static int is_mu_select(const char *sqlstr){
-  size_t i=0;
-  const char space = ' ';
-  const char tab = '\t';
-  /* If the string is blank or all spaces/tabs the null-terminator will end this while loop */
-  while ( (space==sqlstr[i]) || (tab==sqlstr[i]) )
-    ++i;
-  return (('s'==sqlstr[i]) || ('S'==sqlstr[i]));
-}
+/* SQL tokens.  Just enough of sqlite's lexical rules to find the clauses of a
+ * select, its top-level commas and function calls, while keeping the text of
+ * each piece so it can be copied into generated statements unchanged.
+ */
 
-static int mu_makeQueryCoreFile(struct mu_DBCONF * conf, const char *fname, const char *coredbname, int shardc, const char **shardv, const char *mapsql){
+#define MU_TK_WORD 1   /* keyword or bare identifier */
+#define MU_TK_ID 2     /* quoted identifier */
+#define MU_TK_STRING 3 /* 'string literal' */
+#define MU_TK_NUMBER 4
+#define MU_TK_PUNCT 5  /* operators and punctuation */
 
-  int i;
+struct mu_TOKEN {
+  int type;
+  const char *s;
+  int n;
+  int depth; /* parenthesis depth, a '(' and its ')' are at the outer depth */
+};
 
-  if (NULL==conf) MU_WARN("%s\n","mu_makeQueryCoreFile detected conf==NULL");
-  if (NULL==fname) MU_WARN("%s\n","mu_makeQueryCoreFile detected fname==NULL");
-  if (0==shardc) MU_WARN("%s\n", "mu_makeQueryCoreFile detected shardc==0");
-  if (NULL==shardv) MU_WARN("%s\n","mu_makeQueryCoreFile detected shardv==NULL");
-  if (NULL==mapsql) MU_WARN("%s\n","mu_makeQueryCoreFile detected mapsql==NULL");
+struct mu_TOKENS {
+  struct mu_TOKEN *v;
+  int c;
+};
 
-  if ( (conf==NULL) || (fname==NULL) || (shardc==0) || (shardv==NULL) || (mapsql==NULL) || strlen(mapsql)==0 ){
-    MU_WARN("%s\n", "mu_makeQueryCoreFile detected one or more invalid or NULL required parameters");
-    return -1;
-  }
+static int is_mu_word_char(int c){
+  return (isalnum(c) || ('_'==c) || ('$'==c) || (c>=0x80));
+}
 
-  size_t bufsize = (1024+strlen(mapsql))*shardc+1024;
-  size_t cursor = 0;
-  char *buf = malloc(bufsize);
-  if (NULL==buf){
+static int mu_tokenize(const char *sql, struct mu_TOKENS *t){
+  const unsigned char *p = (const unsigned char *) sql;
+  int cap = 64;
+  int depth = 0;
+  t->c = 0;
+  t->v = malloc(cap*sizeof(struct mu_TOKEN));
+  if (NULL==t->v){
     MU_WARN_OOM();
     return -1;
   }
-
-
-  int is_select = is_mu_select(mapsql);
-
-  const char *exts = mu_sqlite3_extensions();
-
-  for(i=0;i<shardc;++i){
-    if (shardv[i]){
-      MU_PRINTBUF(".open %s\n", shardv[i]);
-      MU_PRINTBUF("%s\n",".bail on");
-      if (exts)
-	MU_PRINTBUF("%s\n", exts);
-      if (is_select){
-	MU_PRINTBUF("attach database '%s' as 'resultdb';\n", coredbname);
-	if (i==0){
-	  MU_PRINTBUF("create table resultdb.%s as %s\n",
-		  conf->otablename,
-		  mapsql);
-	} else {
-	  MU_PRINTBUF("insert into resultdb.%s %s\n",
-		  conf->otablename,
-		  mapsql);
+  while (*p){
+    if (isspace(*p)){
+      ++p;
+      continue;
+    }
+    if (('-'==p[0]) && ('-'==p[1])){
+      while ((*p) && ('\n'!=*p))
+	++p;
+      continue;
+    }
+    if (('/'==p[0]) && ('*'==p[1])){
+      const char *e = strstr((const char *) p+2, "*/");
+      p = (e)? (const unsigned char *) e+2: p+strlen((const char *) p);
+      continue;
+    }
+    const unsigned char *s = p;
+    int type = MU_TK_PUNCT;
+    if (('\'' == *p) || ('"' == *p) || ('`' == *p) || ('[' == *p)){
+      unsigned char close = ('['==*p)? ']': *p;
+      type = ('\''==*p)? MU_TK_STRING: MU_TK_ID;
+      ++p;
+      while (*p){
+	if (*p==close){
+	  if ((']'!=close) && (p[1]==close)){
+	    p += 2;
+	    continue;
+	  }
+	  break;
 	}
-      } else {
-	/* mapsql is not a select statment */
-	MU_PRINTBUF("%s\n", mapsql);
+	++p;
       }
+      if (0==*p){
+	MU_WARN("Error: unterminated quote in sql: %s\n", (const char *) s);
+	free(t->v);
+	t->v = NULL;
+	return -1;
+      }
+      ++p;
+    } else if (isdigit(*p) || (('.'==*p) && isdigit(p[1]))){
+      type = MU_TK_NUMBER;
+      int hex = ('0'==s[0]) && (('x'==s[1]) || ('X'==s[1]));
+      while (isalnum(*p) || ('.'==*p) ||
+	     ((!hex) && (('+'==*p) || ('-'==*p)) && (('e'==p[-1]) || ('E'==p[-1]))))
+	++p;
+    } else if (is_mu_word_char(*p)){
+      type = MU_TK_WORD;
+      while (is_mu_word_char(*p))
+	++p;
+    } else {
+      const char *two[] = { "<=", ">=", "<>", "!=", "==", "||", "<<", ">>", "->", NULL };
+      int i;
+      p++;
+      for(i=0;two[i];++i){
+	if ((s[0]==two[i][0]) && (s[1]==two[i][1])){
+	  p++;
+	  break;
+	}
+      }
+    }
+    if (t->c==cap){
+      cap *= 2;
+      struct mu_TOKEN *v = realloc(t->v, cap*sizeof(struct mu_TOKEN));
+      if (NULL==v){
+	MU_WARN_OOM();
+	free(t->v);
+	t->v = NULL;
+	return -1;
+      }
+      t->v = v;
     }
+    if ((MU_TK_PUNCT==type) && (')'==*s) && (depth>0))
+      --depth;
+    t->v[t->c].type = type;
+    t->v[t->c].s = (const char *) s;
+    t->v[t->c].n = (int) (p-s);
+    t->v[t->c].depth = depth;
+    t->c++;
+    if ((MU_TK_PUNCT==type) && ('('==*s))
+      ++depth;
   }
+  return 0;
+}
 
-  if (cursor>bufsize){
-    free(buf);
-    MU_WARN("%s\n", "Oops! A buffer overflow was prevented while constructing the command files derived from the map query.  Unfortunately that buffer ran out of space.  The query was not run.");
-    return -1;
-  }
+/* case insensitive match of a bare word or punctuation token */
+static int is_mu_tk(const struct mu_TOKEN *tk, const char *word){
+  return ((MU_TK_WORD==tk->type) || (MU_TK_PUNCT==tk->type)) &&
+    ((int) strlen(word)==tk->n) &&
+    (0==strncasecmp(tk->s, word, tk->n));
+}
 
-  FILE * qcfile = mu_fopen(fname,"w");
-  if (NULL==qcfile){
-    free(buf);
-    return -1;
-  }
-  int bytes_written = fputs(buf, qcfile);
-  free(buf);
-  if (bytes_written<0){
-    MU_WARN_FNAME(fname);
-    MU_WARN_IF_ERRNO();
-    return -1;
-  }
-  MU_FCLOSE_W(fname, -1, qcfile);
+/* case insensitive match of a bare or quoted identifier token */
+static int is_mu_tk_name(const struct mu_TOKEN *tk, const char *name){
+  size_t len = strlen(name);
+  if (MU_TK_WORD==tk->type)
+    return ((size_t) tk->n==len) && (0==strncasecmp(tk->s, name, len));
+  if (MU_TK_ID==tk->type)
+    return ((size_t) tk->n==len+2) && (0==strncasecmp(tk->s+1, name, len));
   return 0;
 }
 
-char * mu_run_query(struct mu_DBCONF *conf, struct mu_QUERY *q)
-{
+static int is_mu_tk_equal(const struct mu_TOKEN *a, const struct mu_TOKEN *b){
+  if ((a->type!=b->type) || (a->n!=b->n))
+    return 0;
+  return (MU_TK_WORD==a->type)? (0==strncasecmp(a->s, b->s, a->n)): (0==strncmp(a->s, b->s, a->n));
+}
 
-  if (NULL==conf){
-    MU_WARN("%s\n", mu_error_null_dbconf);
-    return NULL;
+/* appends the source text of tokens [a,b), with single spaces where the source had any */
+static int mu_strbuf_add_tokens(struct mu_STRBUF *out, const struct mu_TOKENS *t, int a, int b){
+  int i;
+  for(i=a;i<b;++i){
+    if (mu_strbuf_add(out, t->v[i].s, t->v[i].n))
+      return -1;
+    if ((i+1<b) && ((t->v[i+1].s) > (t->v[i].s+t->v[i].n)) && mu_strbuf_add(out, " ", 1))
+      return -1;
   }
+  return 0;
+}
 
-  if (NULL==q){
-    MU_WARN("%s\n", mu_error_null_query);
-    return NULL;
+static int mu_strbuf_adds(struct mu_STRBUF *out, const char *s){
+  return mu_strbuf_add(out, s, strlen(s));
+}
+
+/* returns the index of the ')' matching the '(' at i, or -1 */
+static int mu_tk_close(const struct mu_TOKENS *t, int i){
+  int j;
+  for(j=i+1;j<t->c;++j){
+    if ((t->v[j].depth==t->v[i].depth) && is_mu_tk(&t->v[j], ")"))
+      return j;
   }
+  return -1;
+}
 
-  /* unpack the query. check existence of mapsql, always required. */
+/* splits [a,b) at commas of depth d, storing up to max range starts in at[], at[count] is b */
+static int mu_tk_split(const struct mu_TOKENS *t, int a, int b, const char *sep, int *at, int max){
+  int count = 0;
+  int d = (a<b)? t->v[a].depth: 0;
+  int i;
+  at[count++] = a;
+  for(i=a;i<b;++i){
+    if ((t->v[i].depth==d) && is_mu_tk(&t->v[i], sep)){
+      if (count>=max)
+	return -1;
+      at[count++] = i+1;
+    }
+  }
+  at[count] = b+1; /* so that at[k+1]-1 is always the end of range k */
+  return count;
+}
 
-  const char *mapsql = q->mapsql;
-  if (NULL==mapsql){
-    MU_WARN("%s\n", mu_error_null_query);
-    return NULL;
+/* The clauses of a single select statement, as token ranges.  An absent clause has a==b. */
+struct mu_SELECT {
+  struct mu_TOKENS t;
+  int items_a, items_b;
+  int from_a, from_b;
+  int where_a, where_b;
+  int group_a, group_b;
+  int having_a, having_b;
+  int order_a, order_b;
+  int limit_a, limit_b;
+};
+
+/* parses a single simple select. Returns -1 and sets no error for anything else, when quiet */
+static int mu_parse_select(const char *sql, struct mu_SELECT *sel, int quiet){
+  memset(sel, 0, sizeof(struct mu_SELECT));
+  if (mu_tokenize(sql, &(sel->t)))
+    return -1;
+  struct mu_TOKENS *t = &(sel->t);
+  int n = t->c;
+  while ((n>0) && is_mu_tk(&t->v[n-1], ";"))
+    --n;
+  const char *why = NULL;
+  int i;
+  int *mark = NULL;
+  if ((0==n) || (!is_mu_tk(&t->v[0], "select")))
+    why = "it does not begin with select";
+  if ((NULL==why) && (n>1) && (is_mu_tk(&t->v[1], "distinct")))
+    why = "select distinct is not supported";
+  sel->items_a = ((n>1) && is_mu_tk(&t->v[1], "all"))? 2: 1;
+  for(i=1; (i<n) && (NULL==why); ++i){
+    struct mu_TOKEN *tk = &t->v[i];
+    if (tk->depth)
+      continue;
+    if (is_mu_tk(tk, ";"))
+      why = "it contains more than one statement";
+    else if (is_mu_tk(tk, "union") || is_mu_tk(tk, "intersect") || is_mu_tk(tk, "except"))
+      why = "compound selects are not supported";
+    else if (is_mu_tk(tk, "window"))
+      why = "window clauses are not supported";
+    else if (is_mu_tk(tk, "from") && (0==sel->from_a))
+      mark = &(sel->from_a);
+    else if (is_mu_tk(tk, "where") && (0==sel->where_a))
+      mark = &(sel->where_a);
+    else if (is_mu_tk(tk, "group") && (i+1<n) && is_mu_tk(&t->v[i+1], "by") && (0==sel->group_a)){
+      mark = &(sel->group_a);
+      ++i;
+    } else if (is_mu_tk(tk, "having") && (0==sel->having_a))
+      mark = &(sel->having_a);
+    else if (is_mu_tk(tk, "order") && (i+1<n) && is_mu_tk(&t->v[i+1], "by") && (0==sel->order_a)){
+      mark = &(sel->order_a);
+      ++i;
+    } else if (is_mu_tk(tk, "limit") && (0==sel->limit_a))
+      mark = &(sel->limit_a);
+    else
+      continue;
+    if (mark)
+      *mark = i+1;
+    mark = NULL;
+  }
+  if ((NULL==why) && (0==sel->from_a))
+    why = "it has no from clause";
+  if (why){
+    if (!quiet)
+      MU_WARN("Error: the query planner can not plan this sql because %s:\n%s\n", why, sql);
+    free(t->v);
+    t->v = NULL;
+    return -1;
+  }
+  /* each clause ends where the next present clause keyword begins */
+  int *starts[] = { &(sel->from_a), &(sel->where_a), &(sel->group_a), &(sel->having_a), &(sel->order_a), &(sel->limit_a) };
+  int *ends[] = { &(sel->from_b), &(sel->where_b), &(sel->group_b), &(sel->having_b), &(sel->order_b), &(sel->limit_b) };
+  const int kwlen[] = { 1, 1, 2, 1, 2, 1 };
+  int k, j;
+  sel->items_b = sel->from_a-1;
+  for(k=0;k<6;++k){
+    *ends[k] = n;
+    for(j=0;j<6;++j){
+      if ((*starts[k]) && (*starts[j] > *starts[k]) && ((*starts[j]-kwlen[j]) < *ends[k]))
+	*ends[k] = *starts[j]-kwlen[j];
+    }
+  }
+  for(k=0;k<6;++k){
+    if (0==*starts[k])
+      *starts[k] = n;
   }
+  return 0;
+}
 
-  const char *reducesql = q->reducesql;
-  const char *createtablesql = q->createtablesql;
+static void mu_free_select(struct mu_SELECT *sel){
+  free(sel->t.v);
+  sel->t.v = NULL;
+}
 
-  const char *tmpdir = mu_create_temp_dir();
-  if (NULL==tmpdir)
+/* Top k.  Of a select with order by and a constant limit, no row past    */
+/* offset+limit in the sort order of one shard or one core's results can  */
+/* reach the result.  Planned map queries keep only those rows per shard, */
+/* and a reduce that only orders and limits maptable, in a query with no  */
+/* combinesql of its own, is run with a combinesql keeping them per core, */
+/* so the tree merge folds runs of at most k rows and the reduce orders   */
+/* at most k rows per part.                                               */
+
+/* returns offset+limit for a select with order by and a constant limit, else 0 */
+static long long mu_select_topk(const struct mu_SELECT *sel){
+  const struct mu_TOKENS *t = &(sel->t);
+  int a = sel->limit_a;
+  int n = sel->limit_b-a;
+  long long v[2] = { 0, 0 };
+  int i;
+  if ((sel->order_a>=sel->order_b) || ((1!=n) && (3!=n)))
+    return 0;
+  for(i=0;i<n;i+=2){
+    const struct mu_TOKEN *tk = &t->v[a+i];
+    if ((MU_TK_NUMBER!=tk->type) || ((int) strspn(tk->s, "0123456789")<tk->n))
+      return 0;
+    v[i/2] = strtoll(tk->s, NULL, 10);
+  }
+  if ((3==n) && (!is_mu_tk(&t->v[a+1], "offset")) && (!is_mu_tk(&t->v[a+1], ",")))
+    return 0;
+  /* limit n, limit n offset m or limit m, n */
+  long long limit = ((3==n) && is_mu_tk(&t->v[a+1], ","))? v[1]: v[0];
+  return (limit>0)? v[0]+v[1]: 0;
+}
+
+/* returns the combinesql keeping the top rows of each core for a reduce "select * from otablename order by ... limit ...", or NULL */
+static char * mu_topk_combinesql(const char *otablename, const char *reducesql){
+  struct mu_SELECT sel;
+  if ((NULL==reducesql) || mu_parse_select(reducesql, &sel, 1))
     return NULL;
+  const struct mu_TOKENS *t = &(sel.t);
+  struct mu_STRBUF b = { NULL, 0, 0 };
+  long long k = mu_select_topk(&sel);
+  if ((k>0) &&
+      (sel.items_a+1==sel.items_b) && is_mu_tk(&t->v[sel.items_a], "*") &&
+      (sel.from_a+1==sel.from_b) && is_mu_tk_name(&t->v[sel.from_a], otablename) &&
+      (sel.where_a==sel.where_b) && (sel.group_a==sel.group_b) && (sel.having_a==sel.having_b)){
+    char limit[32];
+    snprintf(limit, sizeof(limit), " limit %lld;", k);
+    if (mu_strbuf_adds(&b, "select * from ") ||
+	mu_strbuf_adds(&b, otablename) ||
+	mu_strbuf_adds(&b, " order by ") ||
+	mu_strbuf_add_tokens(&b, t, sel.order_a, sel.order_b) ||
+	mu_strbuf_adds(&b, limit)){
+      free(b.s);
+      b.s = NULL;
+    }
+  }
+  mu_free_select(&sel);
+  return b.s;
+}
 
-  int icore;
+/* adds " order by ... limit k" to a map select whose rows are ordered and limited the same way in the reduce */
+static int mu_plan_topk(const struct mu_SELECT *sel, struct mu_STRBUF *mapsql){
+  long long k = mu_select_topk(sel);
+  char limit[32];
+  if (k<=0)
+    return 0;
+  snprintf(limit, sizeof(limit), " limit %lld", k);
+  return mu_strbuf_adds(mapsql, " order by ") ||
+    mu_strbuf_add_tokens(mapsql, &(sel->t), sel->order_a, sel->order_b) ||
+    mu_strbuf_adds(mapsql, limit);
+}
 
-  struct mu_SQLITE3_TASK *mapsql_task[conf->ncores];
-  for(icore=0;icore<conf->ncores;++icore){
-    mapsql_task[icore] =
-      mu_define_task(tmpdir, NULL, "mapsql", icore);
-    if (NULL==mapsql_task[icore])
-      return NULL;
+/* Hash partitioning.  A table imported with a partition key has each row in the
+ * shard named by the FNV-1a hash of its key values, modulo the number of shards.
+ * Key values are hashed as text; in columns with numeric affinity numbers are
+ * first written the way sqlite3 stores them, so 7, 7.0 and 07 hash alike.
+ */
+
+#define MU_KEY_MAX 16
+
+#define MU_KEY_NUMERIC 'n' /* integer, real or numeric affinity */
+#define MU_KEY_TEXT 't'    /* text or blob affinity, binary collation */
+#define MU_KEY_OTHER 'x'   /* text with another collation, equal values may differ as text */
+
+struct mu_PARTITION {
+  char *tablename;
+  int nkey;
+  char *keycol[MU_KEY_MAX];
+  char keytype[MU_KEY_MAX+1];
+  int shardc;
+  struct mu_PARTITION *next;
+};
+
+static uint64_t mu_fnv1a(uint64_t h, const char *s, size_t n){
+  size_t i;
+  for(i=0;i<n;++i){
+    h ^= (unsigned char) s[i];
+    h *= 1099511628211ULL;
   }
+  return h;
+}
 
-  struct mu_SQLITE3_TASK *reducesql_task =
-    mu_define_task(tmpdir,mapsql_task[0]->dbname,"reducesql",0);
-  if (NULL==reducesql_task)
+#define MU_FNV1A_BASIS 14695981039346656037ULL
+
+/* the low bits of FNV-1a are weak on short keys like numbers, so they are mixed before taking the shard */
+static int mu_hash_shard(uint64_t h, int shardc){
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return (int) (h % (uint64_t) shardc);
+}
+
+/* returns the text a key value hashes as, in s itself or in buf, and its length in *n */
+static const char * mu_key_canon(char keytype, const char *s, size_t *n, char *buf, size_t bufsize){
+  if (MU_KEY_NUMERIC!=keytype)
+    return s;
+  const char *a = s;
+  const char *b = s+*n;
+  while ((a<b) && isspace((unsigned char) *a))
+    ++a;
+  while ((b>a) && isspace((unsigned char) b[-1]))
+    --b;
+  const char *c;
+  int digits = 0;
+  for(c=a;c<b;++c){
+    if (isdigit((unsigned char) *c))
+      digits = 1;
+    else if (NULL==strchr("+-.eE", *c))
+      return s;
+  }
+  if ((!digits) || ((size_t) (b-a)>=bufsize))
+    return s;
+  memcpy(buf, a, b-a);
+  buf[b-a] = 0;
+  char *e;
+  errno = 0;
+  long long v = strtoll(buf, &e, 10);
+  if ((0==*e) && (0==errno)){
+    *n = (size_t) snprintf(buf, bufsize, "%lld", v);
+    return buf;
+  }
+  double d = strtod(buf, &e);
+  if (*e)
+    return s;
+  if ((d>-9.2e18) && (d<9.2e18) && (d==(double) (long long) d))
+    *n = (size_t) snprintf(buf, bufsize, "%lld", (long long) d);
+  else
+    *n = (size_t) snprintf(buf, bufsize, "%.17g", d);
+  return buf;
+}
+
+/* the token naming the table a select reads, when it reads only one table, with its alias token in *alias or -1 */
+static int mu_from_table(const struct mu_SELECT *sel, int *alias){
+  const struct mu_TOKENS *t = &(sel->t);
+  int a = sel->from_a;
+  int n = sel->from_b-a;
+  *alias = -1;
+  if ((n<1) || (n>3) || ((MU_TK_WORD!=t->v[a].type) && (MU_TK_ID!=t->v[a].type)))
+    return -1;
+  if (2==n)
+    *alias = a+1;
+  if (3==n){
+    if (!is_mu_tk(&t->v[a+1], "as"))
+      return -1;
+    *alias = a+2;
+  }
+  if ((*alias>=0) && (MU_TK_WORD!=t->v[*alias].type) && (MU_TK_ID!=t->v[*alias].type))
+    return -1;
+  return a;
+}
+
+/* the partitioned table a select reads, when it reads only that one table, with its alias token in *alias or -1 */
+static struct mu_PARTITION * mu_from_partition(struct mu_DBCONF *conf, const struct mu_SELECT *sel, int *alias){
+  int table = mu_from_table(sel, alias);
+  if ((NULL==conf) || (table<0))
     return NULL;
+  struct mu_PARTITION *part;
+  for(part=conf->partition; part; part=part->next){
+    if (is_mu_tk_name(&sel->t.v[table], part->tablename))
+      return part;
+  }
+  return NULL;
+}
 
-  FILE *reducef = NULL;
-  const char * rname = reducesql_task->iname;
+/* number of tokens at i, 1 or 3, naming column col of the table, optionally qualified, or 0 */
+static int mu_tk_column(const struct mu_TOKENS *t, int i, int b, const char *col, const char *tablename, int alias){
+  if ((i<b) && is_mu_tk_name(&t->v[i], col))
+    return 1;
+  if ((i+2<b) && is_mu_tk(&t->v[i+1], ".") && is_mu_tk_name(&t->v[i+2], col) &&
+      ( is_mu_tk_name(&t->v[i], tablename) ||
+	((alias>=0) && is_mu_tk_equal(&t->v[i], &t->v[alias])) ))
+    return 3;
+  return 0;
+}
 
-  size_t cursor = 0; // for reduce
-  size_t bufsize = (reducesql)? ((1024*conf->ncores)+strlen(reducesql)) :0;
-  char *buf = NULL;
+/* splits a where clause [a,b) into its top level "and" terms, keeping "x between y and z" whole.
+ * Returns the number of terms, storing their starts in at[] as mu_tk_split() does, or -1 if there is a top level "or" */
+static int mu_where_terms(const struct mu_TOKENS *t, int a, int b, int *at, int max){
+  int count = 0;
+  int between = 0;
+  int i;
+  if (a>=b)
+    return 0;
+  int d = t->v[a].depth;
+  at[count++] = a;
+  for(i=a;i<b;++i){
+    if (t->v[i].depth!=d)
+      continue;
+    if (is_mu_tk(&t->v[i], "or"))
+      return -1;
+    if (is_mu_tk(&t->v[i], "between"))
+      between = 1;
+    else if (is_mu_tk(&t->v[i], "and")){
+      if (between){
+	between = 0;
+	continue;
+      }
+      if (count>=max)
+	return -1;
+      at[count++] = i+1;
+    }
+  }
+  at[count] = b+1;
+  return count;
+}
 
-  const char *ext = mu_sqlite3_extensions();
+/* Query planner.  A single aggregate select is split into a map query that
+ * computes partial aggregates per shard, grouped by the group by expressions,
+ * and a reduce query that merges the partials.  sum, total, min and max merge
+ * with themselves, count merges by summing and avg travels as total and count.
+ */
 
-#define MU_FREE_Q() do { \
-    int i;							\
-    for(i=0;i<conf->ncores;++i){				\
-      mu_free_task(mapsql_task[i]);				\
-    }								\
-    mu_free_task(reducesql_task);				\
-    if (reducesql) free(buf);					\
-    free((void *) tmpdir);					\
-  } while(0)							\
+#define MU_PLAN_MAX 256
 
+struct mu_PLAN {
+  struct mu_SELECT sel;
+  int ngroup;
+  int group_a[MU_PLAN_MAX]; /* token ranges of the group by expressions */
+  int group_b[MU_PLAN_MAX];
+  int npartial;
+  char *partial[MU_PLAN_MAX]; /* map side expressions, column mu_pN is partial[N-1] */
+  int nagg; /* aggregate calls seen while rewriting */
+  sqlite3 *db; /* lists the functions known to sqlite3, opened on first use */
+  sqlite3_stmt *isagg;
+};
 
-  if (reducesql){
-    buf = malloc(bufsize);
-    if (NULL==buf){
-      MU_WARN_OOM();
-      MU_FREE_Q();
-      return NULL;
+static sqlite3 * mu_sqlite3_open(const char *dbname);
+
+/* 1 when tk names an aggregate or window function the planner does not split, such as group_concat,
+ * whether built into sqlite3 or loaded from MULTICORE_SQLITE3_EXTENSIONS */
+static int is_mu_plan_other_aggregate(struct mu_PLAN *p, const struct mu_TOKEN *tk){
+  const char *known[] = { "group_concat", "string_agg", "json_group_array", "json_group_object", "jsonb_group_array",
+			  "jsonb_group_object", "median", "percentile", "percentile_cont", "percentile_disc", NULL };
+  int i;
+  if (MU_TK_WORD!=tk->type)
+    return 0;
+  for(i=0;known[i];++i){
+    if (is_mu_tk(tk, known[i]))
+      return 1;
+  }
+  if ((NULL==p->db) && (NULL==(p->db = mu_sqlite3_open(":memory:"))))
+    return 0;
+  if ((NULL==p->isagg) &&
+      (SQLITE_OK!=sqlite3_prepare_v2(p->db, "select 1 from pragma_function_list where name=lower(?) and type in ('a', 'w');", -1, &(p->isagg), NULL)))
+    return 0;
+  sqlite3_reset(p->isagg);
+  sqlite3_bind_text(p->isagg, 1, tk->s, tk->n, SQLITE_STATIC);
+  return (SQLITE_ROW==sqlite3_step(p->isagg));
+}
+
+static int mu_plan_partial(struct mu_PLAN *p, const char *fn, const struct mu_TOKENS *t, int a, int b){
+  struct mu_STRBUF e = { NULL, 0, 0 };
+  if ( mu_strbuf_adds(&e, fn) || mu_strbuf_add(&e, "(", 1) ||
+       mu_strbuf_add_tokens(&e, t, a, b) || mu_strbuf_add(&e, ")", 1) ){
+    free(e.s);
+    return -1;
+  }
+  int i;
+  for(i=0;i<p->npartial;++i){
+    if (0==strcmp(p->partial[i], e.s)){
+      free(e.s);
+      return i+1;
     }
-    MU_PRINTBUF("%s\n",".bail on");
-    if (ext)
-      MU_PRINTBUF("%s\n", ext);
   }
+  if (p->npartial>=MU_PLAN_MAX){
+    MU_WARN("%s\n", "Error: the query planner found too many aggregates.");
+    free(e.s);
+    return -1;
+  }
+  p->partial[p->npartial++] = e.s;
+  return p->npartial;
+}
 
-  const size_t coredbnamesize = 255;
+/* length of the longest group by expression matching the tokens at i, with its number in *g */
+static int mu_plan_group_match(struct mu_PLAN *p, int i, int b, int *g){
+  const struct mu_TOKENS *t = &(p->sel.t);
+  int best = 0;
+  int k;
+  for(k=0;k<p->ngroup;++k){
+    int len = p->group_b[k]-p->group_a[k];
+    int j;
+    if ((len<=best) || (i+len>b))
+      continue;
+    for(j=0; (j<len) && is_mu_tk_equal(&t->v[i+j], &t->v[p->group_a[k]+j]); ++j)
+      ;
+    if ((j==len) && ((i+len>=b) || (!is_mu_tk(&t->v[i+len], "(")))){
+      best = len;
+      *g = k+1;
+    }
+  }
+  return best;
+}
 
-  const char *errormsg_on_start = "Fatal error detected by mu_query() attempting to start sqlite3 ";
-  const char *errormsg_on_finish_map = "Fatal error detected by mu_query() in map task";
-  const char *errormsg_on_finish_reduce = "Fatal error detected by mu_query() in reduce task";
+/* appends the reduce side form of expression [a,b): aggregates read their partials and group by expressions read mu_gN */
+static int mu_plan_rewrite(struct mu_PLAN *p, int a, int b, struct mu_STRBUF *out){
+  const struct mu_TOKENS *t = &(p->sel.t);
+  const char *aggs[] = { "sum", "total", "count", "min", "max", "avg", NULL };
+  char col[64];
+  int i = a;
+  while (i<b){
+    int g = 0;
+    int len = mu_plan_group_match(p, i, b, &g);
+    if (len){
+      snprintf(col, sizeof(col), "mu_g%d", g);
+      if (mu_strbuf_adds(out, col))
+	return -1;
+      i += len;
+    } else {
+      int k = -1;
+      int close = -1;
+      int named = 0; /* one of aggs[], even when called as a scalar function */
+      if ((MU_TK_WORD==t->v[i].type) && (i+1<b) && is_mu_tk(&t->v[i+1], "(")){
+	for(k=0; (aggs[k]) && (!is_mu_tk(&t->v[i], aggs[k])); ++k)
+	  ;
+	if (NULL==aggs[k])
+	  k = -1;
+	named = (k>=0);
+	close = mu_tk_close(t, i+1);
+      }
+      if ((k>=0) && (close>0) && ((3==k) || (4==k))){
+	/* min(a,b) and max(a,b) with several arguments are scalar functions */
+	int at[MU_PLAN_MAX+1];
+	if (mu_tk_split(t, i+2, close, ",", at, MU_PLAN_MAX)>1)
+	  k = -1;
+      }
+      if ((k>=0) && (close>0)){
+	if ((close==i+2) || is_mu_tk(&t->v[i+2], "distinct")){
+	  MU_WARN("Error: the query planner can not split %.*s(%s) across shards.\n", t->v[i].n, t->v[i].s, (close==i+2)? "": "distinct ...");
+	  return -1;
+	}
+	if ((close+1<t->c) && (is_mu_tk(&t->v[close+1], "over") || is_mu_tk(&t->v[close+1], "filter"))){
+	  MU_WARN("%s\n", "Error: the query planner does not support window functions or aggregate filters.");
+	  return -1;
+	}
+	int x = 0;
+	int y = 0;
+	const char *fn = aggs[k];
+	if (5==k){
+	  x = mu_plan_partial(p, "total", t, i+2, close);
+	  y = mu_plan_partial(p, "count", t, i+2, close);
+	} else {
+	  x = mu_plan_partial(p, fn, t, i+2, close);
+	}
+	if ((x<0) || (y<0))
+	  return -1;
+	if (5==k)
+	  snprintf(col, sizeof(col), "(total(mu_p%d)/sum(mu_p%d))", x, y);
+	else if (2==k)
+	  snprintf(col, sizeof(col), "coalesce(sum(mu_p%d),0)", x);
+	else
+	  snprintf(col, sizeof(col), "%s(mu_p%d)", fn, x);
+	if (mu_strbuf_adds(out, col))
+	  return -1;
+	p->nagg++;
+	i = close+1;
+      } else {
+	if ((close>0) && (!named) && is_mu_plan_other_aggregate(p, &t->v[i])){
+	  MU_WARN("Error: the query planner can not split %.*s() across shards.  Write the map and reduce queries with -m and -r.\n", t->v[i].n, t->v[i].s);
+	  return -1;
+	}
+	if (mu_strbuf_add(out, t->v[i].s, t->v[i].n))
+	  return -1;
+	++i;
+      }
+    }
+    if ((i<b) && ((t->v[i].s) > (t->v[i-1].s+t->v[i-1].n)) && mu_strbuf_add(out, " ", 1))
+      return -1;
+  }
+  return 0;
+}
 
-  for(icore=0;icore<(conf->ncores);++icore){
-    if ((reducesql) && (icore>0)){
-      MU_PRINTBUF("attach database '%s' as 'coredb%.3d';\n",
-		  mapsql_task[icore]->dbname,
-		  icore);
-      MU_PRINTBUF("insert into %s select * from coredb%.3d.%s;\n",
-		  conf->otablename,
-		  icore,
-		  conf->otablename);
-      MU_PRINTBUF("detach database 'coredb%.3d';\n", icore);
+static int is_mu_keyword(const struct mu_TOKEN *tk){
+  const char *kw[] = { "and", "as", "between", "case", "cast", "collate", "current_date", "current_time",
+		       "current_timestamp", "distinct", "else", "end", "escape", "false", "glob", "in", "is",
+		       "like", "not", "null", "or", "regexp", "then", "true", "when", NULL };
+  int i;
+  if (MU_TK_WORD!=tk->type)
+    return 0;
+  for(i=0;kw[i];++i){
+    if (is_mu_tk(tk, kw[i]))
+      return 1;
+  }
+  return 0;
+}
+
+/* splits an item [a,b) into expression [a,*e) and alias [*alias,b), *alias==b when there is none */
+static void mu_plan_alias(const struct mu_TOKENS *t, int a, int b, int *e, int *alias){
+  *e = b;
+  *alias = b;
+  if (b-a<2)
+    return;
+  const struct mu_TOKEN *last = &t->v[b-1];
+  const struct mu_TOKEN *prev = &t->v[b-2];
+  if (is_mu_tk(prev, "as") && ((MU_TK_WORD==last->type) || (MU_TK_ID==last->type) || (MU_TK_STRING==last->type))){
+    *e = b-2;
+    *alias = b-1;
+    return;
+  }
+  /* implicit alias such as "sum(n) total" or "n total", but not "a.b" or "case ... end" */
+  if ( ((MU_TK_WORD==last->type) || (MU_TK_ID==last->type)) && (!is_mu_keyword(last)) &&
+       ( is_mu_tk(prev, ")") ||
+	 ( ((MU_TK_WORD==prev->type) || (MU_TK_ID==prev->type) || (MU_TK_NUMBER==prev->type)) && (!is_mu_keyword(prev)) ) ) ){
+    *e = b-1;
+    *alias = b-1;
+  }
+}
+
+/* Grouping by every key column of a hash partitioned table puts each group in a single shard, so
+ * the select can run on the shards unchanged and the reduce only has to order and limit the rows. */
+static int is_mu_plan_mapside(struct mu_DBCONF *conf, struct mu_PLAN *p){
+  const struct mu_SELECT *sel = &(p->sel);
+  const struct mu_TOKENS *t = &(sel->t);
+  int alias;
+  struct mu_PARTITION *part = (p->ngroup)? mu_from_partition(conf, sel, &alias): NULL;
+  int i, k;
+  if (NULL==part)
+    return 0;
+  for(k=0;k<part->nkey;++k){
+    if (MU_KEY_OTHER==part->keytype[k])
+      return 0;
+    for(i=0;i<p->ngroup;++i){
+      int len = p->group_b[i]-p->group_a[i];
+      if ((len>0) && (mu_tk_column(t, p->group_a[i], p->group_b[i], part->keycol[k], part->tablename, alias)==len))
+	break;
     }
-    int shardc = mu_getcoreshardc(icore, conf->ncores, conf->shardc);
-    const char **shardv = mu_getcoreshardv(icore, conf->ncores, conf->shardc, conf->shardv);
+    if (i==p->ngroup)
+      return 0;
+  }
+  return 1;
+}
 
-    if (NULL==shardv){
-      MU_FREE_Q();
-      return NULL;
+static int mu_strbuf_add_quoted_id(struct mu_STRBUF *out, const char *s, int n);
+
+/* a bare name naming a quoted alias such as 'x' or "x" */
+static int is_mu_tk_alias(const struct mu_TOKEN *name, const struct mu_TOKEN *alias){
+  return (MU_TK_WORD==name->type) && ((MU_TK_STRING==alias->type) || (MU_TK_ID==alias->type)) &&
+    (alias->n==name->n+2) && (0==strncasecmp(alias->s+1, name->s, name->n));
+}
+
+/* For a reduce that only orders and limits maptable, writes the map's select list to mapitems, the reduce's
+ * "select ... from maptable" to reduce and its order by terms to order.  A term repeating a select item or
+ * its alias becomes the item's ordinal.  Any other term but an ordinal may name columns the map does not
+ * select, so unless the items include * the map also computes it as mu_oN, and the reduce lists the item
+ * columns by name so that mu_oN is not in the result. */
+static int mu_plan_order(const struct mu_PLAN *p, const int *at, int nitems, struct mu_STRBUF *mapitems, struct mu_STRBUF *reduce, struct mu_STRBUF *order){
+  const struct mu_SELECT *sel = &(p->sel);
+  const struct mu_TOKENS *t = &(sel->t);
+  struct mu_STRBUF extra = { NULL, 0, 0 };
+  int oat[MU_PLAN_MAX+1];
+  int nterm = (sel->order_a<sel->order_b)? mu_tk_split(t, sel->order_a, sel->order_b, ",", oat, MU_PLAN_MAX): 0;
+  int star = 0;
+  int nextra = 0;
+  int bad = (nterm<0);
+  int i, k;
+  char col[32];
+  for(k=0;k<nitems;++k){
+    int n = at[k+1]-1-at[k];
+    const struct mu_TOKEN *tk = &t->v[at[k]];
+    star = star || ((1==n) && is_mu_tk(tk, "*")) || ((3==n) && is_mu_tk(tk+1, ".") && is_mu_tk(tk+2, "*"));
+  }
+  for(i=0; (i<nterm) && (!bad); ++i){
+    int a = oat[i];
+    int b = oat[i+1]-1;
+    int e;
+    for(e=a; (e<b) && (!is_mu_tk(&t->v[e], "asc")) && (!is_mu_tk(&t->v[e], "desc")) &&
+	  (!is_mu_tk(&t->v[e], "collate")) && (!is_mu_tk(&t->v[e], "nulls")); ++e)
+      ;
+    for(k=0;k<nitems;++k){
+      int ie, ialias, j;
+      mu_plan_alias(t, at[k], at[k+1]-1, &ie, &ialias);
+      for(j=0; (j<e-a) && (at[k]+j<ie) && is_mu_tk_equal(&t->v[a+j], &t->v[at[k]+j]); ++j)
+	;
+      if ((j==e-a) && (at[k]+j==ie))
+	break;
+      if ((e==a+1) && (ialias<at[k+1]-1) && (is_mu_tk_equal(&t->v[a], &t->v[ialias]) || is_mu_tk_alias(&t->v[a], &t->v[ialias])))
+	break;
     }
-    int makestatus = mu_makeQueryCoreFile(conf,
-					  mapsql_task[icore]->iname,
-					  mapsql_task[icore]->dbname,
-					  shardc,
-					  shardv,
-					  mapsql);
-    free(shardv);
-    if (makestatus){
-      MU_FREE_Q();
-      return NULL;
+    bad = mu_strbuf_adds(order, (i)? ", ": "");
+    if (k<nitems){
+      snprintf(col, sizeof(col), "%d", k+1);
+      bad = bad || mu_strbuf_adds(order, col);
+    } else if ((star) || ((e==a+1) && (MU_TK_NUMBER==t->v[a].type))){
+      bad = bad || mu_strbuf_add_tokens(order, t, a, e);
+    } else {
+      snprintf(col, sizeof(col), " as mu_o%d", ++nextra);
+      bad = bad || mu_strbuf_adds(&extra, ", ") || mu_strbuf_add_tokens(&extra, t, a, e) || mu_strbuf_adds(&extra, col) ||
+	mu_strbuf_adds(order, col+4);
     }
-    if (mu_start_task(mapsql_task[icore], errormsg_on_start)){
-      MU_FREE_Q();
-      return NULL;
+    bad = bad || ((e<b) && (mu_strbuf_adds(order, " ") || mu_strbuf_add_tokens(order, t, e, b)));
+  }
+  if ((!bad) && (0==nextra))
+    bad = mu_strbuf_add_tokens(mapitems, t, sel->items_a, sel->items_b) ||
+      mu_strbuf_adds(reduce, "select * from maptable");
+  else if (!bad){
+    bad = mu_strbuf_adds(reduce, "select ");
+    for(k=0; (k<nitems) && (!bad); ++k){
+      struct mu_STRBUF name = { NULL, 0, 0 };
+      int ie, ialias;
+      mu_plan_alias(t, at[k], at[k+1]-1, &ie, &ialias);
+      const struct mu_TOKEN *tk = &t->v[ialias];
+      if (ialias==at[k+1]-1)
+	bad = mu_strbuf_add_quoted_id(&name, t->v[at[k]].s, (int) ((t->v[ie-1].s+t->v[ie-1].n) - t->v[at[k]].s));
+      else if (MU_TK_STRING==tk->type)
+	bad = mu_strbuf_add_quoted_id(&name, tk->s+1, tk->n-2);
+      else
+	bad = mu_strbuf_add_tokens(&name, t, ialias, at[k+1]-1);
+      bad = bad ||
+	((k) && (mu_strbuf_adds(mapitems, ", ") || mu_strbuf_adds(reduce, ", "))) ||
+	mu_strbuf_add_tokens(mapitems, t, at[k], ie) || mu_strbuf_adds(mapitems, " as ") || mu_strbuf_adds(mapitems, name.s) ||
+	mu_strbuf_adds(reduce, name.s);
+      free(name.s);
     }
+    bad = bad || mu_strbuf_adds(mapitems, extra.s) || mu_strbuf_adds(reduce, " from maptable");
   }
+  free(extra.s);
+  return (bad)? -1: 0;
+}
 
-  char *result = NULL;
+static int mu_strbuf_add_quoted_id(struct mu_STRBUF *out, const char *s, int n){
+  int i;
+  if (mu_strbuf_add(out, "\"", 1))
+    return -1;
+  for(i=0;i<n;++i){
+    if (('"'==s[i]) && mu_strbuf_add(out, "\"", 1))
+      return -1;
+    if (mu_strbuf_add(out, s+i, 1))
+      return -1;
+  }
+  return mu_strbuf_add(out, "\"", 1);
+}
 
-  if (reducesql){
-    int reducer_status=0;
-    reducef = mu_fopen(rname, "w");
-    if (NULL==reducef){
-      MU_FREE_Q();
-      return NULL;
+static void mu_free_plan(struct mu_PLAN *p){
+  int i;
+  for(i=0;i<p->npartial;++i)
+    free(p->partial[i]);
+  sqlite3_finalize(p->isagg);
+  sqlite3_close(p->db);
+  mu_free_select(&(p->sel));
+}
+
+struct mu_QUERY * mu_plan_query(struct mu_DBCONF *conf, const char *selectsql_or_fname){
+  const char *sql = mu_dup_sql_or_read_file(selectsql_or_fname);
+  if (NULL==sql){
+    MU_WARN("%s\n", "Error: the query planner did not receive a select statement.");
+    return NULL;
+  }
+  struct mu_PLAN *p = calloc(1, sizeof(struct mu_PLAN));
+  if (NULL==p){
+    MU_WARN_OOM();
+    free((void *) sql);
+    return NULL;
+  }
+  struct mu_STRBUF mapsql = { NULL, 0, 0 };
+  struct mu_STRBUF createsql = { NULL, 0, 0 };
+  struct mu_STRBUF reducesql = { NULL, 0, 0 };
+  struct mu_STRBUF items = { NULL, 0, 0 };
+  struct mu_QUERY *q = NULL;
+  int at[MU_PLAN_MAX+1];
+  int nitems = 0;
+  int status = mu_parse_select(sql, &(p->sel), 0);
+  struct mu_SELECT *sel = &(p->sel);
+  struct mu_TOKENS *t = &(sel->t);
+  int i;
+  char col[64];
+
+  if (0==status){
+    nitems = mu_tk_split(t, sel->items_a, sel->items_b, ",", at, MU_PLAN_MAX);
+    if (nitems<=0){
+      MU_WARN("%s\n", "Error: the query planner could not read the select list.");
+      status = -1;
     }
-    MU_PRINTBUF("%s\n", reducesql);
-    if (cursor>bufsize){
-      MU_WARN("%s\n", "An unusual error occurred.  The map query may have begun processing, but the reduce query was not processed.");
-      MU_FREE_Q();
-      return NULL;
+  }
+
+  /* group by terms may be ordinals or aliases of select items */
+  if ((0==status) && (sel->group_a<sel->group_b)){
+    int gat[MU_PLAN_MAX+1];
+    p->ngroup = mu_tk_split(t, sel->group_a, sel->group_b, ",", gat, MU_PLAN_MAX);
+    if (p->ngroup<=0){
+      MU_WARN("%s\n", "Error: the query planner could not read the group by clause.");
+      status = -1;
     }
-    int written = fputs(buf, reducef);
-    if (written<=0){
-      MU_WARN_FNAME(rname);
-      MU_WARN_IF_ERRNO();
-      MU_FREE_Q();
-      return NULL;
+    for(i=0; (i<p->ngroup) && (0==status); ++i){
+      int a = gat[i];
+      int b = gat[i+1]-1;
+      p->group_a[i] = a;
+      p->group_b[i] = b;
+      if (b-a!=1)
+	continue;
+      int k;
+      if (MU_TK_NUMBER==t->v[a].type){
+	k = atoi(t->v[a].s)-1;
+	if ((k<0) || (k>=nitems)){
+	  MU_WARN("Error: group by %.*s is not a select item\n", t->v[a].n, t->v[a].s);
+	  status = -1;
+	  break;
+	}
+      } else {
+	for(k=0;k<nitems;++k){
+	  int e, alias;
+	  mu_plan_alias(t, at[k], at[k+1]-1, &e, &alias);
+	  if ((alias<at[k+1]-1) && is_mu_tk_equal(&t->v[alias], &t->v[a]))
+	    break;
+	}
+	if (k==nitems)
+	  continue;
+      }
+      int e, alias;
+      mu_plan_alias(t, at[k], at[k+1]-1, &e, &alias);
+      p->group_a[i] = at[k];
+      p->group_b[i] = e;
     }
-    MU_FCLOSE_W(rname, NULL, reducef);
   }
 
-  // wait for workers
+  struct mu_STRBUF order = { NULL, 0, 0 };
+  struct mu_STRBUF mapitems = { NULL, 0, 0 };
+  int mapside = (0==status) && is_mu_plan_mapside(conf, p);
 
-  for(icore=0;icore<conf->ncores;++icore){
-    if (mu_finish_task(mapsql_task[icore], errormsg_on_finish_map)){
-      MU_FREE_Q();
-      return NULL;
+  /* reduce side select list, which also collects the partials the map must compute */
+  for(i=0; (i<nitems) && (0==status) && (!mapside); ++i){
+    int e, alias;
+    mu_plan_alias(t, at[i], at[i+1]-1, &e, &alias);
+    if (i>0)
+      status = mu_strbuf_adds(&items, ", ");
+    if (0==status)
+      status = mu_plan_rewrite(p, at[i], e, &items);
+    if (0==status)
+      status = mu_strbuf_adds(&items, " as ");
+    if (0==status){
+      if (alias<at[i+1]-1)
+	status = mu_strbuf_add_tokens(&items, t, alias, at[i+1]-1);
+      else
+	status = mu_strbuf_add_quoted_id(&items, t->v[at[i]].s, (int) ((t->v[e-1].s+t->v[e-1].n) - t->v[at[i]].s));
     }
   }
-  if (reducesql){
-    if (mu_start_task(reducesql_task, errormsg_on_start)){
-      MU_FREE_Q();
-      return NULL;
+
+  if ((0==status) && (mapside)){
+    status = mu_plan_order(p, at, nitems, &mapitems, &reducesql, &order) ||
+      mu_strbuf_adds(&mapsql, "select ") ||
+      mu_strbuf_adds(&mapsql, mapitems.s) ||
+      mu_strbuf_adds(&mapsql, " from ") ||
+      mu_strbuf_add_tokens(&mapsql, t, sel->from_a, sel->from_b);
+    if ((0==status) && (sel->where_a<sel->where_b))
+      status = mu_strbuf_adds(&mapsql, " where ") ||
+	mu_strbuf_add_tokens(&mapsql, t, sel->where_a, sel->where_b);
+    if (0==status)
+      status = mu_strbuf_adds(&mapsql, " group by ") ||
+	mu_strbuf_add_tokens(&mapsql, t, sel->group_a, sel->group_b);
+    if ((0==status) && (sel->having_a<sel->having_b))
+      status = mu_strbuf_adds(&mapsql, " having ") ||
+	mu_strbuf_add_tokens(&mapsql, t, sel->having_a, sel->having_b);
+    if (0==status)
+      status = mu_plan_topk(sel, &mapsql) ||
+	mu_strbuf_adds(&mapsql, ";");
+    if ((0==status) && (order.s))
+      status = mu_strbuf_adds(&reducesql, " order by ") ||
+	mu_strbuf_adds(&reducesql, order.s);
+  } else if ((0==status) && (0==p->nagg) && (0==p->ngroup)){
+    /* no aggregation: the map filters and projects, the reduce only orders and limits */
+    for(i=sel->order_a; (i+1<sel->order_b) && (0==status); ++i){
+      if (is_mu_tk(&t->v[i+1], "(") && is_mu_plan_other_aggregate(p, &t->v[i])){
+	MU_WARN("Error: the query planner can not split %.*s() across shards.  Write the map and reduce queries with -m and -r.\n", t->v[i].n, t->v[i].s);
+	status = -1;
+      }
     }
-    if (mu_finish_task(reducesql_task, errormsg_on_finish_reduce)){
-      MU_FREE_Q();
-      return NULL;
+    if (0==status)
+      status = mu_plan_order(p, at, nitems, &mapitems, &reducesql, &order) ||
+	mu_strbuf_adds(&mapsql, "select ") ||
+	mu_strbuf_adds(&mapsql, mapitems.s) ||
+	mu_strbuf_adds(&mapsql, " from ") ||
+	mu_strbuf_add_tokens(&mapsql, t, sel->from_a, sel->from_b);
+    if ((0==status) && (sel->where_a<sel->where_b))
+      status = mu_strbuf_adds(&mapsql, " where ") ||
+	mu_strbuf_add_tokens(&mapsql, t, sel->where_a, sel->where_b);
+    if (0==status)
+      status = mu_plan_topk(sel, &mapsql) ||
+	mu_strbuf_adds(&mapsql, ";");
+    if ((0==status) && (order.s))
+      status = mu_strbuf_adds(&reducesql, " order by ") ||
+	mu_strbuf_adds(&reducesql, order.s);
+  } else if (0==status){
+    status = mu_strbuf_adds(&mapsql, "select ");
+    for(i=0; (i<p->ngroup) && (0==status); ++i){
+      snprintf(col, sizeof(col), " as mu_g%d, ", i+1);
+      status = mu_strbuf_add_tokens(&mapsql, t, p->group_a[i], p->group_b[i]) ||
+	mu_strbuf_adds(&mapsql, col);
     }
-    result = mu_read_small_file(reducesql_task->oname);
+    /* having and order by may introduce further partials, so rewrite them before writing the map list */
+    struct mu_STRBUF tail = { NULL, 0, 0 };
+    if ((0==status) && (p->ngroup)){
+      status = mu_strbuf_adds(&tail, " group by ");
+      for(i=0; (i<p->ngroup) && (0==status); ++i){
+	snprintf(col, sizeof(col), (i)? ", mu_g%d": "mu_g%d", i+1);
+	status = mu_strbuf_adds(&tail, col);
+      }
+    }
+    if ((0==status) && (sel->having_a<sel->having_b))
+      status = mu_strbuf_adds(&tail, " having ") ||
+	mu_plan_rewrite(p, sel->having_a, sel->having_b, &tail);
+    if ((0==status) && (sel->order_a<sel->order_b))
+      status = mu_strbuf_adds(&tail, " order by ") ||
+	mu_plan_rewrite(p, sel->order_a, sel->order_b, &tail);
+    for(i=0; (i<p->npartial) && (0==status); ++i){
+      snprintf(col, sizeof(col), " as mu_p%d", i+1);
+      status = mu_strbuf_adds(&mapsql, (i)? ", ": "") ||
+	mu_strbuf_adds(&mapsql, p->partial[i]) ||
+	mu_strbuf_adds(&mapsql, col);
+    }
+    if ((0==status) && (0==p->npartial)){
+      /* group by without aggregates, drop the trailing comma */
+      mapsql.len -= 2;
+      mapsql.s[mapsql.len] = 0;
+    }
+    if (0==status)
+      status = mu_strbuf_adds(&mapsql, " from ") ||
+	mu_strbuf_add_tokens(&mapsql, t, sel->from_a, sel->from_b);
+    if ((0==status) && (sel->where_a<sel->where_b))
+      status = mu_strbuf_adds(&mapsql, " where ") ||
+	mu_strbuf_add_tokens(&mapsql, t, sel->where_a, sel->where_b);
+    if ((0==status) && (p->ngroup)){
+      status = mu_strbuf_adds(&mapsql, " group by ");
+      for(i=0; (i<p->ngroup) && (0==status); ++i)
+	status = mu_strbuf_adds(&mapsql, (i)? ", ": "") ||
+	  mu_strbuf_add_tokens(&mapsql, t, p->group_a[i], p->group_b[i]);
+    }
+    if (0==status)
+      status = mu_strbuf_adds(&mapsql, ";") ||
+	mu_strbuf_adds(&createsql, "create table maptable (");
+    for(i=0; (i<p->ngroup) && (0==status); ++i){
+      snprintf(col, sizeof(col), (i)? ", mu_g%d": "mu_g%d", i+1);
+      status = mu_strbuf_adds(&createsql, col);
+    }
+    for(i=0; (i<p->npartial) && (0==status); ++i){
+      snprintf(col, sizeof(col), ((i) || (p->ngroup))? ", mu_p%d": "mu_p%d", i+1);
+      status = mu_strbuf_adds(&createsql, col);
+    }
+    if (0==status)
+      status = mu_strbuf_adds(&createsql, ");") ||
+	mu_strbuf_adds(&reducesql, "select ") ||
+	mu_strbuf_adds(&reducesql, items.s) ||
+	mu_strbuf_adds(&reducesql, " from maptable") ||
+	((tail.s) && mu_strbuf_adds(&reducesql, tail.s));
+    free(tail.s);
   }
-  mu_remove_temp_dir(tmpdir);
-  MU_FREE_Q();
-  return result;
+  if ((0==status) && (sel->limit_a<sel->limit_b))
+    status = mu_strbuf_adds(&reducesql, " limit ") ||
+      mu_strbuf_add_tokens(&reducesql, t, sel->limit_a, sel->limit_b);
+  if (0==status)
+    status = mu_strbuf_adds(&reducesql, ";");
+
+  if (0==status){
+    q = mu_create_query(mapsql.s, createsql.s, reducesql.s);
+  }
+  free(mapsql.s);
+  free(createsql.s);
+  free(reducesql.s);
+  free(items.s);
+  free(order.s);
+  free(mapitems.s);
+  mu_free_plan(p);
+  free(p);
+  free((void *) sql);
+  return q;
+}
+
+
+
+static void mu_catalog_load(struct mu_DBCONF *c, const char *dbdir);
+static int mu_manifest_load(struct mu_DBCONF *c, const char *dbdir);
+static const char ** mu_shardv_block(size_t n, const char *prefix, const char *(*name)(const void *arg, size_t i), const void *arg);
+static const char * mu_wordv_name(const void *arg, size_t i);
+
+struct mu_DBCONF * mu_opendb(const char *dbdir){
+  typedef struct mu_DBCONF conftype;
+  if (NULL==dbdir){
+    MU_WARN("%s\n","Fatal: mu_opendb received a NULL instead of the /path/to/shards directory ");
+    return NULL;
+  }
+  struct mu_DBCONF * c = malloc(sizeof(conftype));
+  if (NULL==c)
+    return NULL;
+  c->db = NULL;
+  c->otablename = "maptable";
+  c->isopen = 0;
+  c->ncores = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if ((c->ncores<=0) || (c->ncores>255)){
+    /* number of cores not detected properly by sysconf.  This should not be fatal */
+    /* So we specify 2 cores in this situation and a developer can change it in the returned mu_DBCONF if they know better. */
+    c->ncores = 2;
+  }
+  c->shardc = 0;
+  c->shardv = NULL;
+  c->warm = NULL;
+  c->partition = NULL;
+  c->zonemap = NULL;
+  c->shardinfo = NULL;
+  c->isopen=0;
+  const char *engine = getenv("MULTICORE_ENGINE");
+  c->engine = ((engine) && (0==strcmp(engine,"threads")))? MU_ENGINE_THREADS: MU_ENGINE_PROCESS;
+  const char *cachedir = getenv("MULTICORE_CACHE");
+  c->cachedir = ((cachedir) && (*cachedir))? cachedir: NULL;
+  const char *cachemb = getenv("MULTICORE_CACHE_MB");
+  c->cachebytes = (long long) (1024.0*1024.0*((cachemb)? strtod(cachemb, NULL): 1024.0));
+  const char *agents = getenv("MULTICORE_AGENTS");
+  c->agents = ((agents) && (*agents))? agents: NULL;
+  const char *spillmb = getenv("MULTICORE_SPILL_MB");
+  c->spillbytes = (spillmb)? (long long) (1024.0*1024.0*strtod(spillmb, NULL)): 0;
+  const char *priority = getenv("MULTICORE_PRIORITY");
+  c->priority = ((priority) && (0==strcmp(priority,"low")))? MU_PRIORITY_LOW: MU_PRIORITY_NORMAL;
+  c->readonly = 0;
+  char *glob = mu_cat(dbdir,"/*");
+  if (NULL==glob)
+    return NULL;
+  if (mu_manifest_load(c, dbdir)){
+    wordexp_t p;
+    int flags = WRDE_NOCMD; // do not run commands in shells like "$(evil)"
+    int w = wordexp(glob, &p, flags);
+    /* a glob that matches nothing expands to itself, so a lone word must name an existing file */
+    if (w || (p.we_wordc<1) || ((p.we_wordc==1) && (access(p.we_wordv[0], F_OK))) ){
+      if (0==w) wordfree(&p);
+      MU_WARN("mu_opendb() failed to find any shard database files in %s\n", glob);
+      free(c);
+      return NULL;
+    }
+    c->shardc = p.we_wordc;
+    // fprintf(stderr,"found %zd shards \n",c->shardc);
+    c->shardv = mu_shardv_block(p.we_wordc, "", mu_wordv_name, p.we_wordv);
+    wordfree(&p);
+    if (NULL==c->shardv){
+      free(c);
+      return NULL;
+    }
+  }
+  // mark c as open if return values make sense
+  if ((c->shardc>0) &&
+      (c->shardv[0]) &&
+      (NULL==c->shardv[c->shardc])
+      ){
+        c->isopen=1;
+        if ((c->ncores)>(c->shardc)) c->ncores = c->shardc;  // can use at most shardc cores -- pragmatic fix for issue #1
+  }
+  free(glob);
+  if (c->isopen==0){
+    free(c);
+    MU_WARN("mu_opendb() failed to open the database directory %s.\nCheck that the directory is non-empty and contains at least 1 shard file. \n", dbdir);
+    return NULL;
+  }
+  mu_catalog_load(c, dbdir);
+  return c;
+}
+
+static int is_mu_select(const char *sqlstr){
+  size_t i=0;
+  const char space = ' ';
+  const char tab = '\t';
+  /* If the string is blank or all spaces/tabs the null-terminator will end this while loop */
+  while ( (space==sqlstr[i]) || (tab==sqlstr[i]) )
+    ++i;
+  return (('s'==sqlstr[i]) || ('S'==sqlstr[i]));
+}
+
+/* A select combinesql replaces a core's maptable with its result */
+static const char *mu_combine_select_fmt =
+  "create table mu_combined as %s;\n"
+  "drop table %s;\n"
+  "alter table mu_combined rename to %s;\n";
+
+static int mu_makeQueryCoreFile(struct mu_DBCONF * conf, const char *fname, const char *coredbname, int shardc, const char **shardv, const char *mapsql, const char *createtablesql, const char *combinesql){
+
+  int i;
+
+  if (NULL==conf) MU_WARN("%s\n","mu_makeQueryCoreFile detected conf==NULL");
+  if (NULL==fname) MU_WARN("%s\n","mu_makeQueryCoreFile detected fname==NULL");
+  if (0==shardc) MU_WARN("%s\n", "mu_makeQueryCoreFile detected shardc==0");
+  if (NULL==shardv) MU_WARN("%s\n","mu_makeQueryCoreFile detected shardv==NULL");
+  if (NULL==mapsql) MU_WARN("%s\n","mu_makeQueryCoreFile detected mapsql==NULL");
+
+  if ( (conf==NULL) || (fname==NULL) || (shardc==0) || (shardv==NULL) || (mapsql==NULL) || strlen(mapsql)==0 ){
+    MU_WARN("%s\n", "mu_makeQueryCoreFile detected one or more invalid or NULL required parameters");
+    return -1;
+  }
+
+  size_t bufsize = (1024+strlen(mapsql))*shardc+1024+
+    ((createtablesql)? (1024+strlen(createtablesql)): 0)+
+    ((combinesql)? (1024+strlen(combinesql)): 0);
+  size_t cursor = 0;
+  char *buf = malloc(bufsize);
+  if (NULL==buf){
+    MU_WARN_OOM();
+    return -1;
+  }
+
+
+  int is_select = is_mu_select(mapsql);
+
+  const char *exts = mu_sqlite3_extensions();
+
+  if ((createtablesql) && (is_select)){
+    MU_PRINTBUF(".open %s\n", coredbname);
+    MU_PRINTBUF("%s\n",".bail on");
+    MU_PRINTBUF("%s\n", createtablesql);
+  }
+
+  for(i=0;i<shardc;++i){
+    if (shardv[i]){
+      MU_PRINTBUF(".open %s\n", shardv[i]);
+      MU_PRINTBUF("%s\n",".bail on");
+      if (exts)
+	MU_PRINTBUF("%s\n", exts);
+      if (is_select){
+	MU_PRINTBUF("attach database '%s' as 'resultdb';\n", coredbname);
+	if ((i==0) && (NULL==createtablesql)){
+	  MU_PRINTBUF("create table resultdb.%s as %s\n",
+		  conf->otablename,
+		  mapsql);
+	} else {
+	  MU_PRINTBUF("insert into resultdb.%s %s\n",
+		  conf->otablename,
+		  mapsql);
+	}
+      } else {
+	/* mapsql is not a select statment */
+	MU_PRINTBUF("%s\n", mapsql);
+      }
+    }
+  }
+
+  if ((combinesql) && (is_select)){
+    MU_PRINTBUF(".open %s\n", coredbname);
+    MU_PRINTBUF("%s\n",".bail on");
+    if (exts)
+      MU_PRINTBUF("%s\n", exts);
+    if (is_mu_select(combinesql)){
+      MU_PRINTBUF(mu_combine_select_fmt, combinesql, conf->otablename, conf->otablename);
+    } else {
+      MU_PRINTBUF("%s\n", combinesql);
+    }
+  }
+
+  if (cursor>bufsize){
+    free(buf);
+    MU_WARN("%s\n", "Oops! A buffer overflow was prevented while constructing the command files derived from the map query.  Unfortunately that buffer ran out of space.  The query was not run.");
+    return -1;
+  }
+
+  FILE * qcfile = mu_fopen(fname,"w");
+  if (NULL==qcfile){
+    free(buf);
+    return -1;
+  }
+  int bytes_written = fputs(buf, qcfile);
+  free(buf);
+  if (bytes_written<0){
+    MU_WARN_FNAME(fname);
+    MU_WARN_IF_ERRNO();
+    return -1;
+  }
+  MU_FCLOSE_W(fname, -1, qcfile);
+  return 0;
+}
+
+/* In-process engine.  Each map worker is a thread that opens each of its shards
+ * in turn with libsqlite3, exactly as ".open" would in the sqlite3 shell, attaches its
+ * core's result database as resultdb and runs the map query into resultdb.maptable.
+ * The calling thread collects each core's results as it finishes and runs the reduce.
+ * Nothing is forked, no command files are written, and no query output is
+ * round-tripped through text files.
+ */
+
+static int is_mu_dot_free(const char *sql){
+  /* libsqlite3 does not understand the sqlite3 shell's dot commands such as .mode */
+  const char *p = sql;
+  while ((p) && (*p)){
+    while ((' '==*p) || ('\t'==*p) || ('\r'==*p))
+      ++p;
+    if ('.'==*p)
+      return 0;
+    p = strchr(p, '\n');
+    if (p)
+      ++p;
+  }
+  return 1;
+}
+
+static int mu_load_extensions(sqlite3 *db){
+  const char *extensions = getenv("MULTICORE_SQLITE3_EXTENSIONS");
+  if (NULL==extensions)
+    return 0;
+  char *e = strdup(extensions);
+  if (NULL==e){
+    MU_WARN_OOM();
+    return -1;
+  }
+  sqlite3_db_config(db, SQLITE_DBCONFIG_ENABLE_LOAD_EXTENSION, 1, NULL);
+  int status = 0;
+  char *save = NULL;
+  char *tok = strtok_r(e, " ", &save);
+  while (tok){
+    char *errmsg = NULL;
+    if (sqlite3_load_extension(db, tok, NULL, &errmsg)!=SQLITE_OK){
+      MU_WARN("Could not load sqlite3 extension %s\n%s\n", tok, (errmsg)? errmsg: "");
+      sqlite3_free(errmsg);
+      status = -1;
+      break;
+    }
+    tok = strtok_r(NULL, " ", &save);
+  }
+  free(e);
+  return status;
+}
+
+static sqlite3 * mu_sqlite3_open(const char *dbname){
+  sqlite3 *db = NULL;
+  /* a connection is only ever used by one thread at a time, so sqlite3's own per-call locking is not needed */
+  int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI | SQLITE_OPEN_NOMUTEX;
+  if (sqlite3_open_v2(dbname, &db, flags, NULL)!=SQLITE_OK){
+    MU_WARN("Could not open sqlite3 database %s\n", dbname);
+    MU_WARN("%s\n", (db)? sqlite3_errmsg(db): mu_error_oom);
+    sqlite3_close(db);
+    return NULL;
+  }
+  if (mu_load_extensions(db)){
+    sqlite3_close(db);
+    return NULL;
+  }
+  return db;
+}
+
+/* opens a shard, through a read only uri when conf->readonly; other databases attached to it stay writable */
+static sqlite3 * mu_shard_open(const struct mu_DBCONF *conf, const char *shard){
+  if (!conf->readonly)
+    return mu_sqlite3_open(shard);
+  struct mu_STRBUF uri = { NULL, 0, 0 };
+  const char *p;
+  int failed = mu_strbuf_adds(&uri, "file:");
+  for(p=shard; (*p) && (!failed); ++p){
+    char hex[4];
+    snprintf(hex, sizeof(hex), "%%%02X", (unsigned char) *p);
+    failed = ((('%'==*p) || ('?'==*p) || ('#'==*p))? mu_strbuf_adds(&uri, hex): mu_strbuf_add(&uri, p, 1));
+  }
+  failed = failed || mu_strbuf_adds(&uri, "?mode=ro");
+  sqlite3 *db = (failed)? NULL: mu_sqlite3_open(uri.s);
+  free(uri.s);
+  return db;
+}
+
+static int mu_sqlite3_exec(sqlite3 *db, const char *sql){
+  char *errmsg = NULL;
+  if (sqlite3_exec(db, sql, NULL, NULL, &errmsg)!=SQLITE_OK){
+    MU_WARN("sqlite3 reported this error:\n%s\n", (errmsg)? errmsg: sqlite3_errmsg(db));
+    sqlite3_free(errmsg);
+    return -1;
+  }
+  return 0;
+}
+
+static int mu_sqlite3_execf(sqlite3 *db, const char *fmt, ...){
+  va_list ap;
+  va_start(ap, fmt);
+  char *sql = sqlite3_vmprintf(fmt, ap);
+  va_end(ap);
+  if (NULL==sql){
+    MU_WARN_OOM();
+    return -1;
+  }
+  int status = mu_sqlite3_exec(db, sql);
+  sqlite3_free(sql);
+  return status;
+}
+
+/* mu_stmt_columns hands sqlite3's column type codes straight to row callbacks */
+#if (MU_INTEGER!=SQLITE_INTEGER) || (MU_FLOAT!=SQLITE_FLOAT) || (MU_TEXT!=SQLITE_TEXT) || (MU_BLOB!=SQLITE_BLOB) || (MU_NULL!=SQLITE_NULL)
+#error "mu_COLUMN types must be numbered as sqlite3 numbers them"
+#endif
+
+/* fills colv with the ncol values of the current row of stmt, starting at column first */
+static void mu_stmt_columns(sqlite3_stmt *stmt, int first, int ncol, struct mu_COLUMN *colv){
+  int i;
+  for(i=0;i<ncol;++i){
+    struct mu_COLUMN *c = &colv[i];
+    c->type = sqlite3_column_type(stmt, first+i);
+    c->s = NULL;
+    c->n = 0;
+    if (MU_INTEGER==c->type)
+      c->i = sqlite3_column_int64(stmt, first+i);
+    else if (MU_FLOAT==c->type)
+      c->d = sqlite3_column_double(stmt, first+i);
+    else if (MU_TEXT==c->type)
+      c->s = (const char *) sqlite3_column_text(stmt, first+i);
+    else if (MU_BLOB==c->type)
+      c->s = (const char *) sqlite3_column_blob(stmt, first+i);
+    if (c->s)
+      c->n = (size_t) sqlite3_column_bytes(stmt, first+i);
+  }
+}
+
+/* runs sql, passing each row of every statement to cb, and returns 0, -1 on error, or the nonzero value of cb that stopped it */
+static int mu_sqlite3_exec_rows(sqlite3 *db, const char *sql, mu_ROW_CALLBACK cb, void *ctx){
+  const char *tail = sql;
+  while ((tail) && (*tail)){
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, tail, -1, &stmt, &tail)!=SQLITE_OK){
+      MU_WARN("sqlite3 reported this error:\n%s\n", sqlite3_errmsg(db));
+      return -1;
+    }
+    if (NULL==stmt)
+      continue; /* whitespace or comment */
+    int ncol = sqlite3_column_count(stmt);
+    struct mu_COLUMN *colv = calloc((ncol)? ncol: 1, sizeof(struct mu_COLUMN));
+    if (NULL==colv){
+      MU_WARN_OOM();
+      sqlite3_finalize(stmt);
+      return -1;
+    }
+    int i;
+    for(i=0;i<ncol;++i)
+      colv[i].name = sqlite3_column_name(stmt, i);
+    int rc;
+    int stop = 0;
+    while ((0==stop) && ((rc = sqlite3_step(stmt))==SQLITE_ROW)){
+      mu_stmt_columns(stmt, 0, ncol, colv);
+      stop = cb(ctx, ncol, colv);
+    }
+    free(colv);
+    if (stop){
+      sqlite3_finalize(stmt);
+      return stop;
+    }
+    if (rc!=SQLITE_DONE){
+      MU_WARN("sqlite3 reported this error:\n%s\n", sqlite3_errmsg(db));
+      sqlite3_finalize(stmt);
+      return -1;
+    }
+    sqlite3_finalize(stmt);
+  }
+  return 0;
+}
+
+/* a value as the sqlite3 shell lists it, in buf unless it is text or a blob */
+static const char * mu_column_text(const struct mu_COLUMN *c, char *buf, int bufsize, size_t *n){
+  const char *v = buf;
+  if (MU_INTEGER==c->type)
+    sqlite3_snprintf(bufsize, buf, "%lld", c->i);
+  else if (MU_FLOAT==c->type)
+    sqlite3_snprintf(bufsize, buf, "%!.15g", c->d);
+  else if (c->s)
+    v = c->s;
+  else
+    buf[0] = 0;
+  *n = (v==buf)? strlen(buf): c->n;
+  return v;
+}
+
+/* mu_ROW_CALLBACK collecting rows, separated by '|', in the mu_STRBUF ctx */
+static int mu_text_row(void *ctx, int ncol, const struct mu_COLUMN *colv){
+  struct mu_STRBUF *out = (struct mu_STRBUF *) ctx;
+  char buf[64];
+  int i;
+  for(i=0;i<ncol;++i){
+    size_t n;
+    const char *v = mu_column_text(&colv[i], buf, sizeof(buf), &n);
+    if ( ((i>0) && mu_strbuf_add(out, "|", 1)) || mu_strbuf_add(out, v, n) )
+      return -1;
+  }
+  return mu_strbuf_add(out, "\n", 1);
+}
+
+int mu_print_row(void *file, int ncol, const struct mu_COLUMN *colv){
+  FILE *f = (FILE *) file;
+  char buf[64];
+  int i;
+  for(i=0;i<ncol;++i){
+    size_t n;
+    const char *v = mu_column_text(&colv[i], buf, sizeof(buf), &n);
+    if ( ((i>0) && (EOF==putc('|', f))) || (n!=fwrite(v, 1, n, f)) ){
+      MU_WARN("mu_print_row() could not write a row\n");
+      MU_WARN_IF_ERRNO();
+      return -1;
+    }
+  }
+  if (EOF==putc('\n', f)){
+    MU_WARN("mu_print_row() could not write a row\n");
+    MU_WARN_IF_ERRNO();
+    return -1;
+  }
+  return 0;
+}
+
+/* runs fn(arg, i) for every shard i<n on up to ncores threads, each taking the next shard as it finishes one.
+ * returns -1, after copying the threads' warnings here, if any call did */
+struct mu_EACH {
+  pthread_mutex_t lock;
+  size_t n;
+  size_t next;
+  int (*fn)(void *arg, size_t i);
+  void *arg;
+  volatile int failed;
+};
+
+static void * mu_each_worker(void *p){
+  struct mu_EACH *e = (struct mu_EACH *) p;
+  while (!e->failed){
+    pthread_mutex_lock(&(e->lock));
+    size_t i = e->next++;
+    pthread_mutex_unlock(&(e->lock));
+    if (i>=e->n)
+      break;
+    if (e->fn(e->arg, i))
+      e->failed = 1;
+  }
+  char *errs = (mu_error_string())? strdup(mu_error_string()): NULL;
+  mu_error_clear();
+  return errs;
+}
+
+static int mu_each_shard(size_t n, int ncores, int (*fn)(void *arg, size_t i), void *arg){
+  struct mu_EACH e = { .n = n, .next = 0, .fn = fn, .arg = arg, .failed = 0 };
+  pthread_t tid[(ncores>0)? ncores: 1];
+  int started;
+  pthread_mutex_init(&(e.lock), NULL);
+  for(started=0; started<ncores; ++started){
+    if (pthread_create(&tid[started], NULL, mu_each_worker, &e))
+      break;
+  }
+  if (0==started)
+    free(mu_each_worker(&e));
+  while (started>0){
+    void *errs = NULL;
+    pthread_join(tid[--started], &errs);
+    if (errs)
+      MU_WARN("%s", (char *) errs);
+    free(errs);
+  }
+  pthread_mutex_destroy(&(e.lock));
+  return (e.failed)? -1: 0;
+}
+
+/* The manifest lists the shards of a directory with what the scheduler and     */
+/* planner want to know of each, so mu_opendb() reads one file instead of the   */
+/* directory.  It is written by the shard builders, after the shards, as:       */
+/*   struct mu_MANIFEST_HEADER, then count entries, then the shard file names,  */
+/*   each ending in a NUL, in native byte order.                                */
+/* A directory without a manifest, or with one that does not parse, is globbed. */
+
+static const char *mu_manifest_name = ".multicoresql.manifest";
+
+#define MU_MANIFEST_MAGIC "MUSHARD1"
+
+struct mu_MANIFEST_HEADER {
+  char magic[8];
+  uint64_t count;
+  uint64_t namebytes;
+};
+
+struct mu_MANIFEST_ENTRY {
+  int64_t bytes;
+  int64_t rows;
+  uint64_t schemahash;
+  int64_t mtime;
+  uint64_t name; /* offset of the name after the entries */
+};
+
+static sqlite3_int64 mu_mtime_ns(const struct stat *fstats){
+  return ((sqlite3_int64) fstats->st_mtim.tv_sec)*1000000000+fstats->st_mtim.tv_nsec;
+}
+
+/* one allocation holding n+1 pointers followed by the strings prefix+name[i], so free() releases all of it */
+static const char ** mu_shardv_block(size_t n, const char *prefix, const char *(*name)(const void *arg, size_t i), const void *arg){
+  size_t plen = strlen(prefix);
+  size_t total = (n+1)*sizeof(char *);
+  size_t i;
+  for(i=0;i<n;++i)
+    total += plen+strlen(name(arg, i))+1;
+  char **v = malloc(total);
+  if (NULL==v){
+    MU_WARN_OOM();
+    return NULL;
+  }
+  char *p = (char *) (v+n+1);
+  for(i=0;i<n;++i){
+    const char *s = name(arg, i);
+    size_t len = strlen(s);
+    v[i] = p;
+    memcpy(p, prefix, plen);
+    memcpy(p+plen, s, len+1);
+    p += plen+len+1;
+  }
+  v[n] = NULL;
+  return (const char **) v;
+}
+
+static const char * mu_wordv_name(const void *arg, size_t i){
+  return ((char * const *) arg)[i];
+}
+
+static const char * mu_manifest_entry_name(const void *arg, size_t i){
+  const struct mu_MANIFEST_HEADER *h = (const struct mu_MANIFEST_HEADER *) arg;
+  const struct mu_MANIFEST_ENTRY *e = (const struct mu_MANIFEST_ENTRY *) (h+1);
+  return ((const char *) (e+h->count))+e[i].name;
+}
+
+/* fills c->shardc, c->shardv and c->shardinfo from the manifest of dbdir.  returns 0 on success */
+static int mu_manifest_load(struct mu_DBCONF *c, const char *dbdir){
+  char *fname = sqlite3_mprintf("%s/%s", dbdir, mu_manifest_name);
+  int fd = (fname)? open(fname, O_RDONLY): -1;
+  sqlite3_free(fname);
+  struct stat fstats;
+  if ((fd<0) || fstat(fd, &fstats) || ((size_t) fstats.st_size<sizeof(struct mu_MANIFEST_HEADER))){
+    if (fd>=0)
+      close(fd);
+    return -1;
+  }
+  size_t size = (size_t) fstats.st_size;
+  const struct mu_MANIFEST_HEADER *h = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (MAP_FAILED==h)
+    return -1;
+  const struct mu_MANIFEST_ENTRY *e = (const struct mu_MANIFEST_ENTRY *) (h+1);
+  const char *names = (const char *) (e+h->count);
+  int ok = (0==memcmp(h->magic, MU_MANIFEST_MAGIC, sizeof(h->magic))) &&
+    (h->count>0) && (h->count<(size/sizeof(struct mu_MANIFEST_ENTRY))) &&
+    (size==sizeof(*h)+h->count*sizeof(*e)+h->namebytes) &&
+    (h->namebytes>0) && (0==names[h->namebytes-1]);
+  size_t i;
+  for(i=0; (ok) && (i<h->count); ++i)
+    ok = (e[i].name<h->namebytes);
+  char *prefix = (ok)? sqlite3_mprintf("%s/", dbdir): NULL;
+  c->shardinfo = (prefix)? malloc(h->count*sizeof(struct mu_SHARDINFO)): NULL;
+  c->shardv = (c->shardinfo)? mu_shardv_block(h->count, prefix, mu_manifest_entry_name, h): NULL;
+  if (c->shardv){
+    c->shardc = h->count;
+    for(i=0;i<h->count;++i){
+      c->shardinfo[i].bytes = e[i].bytes;
+      c->shardinfo[i].rows = e[i].rows;
+      c->shardinfo[i].schemahash = e[i].schemahash;
+      c->shardinfo[i].mtime = e[i].mtime;
+    }
+  } else {
+    free(c->shardinfo);
+    c->shardinfo = NULL;
+  }
+  sqlite3_free(prefix);
+  munmap((void *) h, size);
+  return (c->shardv)? 0: -1;
+}
+
+static void mu_manifest_forget(const char *dbdir){
+  char *fname = sqlite3_mprintf("%s/%s", dbdir, mu_manifest_name);
+  if (fname)
+    unlink(fname);
+  sqlite3_free(fname);
+}
+
+static void mu_free_partition(struct mu_PARTITION *part);
+static void mu_free_zonemap(struct mu_ZONEMAP *zm);
+
+static void mu_free_dbconf(struct mu_DBCONF *c){
+  if (c){
+    free((void *) c->shardv);
+    free(c->shardinfo);
+    mu_free_partition(c->partition);
+    mu_free_zonemap(c->zonemap);
+    free(c);
+  }
+}
+
+struct mu_MANIFEST_SCAN {
+  const char **shardv;
+  struct mu_SHARDINFO *info;
+};
+
+static int mu_manifest_scan(void *arg, size_t i){
+  struct mu_MANIFEST_SCAN *ms = (struct mu_MANIFEST_SCAN *) arg;
+  struct mu_SHARDINFO *info = &(ms->info[i]);
+  struct stat fstats;
+  sqlite3_stmt *stmt = NULL;
+  sqlite3 *db = (stat(ms->shardv[i], &fstats))? NULL: mu_sqlite3_open(ms->shardv[i]);
+  struct mu_STRBUF count = { NULL, 0, 0 };
+  int ok = (db) && (sqlite3_prepare_v2(db, "select type, name, sql from sqlite_master order by type, name;", -1, &stmt, NULL)==SQLITE_OK);
+  uint64_t h = MU_FNV1A_BASIS;
+  int rc;
+  while ((ok) && ((rc = sqlite3_step(stmt))==SQLITE_ROW)){
+    int k;
+    for(k=0;k<3;++k)
+      h = mu_fnv1a(mu_fnv1a(h, (const char *) sqlite3_column_text(stmt, k), (size_t) sqlite3_column_bytes(stmt, k)), "\x1f", 1);
+    const char *name = (const char *) sqlite3_column_text(stmt, 1);
+    if ((0==strcmp((const char *) sqlite3_column_text(stmt, 0), "table")) && (strncmp(name, "sqlite_", 7))){
+      char *term = sqlite3_mprintf("%s(select count(*) from \"%w\")", (count.len)? "+": "select ", name);
+      ok = (NULL!=term) && (0==mu_strbuf_adds(&count, term));
+      sqlite3_free(term);
+    }
+  }
+  ok = (ok) && (SQLITE_DONE==rc);
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+  info->rows = 0;
+  if ((ok) && (count.len)){
+    ok = (sqlite3_prepare_v2(db, count.s, -1, &stmt, NULL)==SQLITE_OK) && (sqlite3_step(stmt)==SQLITE_ROW);
+    if (ok)
+      info->rows = sqlite3_column_int64(stmt, 0);
+  }
+  if (!ok){
+    MU_WARN("mu_write_manifest() could not read shard %s\n", ms->shardv[i]);
+    if (db)
+      MU_WARN("%s\n", sqlite3_errmsg(db));
+  } else {
+    info->bytes = (long long) fstats.st_size;
+    info->schemahash = h;
+    info->mtime = mu_mtime_ns(&fstats);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  free(count.s);
+  return (ok)? 0: -1;
+}
+
+int mu_write_manifest(const char *dbdir){
+  mu_manifest_forget(dbdir);
+  struct mu_DBCONF *conf = mu_opendb(dbdir);
+  if (NULL==conf)
+    return -1;
+  struct mu_MANIFEST_SCAN ms = { conf->shardv, calloc(conf->shardc, sizeof(struct mu_SHARDINFO)) };
+  int status = (ms.info)? mu_each_shard(conf->shardc, conf->ncores, mu_manifest_scan, &ms): -1;
+  char *tmpname = (status)? NULL: sqlite3_mprintf("%s/%s.tmp", dbdir, mu_manifest_name);
+  char *fname = (tmpname)? sqlite3_mprintf("%s/%s", dbdir, mu_manifest_name): NULL;
+  FILE *f = (fname)? mu_fopen(tmpname, "w"): NULL;
+  if (NULL==f)
+    status = -1;
+  if (0==status){
+    struct mu_MANIFEST_HEADER h;
+    memcpy(h.magic, MU_MANIFEST_MAGIC, sizeof(h.magic));
+    h.count = conf->shardc;
+    h.namebytes = 0;
+    size_t i;
+    for(i=0;i<conf->shardc;++i){
+      const char *base = strrchr(conf->shardv[i], '/');
+      h.namebytes += strlen((base)? base+1: conf->shardv[i])+1;
+    }
+    status = (1!=fwrite(&h, sizeof(h), 1, f));
+    uint64_t off = 0;
+    for(i=0; (i<conf->shardc) && (0==status); ++i){
+      const char *base = strrchr(conf->shardv[i], '/');
+      base = (base)? base+1: conf->shardv[i];
+      struct mu_MANIFEST_ENTRY e = { ms.info[i].bytes, ms.info[i].rows, ms.info[i].schemahash, ms.info[i].mtime, off };
+      status = (1!=fwrite(&e, sizeof(e), 1, f));
+      off += strlen(base)+1;
+    }
+    for(i=0; (i<conf->shardc) && (0==status); ++i){
+      const char *base = strrchr(conf->shardv[i], '/');
+      base = (base)? base+1: conf->shardv[i];
+      status = (1!=fwrite(base, strlen(base)+1, 1, f));
+    }
+    status = (fclose(f)) || (status) || rename(tmpname, fname);
+    if (status){
+      MU_WARN("mu_write_manifest() could not write %s\n", fname);
+      MU_WARN_IF_ERRNO();
+      unlink(tmpname);
+    }
+  }
+  sqlite3_free(tmpname);
+  sqlite3_free(fname);
+  free(ms.info);
+  mu_free_dbconf(conf);
+  return (status)? -1: 0;
+}
+
+/* The catalog is a sqlite3 database in the shard directory.  Its name begins */
+/* with a dot so mu_opendb() does not take it for a shard.                     */
+
+static const char *mu_catalog_name = ".multicoresql.catalog";
+
+static const char *mu_catalog_schema =
+  "create table if not exists mu_partition (tablename text primary key collate nocase, keycols text, keytypes text, hash text, shardc integer);"
+  "create table if not exists mu_zonemap (tablename text collate nocase, col text collate nocase, shard text, minv, maxv, nulls integer, nrows integer,"
+  " bytes integer, mtime integer, affinity text, collation text, primary key (tablename, col, shard));";
+
+static sqlite3 * mu_catalog_open(const char *dbdir, int create){
+  char *fname = sqlite3_mprintf("%s/%s", dbdir, mu_catalog_name);
+  if (NULL==fname){
+    MU_WARN_OOM();
+    return NULL;
+  }
+  sqlite3 *db = NULL;
+  struct stat fstats;
+  if ((create) || (0==stat(fname, &fstats))){
+    db = mu_sqlite3_open(fname);
+    if ((db) && mu_sqlite3_exec(db, mu_catalog_schema)){
+      sqlite3_close(db);
+      db = NULL;
+    }
+  }
+  sqlite3_free(fname);
+  return db;
+}
+
+static int mu_catalog_forget(const char *dbdir, const char *tablename){
+  mu_manifest_forget(dbdir);
+  sqlite3 *db = mu_catalog_open(dbdir, 0);
+  if (NULL==db)
+    return 0;
+  int status = mu_sqlite3_execf(db,
+				"delete from mu_partition where tablename=%Q;\n"
+				"delete from mu_zonemap where tablename=%Q;\n",
+				tablename, tablename);
+  sqlite3_close(db);
+  return status;
+}
+
+static int mu_catalog_save(const char *dbdir, const struct mu_PARTITION *part){
+  struct mu_STRBUF keycols = { NULL, 0, 0 };
+  int i;
+  int status = 0;
+  for(i=0; (i<part->nkey) && (0==status); ++i)
+    status = ((i) && mu_strbuf_adds(&keycols, ",")) || mu_strbuf_adds(&keycols, part->keycol[i]);
+  sqlite3 *db = (status)? NULL: mu_catalog_open(dbdir, 1);
+  if (NULL==db)
+    status = -1;
+  if (0==status)
+    status = mu_sqlite3_execf(db, "insert or replace into mu_partition values (%Q, %Q, %Q, 'fnv1a64-fmix64', %d);",
+			      part->tablename, keycols.s, part->keytype, part->shardc);
+  if (status)
+    MU_WARN("Could not record the partition key of table %s in the catalog of %s\n", part->tablename, dbdir);
+  sqlite3_close(db);
+  free(keycols.s);
+  return status;
+}
+
+static void mu_free_partition(struct mu_PARTITION *part){
+  while (part){
+    struct mu_PARTITION *next = part->next;
+    int i;
+    free(part->tablename);
+    for(i=0;i<part->nkey;++i)
+      free(part->keycol[i]);
+    free(part);
+    part = next;
+  }
+}
+
+static struct mu_PARTITION * mu_catalog_partitions(sqlite3 *db){
+  struct mu_PARTITION *list = NULL;
+  sqlite3_stmt *stmt = NULL;
+  const char *sql = "select tablename, keycols, keytypes, shardc from mu_partition where hash='fnv1a64-fmix64';";
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)==SQLITE_OK){
+    while (sqlite3_step(stmt)==SQLITE_ROW){
+      const char *tablename = (const char *) sqlite3_column_text(stmt, 0);
+      const char *keycols = (const char *) sqlite3_column_text(stmt, 1);
+      const char *keytypes = (const char *) sqlite3_column_text(stmt, 2);
+      struct mu_PARTITION *part = calloc(1, sizeof(struct mu_PARTITION));
+      if ((NULL==part) || (NULL==tablename) || (NULL==keycols) || (NULL==keytypes)){
+	free(part);
+	continue;
+      }
+      part->tablename = strdup(tablename);
+      part->shardc = sqlite3_column_int(stmt, 3);
+      char *cols = strdup(keycols);
+      char *save = NULL;
+      char *col = (cols)? strtok_r(cols, ",", &save): NULL;
+      while ((col) && (part->nkey<MU_KEY_MAX)){
+	part->keycol[part->nkey++] = strdup(col);
+	col = strtok_r(NULL, ",", &save);
+      }
+      free(cols);
+      snprintf(part->keytype, sizeof(part->keytype), "%s", keytypes);
+      part->next = list;
+      list = part;
+      if ((NULL==part->tablename) || (part->shardc<=0) || (0==part->nkey) || ((int) strlen(part->keytype)!=part->nkey)){
+	/* never route on an entry we could not read completely */
+	list = part->next;
+	part->next = NULL;
+	mu_free_partition(part);
+      }
+    }
+  }
+  sqlite3_finalize(stmt);
+  return list;
+}
+
+/* Zone maps.  For chosen columns the catalog keeps each shard's min, max, null count
+ * and row count, with the shard's size and modification time when they were taken.
+ * A shard that changed since is never left out on its old zone map.
+ */
+
+struct mu_VALUE {
+  int type; /* SQLITE_INTEGER, SQLITE_FLOAT or SQLITE_TEXT; anything else is never compared */
+  sqlite3_int64 i;
+  double d;
+  char *s;
+  size_t n;
+};
+
+struct mu_ZONE {
+  int known; /* the shard is unchanged since its zone map was taken */
+  struct mu_VALUE min, max;
+  sqlite3_int64 nulls, nrows;
+};
+
+struct mu_ZONEMAP {
+  char *tablename;
+  char *col;
+  char affinity; /* 'N' integer, real or numeric, 'T' text, 'B' blob or none */
+  int binary; /* the column compares text with the binary collation */
+  size_t shardc;
+  struct mu_ZONE *zone; /* one per shard of conf->shardv */
+  struct mu_ZONEMAP *next;
+};
+
+static void mu_free_zonemap(struct mu_ZONEMAP *zm){
+  while (zm){
+    struct mu_ZONEMAP *next = zm->next;
+    size_t i;
+    for(i=0; (zm->zone) && (i<zm->shardc); ++i){
+      free(zm->zone[i].min.s);
+      free(zm->zone[i].max.s);
+    }
+    free(zm->zone);
+    free(zm->tablename);
+    free(zm->col);
+    free(zm);
+    zm = next;
+  }
+}
+
+static void mu_value_column(struct mu_VALUE *v, sqlite3_stmt *stmt, int i){
+  v->type = sqlite3_column_type(stmt, i);
+  if (SQLITE_INTEGER==v->type)
+    v->i = sqlite3_column_int64(stmt, i);
+  else if (SQLITE_FLOAT==v->type)
+    v->d = sqlite3_column_double(stmt, i);
+  else if (SQLITE_TEXT==v->type){
+    v->n = (size_t) sqlite3_column_bytes(stmt, i);
+    v->s = malloc(v->n+1);
+    if (v->s)
+      memcpy(v->s, sqlite3_column_text(stmt, i), v->n+1);
+    else
+      v->type = SQLITE_NULL;
+  }
+}
+
+struct mu_SHARDNAME {
+  const char *base;
+  size_t idx;
+};
+
+static int mu_cmp_shardname(const void *a, const void *b){
+  return strcmp(((const struct mu_SHARDNAME *) a)->base, ((const struct mu_SHARDNAME *) b)->base);
+}
+
+static struct mu_ZONEMAP * mu_catalog_zonemaps(sqlite3 *db, struct mu_DBCONF *c){
+  struct mu_ZONEMAP *list = NULL;
+  struct mu_SHARDNAME *names = malloc(c->shardc*sizeof(struct mu_SHARDNAME));
+  sqlite3_stmt *stmt = NULL;
+  const char *sql =
+    "select tablename, col, shard, minv, maxv, nulls, nrows, bytes, mtime, affinity, collation"
+    " from mu_zonemap order by tablename, col;";
+  size_t i;
+  if (NULL==names)
+    return NULL;
+  for(i=0;i<c->shardc;++i){
+    const char *base = strrchr(c->shardv[i], '/');
+    names[i].base = (base)? base+1: c->shardv[i];
+    names[i].idx = i;
+  }
+  qsort(names, c->shardc, sizeof(struct mu_SHARDNAME), mu_cmp_shardname);
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)==SQLITE_OK){
+    while (sqlite3_step(stmt)==SQLITE_ROW){
+      const char *tablename = (const char *) sqlite3_column_text(stmt, 0);
+      const char *col = (const char *) sqlite3_column_text(stmt, 1);
+      const char *affinity = (const char *) sqlite3_column_text(stmt, 9);
+      const char *collation = (const char *) sqlite3_column_text(stmt, 10);
+      struct mu_SHARDNAME key = { (const char *) sqlite3_column_text(stmt, 2), 0 };
+      if ((NULL==tablename) || (NULL==col) || (NULL==key.base))
+	continue;
+      if ((NULL==list) || strcasecmp(list->tablename, tablename) || strcasecmp(list->col, col)){
+	struct mu_ZONEMAP *zm = calloc(1, sizeof(struct mu_ZONEMAP));
+	if (zm){
+	  zm->tablename = strdup(tablename);
+	  zm->col = strdup(col);
+	  zm->affinity = (affinity)? affinity[0]: 0;
+	  zm->binary = (NULL==collation) || (0==strcasecmp(collation, "binary"));
+	  zm->shardc = c->shardc;
+	  zm->zone = calloc(c->shardc, sizeof(struct mu_ZONE));
+	}
+	if ((NULL==zm) || (NULL==zm->tablename) || (NULL==zm->col) || (NULL==zm->zone)){
+	  mu_free_zonemap(zm);
+	  break;
+	}
+	zm->next = list;
+	list = zm;
+      }
+      struct mu_SHARDNAME *found = bsearch(&key, names, c->shardc, sizeof(struct mu_SHARDNAME), mu_cmp_shardname);
+      struct stat fstats;
+      if ((NULL==found) || stat(c->shardv[found->idx], &fstats) ||
+	  (sqlite3_column_int64(stmt, 8)!=mu_mtime_ns(&fstats)) ||
+	  (sqlite3_column_int64(stmt, 7)!=(sqlite3_int64) fstats.st_size))
+	continue;
+      struct mu_ZONE *z = &(list->zone[found->idx]);
+      mu_value_column(&(z->min), stmt, 3);
+      mu_value_column(&(z->max), stmt, 4);
+      z->nulls = sqlite3_column_int64(stmt, 5);
+      z->nrows = sqlite3_column_int64(stmt, 6);
+      z->known = 1;
+    }
+  }
+  sqlite3_finalize(stmt);
+  free(names);
+  return list;
+}
+
+/* reads the partitioned tables and zone maps of dbdir from its catalog.  A missing or unreadable catalog means none */
+static void mu_catalog_load(struct mu_DBCONF *c, const char *dbdir){
+  size_t cursor = mu_error_cursor;
+  sqlite3 *db = mu_catalog_open(dbdir, 0);
+  mu_error_cursor = cursor;
+  if (NULL==db)
+    return;
+  c->partition = mu_catalog_partitions(db);
+  c->zonemap = mu_catalog_zonemaps(db, c);
+  sqlite3_close(db);
+}
+
+struct mu_ZONESCAN {
+  const char **shardv;
+  const char *sql;
+  int ncol;
+  sqlite3_value **v; /* per shard: count(*), then min, max and count of each column */
+  sqlite3_int64 *bytes;
+  sqlite3_int64 *mtime;
+};
+
+static int mu_zonescan(void *arg, size_t i){
+  struct mu_ZONESCAN *zs = (struct mu_ZONESCAN *) arg;
+  int nv = 1+3*zs->ncol;
+  struct stat fstats;
+  sqlite3_stmt *stmt = NULL;
+  sqlite3 *db = (stat(zs->shardv[i], &fstats))? NULL: mu_sqlite3_open(zs->shardv[i]);
+  int ok = (db) && (sqlite3_prepare_v2(db, zs->sql, -1, &stmt, NULL)==SQLITE_OK) && (sqlite3_step(stmt)==SQLITE_ROW);
+  int k;
+  for(k=0; (ok) && (k<nv); ++k)
+    ok = (NULL!=(zs->v[i*nv+k] = sqlite3_value_dup(sqlite3_column_value(stmt, k))));
+  if (!ok){
+    MU_WARN("mu_index_shards() could not scan shard %s\n", zs->shardv[i]);
+    if (db)
+      MU_WARN("%s\n", sqlite3_errmsg(db));
+  } else {
+    zs->bytes[i] = (sqlite3_int64) fstats.st_size;
+    zs->mtime[i] = mu_mtime_ns(&fstats);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  return (ok)? 0: -1;
+}
+
+/* the affinity sqlite3 gives a column declared as decltype, as recorded in mu_zonemap */
+static const char * mu_affinity(const char *decltype){
+  if ((NULL==decltype) || (0==*decltype))
+    return "BLOB";
+  if (strcasestr(decltype, "int"))
+    return "NUMERIC";
+  if (strcasestr(decltype, "char") || strcasestr(decltype, "clob") || strcasestr(decltype, "text"))
+    return "TEXT";
+  if (strcasestr(decltype, "blob"))
+    return "BLOB";
+  return "NUMERIC";
+}
+
+int mu_index_shards(const char *dbdir, const char *tablename, const char *cols){
+  if ((NULL==dbdir) || (NULL==tablename) || (NULL==cols)){
+    MU_WARN("%s\n", "mu_index_shards() received a NULL shard directory, table name or column list");
+    return -1;
+  }
+  struct mu_DBCONF *conf = mu_opendb(dbdir);
+  if (NULL==conf)
+    return -1;
+  char *list = strdup(cols);
+  char **colv = calloc(strlen(cols)+1, sizeof(char *));
+  struct mu_STRBUF sql = { NULL, 0, 0 };
+  struct mu_ZONESCAN zs;
+  memset(&zs, 0, sizeof(zs));
+  int status = ((NULL==list) || (NULL==colv) || mu_strbuf_adds(&sql, "select count(*)"))? -1: 0;
+  if (status)
+    MU_WARN_OOM();
+  char *save = NULL;
+  char *col = (list)? strtok_r(list, ", ", &save): NULL;
+  while ((col) && (0==status)){
+    char *term = sqlite3_mprintf(", min(\"%w\"), max(\"%w\"), count(\"%w\")", col, col, col);
+    status = (NULL==term) || mu_strbuf_adds(&sql, term);
+    sqlite3_free(term);
+    colv[zs.ncol++] = col;
+    col = strtok_r(NULL, ", ", &save);
+  }
+  if ((0==status) && (0==zs.ncol)){
+    MU_WARN("%s\n", "mu_index_shards() received an empty list of columns");
+    status = -1;
+  }
+  char *from = (status)? NULL: sqlite3_mprintf(" from \"%w\";", tablename);
+  if ((0==status) && ((NULL==from) || mu_strbuf_adds(&sql, from)))
+    status = -1;
+  sqlite3_free(from);
+  int nv = 1+3*zs.ncol;
+  if (0==status){
+    zs.shardv = conf->shardv;
+    zs.sql = sql.s;
+    zs.v = calloc(conf->shardc*nv, sizeof(sqlite3_value *));
+    zs.bytes = calloc(conf->shardc, sizeof(sqlite3_int64));
+    zs.mtime = calloc(conf->shardc, sizeof(sqlite3_int64));
+    if ((NULL==zs.v) || (NULL==zs.bytes) || (NULL==zs.mtime)){
+      MU_WARN_OOM();
+      status = -1;
+    }
+  }
+  if (0==status)
+    status = mu_each_shard(conf->shardc, conf->ncores, mu_zonescan, &zs);
+
+  /* the catalog is rewritten in one transaction, so queries see all of the new zone maps or none */
+  sqlite3 *shard = (status)? NULL: mu_sqlite3_open(conf->shardv[0]);
+  sqlite3 *db = (shard)? mu_catalog_open(dbdir, 1): NULL;
+  sqlite3_stmt *stmt = NULL;
+  if ((0==status) && ((NULL==db) ||
+		      mu_sqlite3_exec(db, "begin;") ||
+		      (sqlite3_prepare_v2(db, "insert or replace into mu_zonemap values (?,?,?,?,?,?,?,?,?,?,?);", -1, &stmt, NULL)!=SQLITE_OK)))
+    status = -1;
+  int k;
+  for(k=0; (k<zs.ncol) && (0==status); ++k){
+    const char *decltype = NULL;
+    const char *collation = NULL;
+    if (sqlite3_table_column_metadata(shard, NULL, tablename, colv[k], &decltype, &collation, NULL, NULL, NULL)!=SQLITE_OK){
+      MU_WARN("mu_index_shards() can not index %s, it is not a column of table %s\n", colv[k], tablename);
+      status = -1;
+      break;
+    }
+    size_t i;
+    status = mu_sqlite3_execf(db, "delete from mu_zonemap where tablename=%Q and col=%Q;", tablename, colv[k]);
+    for(i=0; (i<conf->shardc) && (0==status); ++i){
+      sqlite3_value **v = zs.v+i*nv;
+      const char *base = strrchr(conf->shardv[i], '/');
+      base = (base)? base+1: conf->shardv[i];
+      sqlite3_bind_text(stmt, 1, tablename, -1, SQLITE_STATIC);
+      sqlite3_bind_text(stmt, 2, colv[k], -1, SQLITE_STATIC);
+      sqlite3_bind_text(stmt, 3, base, -1, SQLITE_STATIC);
+      sqlite3_bind_value(stmt, 4, v[1+3*k]);
+      sqlite3_bind_value(stmt, 5, v[2+3*k]);
+      sqlite3_bind_int64(stmt, 6, sqlite3_value_int64(v[0])-sqlite3_value_int64(v[3+3*k]));
+      sqlite3_bind_int64(stmt, 7, sqlite3_value_int64(v[0]));
+      sqlite3_bind_int64(stmt, 8, zs.bytes[i]);
+      sqlite3_bind_int64(stmt, 9, zs.mtime[i]);
+      sqlite3_bind_text(stmt, 10, mu_affinity(decltype), -1, SQLITE_STATIC);
+      sqlite3_bind_text(stmt, 11, (collation)? collation: "BINARY", -1, SQLITE_TRANSIENT);
+      if (sqlite3_step(stmt)!=SQLITE_DONE){
+	MU_WARN("sqlite3 reported this error:\n%s\n", sqlite3_errmsg(db));
+	status = -1;
+      }
+      sqlite3_reset(stmt);
+    }
+  }
+  sqlite3_finalize(stmt);
+  if (db)
+    status = mu_sqlite3_exec(db, (status)? "rollback;": "commit;") || status;
+  sqlite3_close(db);
+  sqlite3_close(shard);
+  if (status)
+    MU_WARN("Could not record the zone maps of table %s in the catalog of %s\n", tablename, dbdir);
+
+  size_t i;
+  for(i=0; (zs.v) && (i<conf->shardc*nv); ++i)
+    sqlite3_value_free(zs.v[i]);
+  free(zs.v);
+  free(zs.bytes);
+  free(zs.mtime);
+  free(sql.s);
+  free(colv);
+  free(list);
+  mu_free_dbconf(conf);
+  return status;
+}
+
+/* the canonical text of literal [i,b) compared with a key column of keytype, or NULL if it is not a plain literal */
+static const char * mu_key_literal(const struct mu_TOKENS *t, int i, int b, char keytype, size_t *n, char *buf, size_t bufsize){
+  if (MU_KEY_OTHER==keytype)
+    return NULL;
+  if ((i+1==b) && (MU_TK_STRING==t->v[i].type)){
+    const char *s = t->v[i].s;
+    int k;
+    *n = 0;
+    for(k=1; (k<t->v[i].n-1) && (*n<bufsize); ++k){
+      buf[(*n)++] = s[k];
+      if ('\''==s[k])
+	++k;
+    }
+    if (*n>=bufsize)
+      return NULL;
+    buf[*n] = 0;
+    char *tmp = buf+(*n)+1;
+    return mu_key_canon(keytype, buf, n, tmp, bufsize-(*n)-1);
+  }
+  int sign = (i+2==b) && (is_mu_tk(&t->v[i], "-") || is_mu_tk(&t->v[i], "+"));
+  if ((i+1+sign==b) && (MU_TK_NUMBER==t->v[i+sign].type)){
+    /* a number compared with a text column is compared as sqlite3 writes it, so only integers are safe */
+    *n = (size_t) ((t->v[b-1].s+t->v[b-1].n)-t->v[i].s);
+    if (*n>=bufsize)
+      return NULL;
+    memcpy(buf, t->v[i].s, *n);
+    buf[*n] = 0;
+    size_t len = *n;
+    const char *c = mu_key_canon(MU_KEY_NUMERIC, buf, n, buf+len+1, bufsize-len-1);
+    if ((MU_KEY_TEXT==keytype) && ((c==buf) || (NULL!=strpbrk(c, ".eE"))))
+      return NULL;
+    return c;
+  }
+  return NULL;
+}
+
+/* A select of a single partitioned table whose where clause fixes every key column
+ * with "key = literal" terms has all its rows in one shard.  Leaves only that shard in use[]. */
+static void mu_route_partition(struct mu_DBCONF *conf, const struct mu_SELECT *sel, const int *at, int nterm, char *use){
+  const struct mu_TOKENS *t = &(sel->t);
+  int alias;
+  struct mu_PARTITION *part = mu_from_partition(conf, sel, &alias);
+  char buf[MU_KEY_MAX][256];
+  uint64_t h = MU_FNV1A_BASIS;
+  int found = 0;
+  int k;
+  size_t i;
+  if (NULL==part)
+    return;
+  for(k=0;k<part->nkey;++k){
+    int j;
+    for(j=0;j<nterm;++j){
+      int a = at[j];
+      int b = at[j+1]-1;
+      int c;
+      const char *lit = NULL;
+      size_t n = 0;
+      if ((c = mu_tk_column(t, a, b, part->keycol[k], part->tablename, alias)) && (a+c<b) &&
+	  (is_mu_tk(&t->v[a+c], "=") || is_mu_tk(&t->v[a+c], "==")))
+	lit = mu_key_literal(t, a+c+1, b, part->keytype[k], &n, buf[k], sizeof(buf[k]));
+      for(c=a+1; (NULL==lit) && (c<b-1); ++c){
+	if ((is_mu_tk(&t->v[c], "=") || is_mu_tk(&t->v[c], "==")) &&
+	    (mu_tk_column(t, c+1, b, part->keycol[k], part->tablename, alias)==b-c-1))
+	  lit = mu_key_literal(t, a, c, part->keytype[k], &n, buf[k], sizeof(buf[k]));
+      }
+      if (lit){
+	if (k)
+	  h = mu_fnv1a(h, "\x1f", 1);
+	h = mu_fnv1a(h, lit, n);
+	++found;
+	break;
+      }
+    }
+  }
+  if (found<part->nkey)
+    return;
+  char name[32];
+  snprintf(name, sizeof(name), "%.3d", mu_hash_shard(h, part->shardc));
+  for(i=0;i<conf->shardc;++i){
+    const char *base = strrchr(conf->shardv[i], '/');
+    base = (base)? base+1: conf->shardv[i];
+    if (0==strcmp(base, name))
+      break;
+  }
+  if (i<conf->shardc){
+    int keep = use[i];
+    memset(use, 0, conf->shardc);
+    use[i] = keep;
+  }
+}
+
+/* the value of literal [i,b), a number with an optional sign or a quoted string, or 0 if it is neither */
+static int mu_zone_literal(const struct mu_TOKENS *t, int i, int b, struct mu_VALUE *v, char *buf, size_t bufsize){
+  if ((i+1==b) && (MU_TK_STRING==t->v[i].type)){
+    const char *s = t->v[i].s;
+    int k;
+    v->n = 0;
+    for(k=1; (k<t->v[i].n-1) && (v->n<bufsize); ++k){
+      buf[v->n++] = s[k];
+      if ('\''==s[k])
+	++k;
+    }
+    if (v->n>=bufsize)
+      return 0;
+    buf[v->n] = 0;
+    v->s = buf;
+    v->type = SQLITE_TEXT;
+    return 1;
+  }
+  int sign = (i+2==b) && (is_mu_tk(&t->v[i], "-") || is_mu_tk(&t->v[i], "+"));
+  if ((i+1+sign!=b) || (MU_TK_NUMBER!=t->v[i+sign].type) || ((size_t) t->v[b-1].n+1>=bufsize))
+    return 0;
+  buf[0] = (sign)? t->v[i].s[0]: '+';
+  memcpy(buf+1, t->v[b-1].s, t->v[b-1].n);
+  buf[t->v[b-1].n+1] = 0;
+  char *end;
+  errno = 0;
+  v->i = strtoll(buf, &end, 10);
+  if ((0==*end) && (0==errno)){
+    v->type = SQLITE_INTEGER;
+    return 1;
+  }
+  v->d = strtod(buf, &end);
+  if (*end)
+    return 0;
+  v->type = SQLITE_FLOAT;
+  return 1;
+}
+
+/* compares two values of the same class, numbers or binary collated text */
+static int mu_value_cmp(const struct mu_VALUE *x, const struct mu_VALUE *y){
+  if (SQLITE_TEXT==x->type){
+    size_t n = (x->n<y->n)? x->n: y->n;
+    int c = memcmp(x->s, y->s, n);
+    if (c)
+      return c;
+    return (x->n>y->n)-(x->n<y->n);
+  }
+  if ((SQLITE_INTEGER==x->type) && (SQLITE_INTEGER==y->type))
+    return (x->i>y->i)-(x->i<y->i);
+  long double a = (SQLITE_INTEGER==x->type)? (long double) x->i: (long double) x->d;
+  long double b = (SQLITE_INTEGER==y->type)? (long double) y->i: (long double) y->d;
+  return (a>b)-(a<b);
+}
+
+/* 0 when no row of a shard with zone z can satisfy "col op lit", where op is one of = < <= > >= */
+static int mu_zone_may_match(const struct mu_ZONEMAP *zm, const struct mu_ZONE *z, const char *op, const struct mu_VALUE *lit){
+  if (!z->known)
+    return 1;
+  if ((0==z->nrows) || (z->nulls==z->nrows))
+    return 0;
+  if (SQLITE_TEXT==lit->type){
+    /* a text literal meets a numeric column's affinity, and other collations order text differently */
+    if (('N'==zm->affinity) || (!zm->binary) || (SQLITE_TEXT!=z->min.type) || (SQLITE_TEXT!=z->max.type))
+      return 1;
+  } else {
+    /* a number meets a text column's affinity, and a numeric max means there is no text or blob in the shard */
+    if (('T'==zm->affinity) ||
+	((SQLITE_INTEGER!=z->min.type) && (SQLITE_FLOAT!=z->min.type)) ||
+	((SQLITE_INTEGER!=z->max.type) && (SQLITE_FLOAT!=z->max.type)))
+      return 1;
+  }
+  int lo = mu_value_cmp(&(z->min), lit);
+  int hi = mu_value_cmp(&(z->max), lit);
+  if ('='==op[0])
+    return (lo<=0) && (hi>=0);
+  if ('<'==op[0])
+    return ('='==op[1])? (lo<=0): (lo<0);
+  return ('='==op[1])? (hi>=0): (hi>0);
+}
+
+static const char * mu_zone_op(const struct mu_TOKEN *tk, int flip){
+  static const char *ops[] = { "=", "==", "<", "<=", ">", ">=" };
+  static const char *flipped[] = { "=", "==", ">", ">=", "<", "<=" };
+  size_t k;
+  for(k=0;k<sizeof(ops)/sizeof(ops[0]);++k){
+    if (is_mu_tk(tk, ops[k]))
+      return (flip)? flipped[k]: ops[k];
+  }
+  return NULL;
+}
+
+/* Leaves out of use[] the shards whose zone maps show that some where term
+ * "col op literal", "literal op col" or "col between literal and literal" is never true. */
+static void mu_prune_zones(struct mu_DBCONF *conf, const struct mu_SELECT *sel, const int *at, int nterm, char *use){
+  const struct mu_TOKENS *t = &(sel->t);
+  int alias;
+  int table = mu_from_table(sel, &alias);
+  struct mu_ZONEMAP *zm;
+  if (table<0)
+    return;
+  for(zm=conf->zonemap; zm; zm=zm->next){
+    int j;
+    if ((zm->shardc!=conf->shardc) || (!is_mu_tk_name(&t->v[table], zm->tablename)))
+      continue;
+    for(j=0;j<nterm;++j){
+      int a = at[j];
+      int b = at[j+1]-1;
+      int c;
+      const char *op[2] = { NULL, NULL };
+      struct mu_VALUE lit[2];
+      char buf[2][256];
+      if ((c = mu_tk_column(t, a, b, zm->col, zm->tablename, alias)) && (a+c<b)){
+	if (is_mu_tk(&t->v[a+c], "between")){
+	  int k;
+	  for(k=a+c+2; k<b-1; ++k){
+	    if ((t->v[k].depth==t->v[a].depth) && is_mu_tk(&t->v[k], "and"))
+	      break;
+	  }
+	  if ((k<b-1) && mu_zone_literal(t, a+c+1, k, &lit[0], buf[0], sizeof(buf[0])) &&
+	      mu_zone_literal(t, k+1, b, &lit[1], buf[1], sizeof(buf[1]))){
+	    op[0] = ">=";
+	    op[1] = "<=";
+	  }
+	} else if ((NULL!=(op[0] = mu_zone_op(&t->v[a+c], 0))) &&
+		   (!mu_zone_literal(t, a+c+1, b, &lit[0], buf[0], sizeof(buf[0]))))
+	  op[0] = NULL;
+      }
+      for(c=a+1; (NULL==op[0]) && (c<b-1); ++c){
+	if ((mu_tk_column(t, c+1, b, zm->col, zm->tablename, alias)==b-c-1) &&
+	    (NULL!=(op[0] = mu_zone_op(&t->v[c], 1))) &&
+	    (!mu_zone_literal(t, a, c, &lit[0], buf[0], sizeof(buf[0]))))
+	  op[0] = NULL;
+      }
+      if (NULL==op[0])
+	continue;
+      size_t i;
+      for(i=0;i<conf->shardc;++i){
+	if (use[i] &&
+	    ( (!mu_zone_may_match(zm, &(zm->zone[i]), op[0], &lit[0])) ||
+	      (op[1] && !mu_zone_may_match(zm, &(zm->zone[i]), op[1], &lit[1])) ))
+	  use[i] = 0;
+      }
+    }
+  }
+}
+
+/* marks in use[] the shards that can hold rows for the select sql, and returns how many there are.
+ * Shards are left out by their partition key or their zone maps.  At least one shard is always
+ * kept, so the map still gives maptable its columns. */
+static size_t mu_prune_shards(struct mu_DBCONF *conf, const char *sql, char *use){
+  size_t i;
+  size_t nuse = 0;
+  memset(use, 1, conf->shardc);
+  if (((NULL==conf->partition) && (NULL==conf->zonemap)) || (NULL==sql))
+    return conf->shardc;
+  struct mu_SELECT sel;
+  size_t cursor = mu_error_cursor;
+  if (mu_parse_select(sql, &sel, 1)){
+    mu_error_cursor = cursor;
+    return conf->shardc;
+  }
+  int at[MU_PLAN_MAX+1];
+  int nterm = mu_where_terms(&(sel.t), sel.where_a, sel.where_b, at, MU_PLAN_MAX);
+  if (nterm>0){
+    mu_route_partition(conf, &sel, at, nterm, use);
+    mu_prune_zones(conf, &sel, at, nterm, use);
+  }
+  for(i=0;i<conf->shardc;++i)
+    nuse += use[i];
+  if (0==nuse){
+    use[0] = 1;
+    nuse = 1;
+  }
+  mu_free_select(&sel);
+  return nuse;
+}
+
+/* workers post their core number here as they finish, so the reduce can consume them in that order */
+struct mu_DONEQ {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int n;
+  int *core;
+};
+
+static void mu_doneq_post(struct mu_DONEQ *d, int icore){
+  pthread_mutex_lock(&(d->lock));
+  d->core[d->n++] = icore;
+  pthread_cond_signal(&(d->cond));
+  pthread_mutex_unlock(&(d->lock));
+}
+
+/* returns the core that was k-th to finish, waiting for it if necessary */
+static int mu_doneq_wait(struct mu_DONEQ *d, int k){
+  pthread_mutex_lock(&(d->lock));
+  while (d->n <= k)
+    pthread_cond_wait(&(d->cond), &(d->lock));
+  int icore = d->core[k];
+  pthread_mutex_unlock(&(d->lock));
+  return icore;
+}
+
+/* A warm database keeps a pool of map threads and one open connection per
+ * shard between queries, see mu_warm_db().  Pool threads run jobs in the order
+ * submitted and live as long as the process.  A shard's connection is used by
+ * one map thread at a time under that shard's lock.
+ */
+
+struct mu_JOB {
+  void * (*fn)(void *);
+  void *arg;
+  struct mu_JOB *next;
+};
+
+struct mu_WARM {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct mu_JOB *head;
+  struct mu_JOB *tail;
+  int nthreads;
+  int quit; /* set when mu_warm_db() fails, so the threads it started exit */
+  int readonly; /* conf->readonly when sharddb was opened */
+  size_t shardc;
+  sqlite3 **sharddb; /* NULL if there are too many shards to keep open */
+  pthread_mutex_t *shardlock;
+};
+
+static void * mu_pool_thread(void *arg){
+  struct mu_WARM *warm = (struct mu_WARM *) arg;
+  for(;;){
+    pthread_mutex_lock(&(warm->lock));
+    while ((NULL==warm->head) && (!warm->quit))
+      pthread_cond_wait(&(warm->cond), &(warm->lock));
+    if (NULL==warm->head){
+      pthread_mutex_unlock(&(warm->lock));
+      break;
+    }
+    struct mu_JOB *job = warm->head;
+    warm->head = job->next;
+    if (NULL==warm->head)
+      warm->tail = NULL;
+    pthread_mutex_unlock(&(warm->lock));
+    job->fn(job->arg);
+    free(job);
+  }
+  return NULL;
+}
+
+static int mu_pool_submit(struct mu_WARM *warm, void * (*fn)(void *), void *arg){
+  struct mu_JOB *job = malloc(sizeof(struct mu_JOB));
+  if (NULL==job){
+    MU_WARN_OOM();
+    return -1;
+  }
+  job->fn = fn;
+  job->arg = arg;
+  job->next = NULL;
+  pthread_mutex_lock(&(warm->lock));
+  if (warm->tail)
+    warm->tail->next = job;
+  else
+    warm->head = job;
+  warm->tail = job;
+  pthread_cond_signal(&(warm->cond));
+  pthread_mutex_unlock(&(warm->lock));
+  return 0;
+}
+
+/* stops the nthreads threads of tidv and frees a warm database that mu_warm_db() could not finish */
+static void mu_free_warm(struct mu_WARM *warm, pthread_t *tidv, int nthreads){
+  int i;
+  pthread_mutex_lock(&(warm->lock));
+  warm->quit = 1;
+  pthread_cond_broadcast(&(warm->cond));
+  pthread_mutex_unlock(&(warm->lock));
+  for(i=0;i<nthreads;++i)
+    pthread_join(tidv[i], NULL);
+  for(i=0; (warm->sharddb) && (i<(int) warm->shardc); ++i)
+    sqlite3_close(warm->sharddb[i]);
+  for(i=0; (warm->shardlock) && (i<(int) warm->shardc); ++i)
+    pthread_mutex_destroy(&(warm->shardlock[i]));
+  pthread_mutex_destroy(&(warm->lock));
+  pthread_cond_destroy(&(warm->cond));
+  free(warm->sharddb);
+  free(warm->shardlock);
+  free(warm);
+}
+
+int mu_warm_db(struct mu_DBCONF *conf){
+  if (NULL==conf){
+    MU_WARN("%s\n", mu_error_null_dbconf);
+    return -1;
+  }
+  if (conf->warm)
+    return 0;
+  struct mu_WARM *warm = calloc(1, sizeof(struct mu_WARM));
+  if (NULL==warm){
+    MU_WARN_OOM();
+    return -1;
+  }
+  pthread_mutex_init(&(warm->lock), NULL);
+  pthread_cond_init(&(warm->cond), NULL);
+  warm->shardlock = malloc(conf->shardc*sizeof(pthread_mutex_t));
+  if (NULL==warm->shardlock){
+    MU_WARN_OOM();
+    mu_free_warm(warm, NULL, 0);
+    return -1;
+  }
+  warm->shardc = conf->shardc;
+  size_t i;
+  for(i=0;i<conf->shardc;++i)
+    pthread_mutex_init(&(warm->shardlock[i]), NULL);
+  /* each open shard holds a file descriptor, leave plenty for everything else */
+  long int max_open_files = sysconf(_SC_OPEN_MAX);
+  if ((max_open_files<0) || (((long int) conf->shardc)+64 < max_open_files)){
+    warm->sharddb = calloc(conf->shardc, sizeof(sqlite3 *));
+    warm->readonly = conf->readonly;
+    if (NULL==warm->sharddb){
+      MU_WARN_OOM();
+      mu_free_warm(warm, NULL, 0);
+      return -1;
+    }
+    for(i=0;i<conf->shardc;++i){
+      warm->sharddb[i] = mu_shard_open(conf, conf->shardv[i]);
+      /* reading the schema now saves parsing it on the first query */
+      if ((NULL==warm->sharddb[i]) || mu_sqlite3_exec(warm->sharddb[i], "select count(*) from sqlite_master;")){
+	MU_WARN("mu_warm_db() could not open shard %s\n", conf->shardv[i]);
+	mu_free_warm(warm, NULL, 0);
+	return -1;
+      }
+    }
+  }
+  /* the threads are joinable until every one has started, so a failure can stop them */
+  pthread_t tidv[conf->ncores];
+  int icore;
+  for(icore=0;icore<conf->ncores;++icore){
+    if (pthread_create(&tidv[icore], NULL, mu_pool_thread, warm)){
+      MU_WARN("%s\n", "mu_warm_db() could not start a pool thread");
+      mu_free_warm(warm, tidv, icore);
+      return -1;
+    }
+    warm->nthreads++;
+  }
+  for(icore=0;icore<conf->ncores;++icore)
+    pthread_detach(tidv[icore]);
+  /* initialized here, before concurrent queries could race to do it */
+  mu_sqlite3_extensions();
+  conf->warm = warm;
+  return 0;
+}
+
+/* Map result cache.  With conf->cachedir set, each shard's map result is kept in   */
+/* a small database in that directory, named by a hash of the normalized mapsql,   */
+/* createtablesql and the shard's path, and stamped with the shard's inode, size   */
+/* and modification time.  A later query finding a stamp that still matches copies */
+/* the kept rows instead of mapping the shard again.  A hit touches the database's */
+/* modification time, and after each query the directory is trimmed to at most     */
+/* conf->cachebytes by removing the databases used longest ago.                    */
+
+struct mu_CACHEKEY {
+  const char *query; /* normalized mapsql and createtablesql */
+  char *shard; /* real path of the shard */
+  long long ino;
+  long long bytes;
+  long long mtime;
+  char *name; /* the cache database */
+  char *tmpname; /* written while mapping, then renamed to name */
+};
+
+/* sql with its tokens separated by single spaces and its bare words in lower case, so spacing, comments and case do not matter */
+static char * mu_normalize_sql(const char *sql){
+  struct mu_STRBUF out = { NULL, 0, 0 };
+  struct mu_TOKENS t;
+  if ((NULL==sql) || (mu_strbuf_add(&out, "", 0)))
+    return out.s;
+  if (mu_tokenize(sql, &t)){
+    free(out.s);
+    return NULL;
+  }
+  while ((t.c>0) && is_mu_tk(&t.v[t.c-1], ";"))
+    --t.c;
+  int i;
+  for(i=0;i<t.c;++i){
+    if (((i) && mu_strbuf_add(&out, " ", 1)) || mu_strbuf_add(&out, t.v[i].s, (size_t) t.v[i].n)){
+      free(out.s);
+      out.s = NULL;
+      break;
+    }
+    if (MU_TK_WORD==t.v[i].type){
+      char *w = out.s+out.len-t.v[i].n;
+      int k;
+      for(k=0;k<t.v[i].n;++k)
+	w[k] = (char) tolower((unsigned char) w[k]);
+    }
+  }
+  free(t.v);
+  return out.s;
+}
+
+static void mu_cachekey_free(struct mu_CACHEKEY *k){
+  free(k->shard);
+  sqlite3_free(k->name);
+  sqlite3_free(k->tmpname);
+}
+
+/* fills k for shard.  returns 0 on success, or -1 when the shard can not be cached, with no warning */
+static int mu_cachekey(struct mu_CACHEKEY *k, const char *cachedir, const char *query, const char *shard){
+  struct stat fstats;
+  memset(k, 0, sizeof(*k));
+  k->query = query;
+  k->shard = realpath(shard, NULL);
+  if ((NULL==k->shard) || stat(k->shard, &fstats)){
+    mu_cachekey_free(k);
+    return -1;
+  }
+  k->ino = (long long) fstats.st_ino;
+  k->bytes = (long long) fstats.st_size;
+  k->mtime = mu_mtime_ns(&fstats);
+  uint64_t h = mu_fnv1a(MU_FNV1A_BASIS, query, strlen(query));
+  h = mu_fnv1a(mu_fnv1a(h, "\x1f", 1), k->shard, strlen(k->shard));
+  k->name = sqlite3_mprintf("%s/%016llx.db", cachedir, (unsigned long long) h);
+  k->tmpname = sqlite3_mprintf("%s/%016llx.%d.%lx.tmp", cachedir, (unsigned long long) h, (int) getpid(), (unsigned long) pthread_self());
+  if ((NULL==k->name) || (NULL==k->tmpname)){
+    mu_cachekey_free(k);
+    return -1;
+  }
+  return 0;
+}
+
+/* copies the kept rows for k into the result table of dbname.  returns 0 on a hit, 1 on a miss, -1 on error */
+static int mu_cache_fetch(const struct mu_CACHEKEY *k, const char *dbname, const char *otablename, int first){
+  struct stat fstats;
+  if (stat(k->name, &fstats))
+    return 1;
+  sqlite3 *db = mu_sqlite3_open(dbname);
+  if (NULL==db)
+    return -1;
+  sqlite3_stmt *stmt = NULL;
+  int hit = (0==mu_sqlite3_execf(db, "attach database %Q as mu_cache;", k->name));
+  int attached = hit;
+  size_t cursor = mu_error_cursor;
+  hit = (hit) &&
+    (sqlite3_prepare_v2(db, "select count(*) from mu_cache.mu_cache_key where query=?1 and shard=?2 and ino=?3 and bytes=?4 and mtime=?5;", -1, &stmt, NULL)==SQLITE_OK);
+  if (hit){
+    sqlite3_bind_text(stmt, 1, k->query, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, k->shard, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, k->ino);
+    sqlite3_bind_int64(stmt, 4, k->bytes);
+    sqlite3_bind_int64(stmt, 5, k->mtime);
+    hit = (sqlite3_step(stmt)==SQLITE_ROW) && (1==sqlite3_column_int(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+  /* an unreadable or stale cache database is only a miss */
+  mu_error_cursor = cursor;
+  int status = (hit)? 0: 1;
+  if (hit)
+    utimensat(AT_FDCWD, k->name, NULL, 0);
+  if ((hit) &&
+      mu_sqlite3_execf(db,
+		       (first)? "create table main.%s as select * from mu_cache.mu_cache;": "insert into main.%s select * from mu_cache.mu_cache;",
+		       otablename))
+    status = -1;
+  if ((attached) && mu_sqlite3_exec(db, "detach database mu_cache;"))
+    status = -1;
+  sqlite3_close(db);
+  return status;
+}
+
+struct mu_CACHEFILE {
+  char *name;
+  long long bytes;
+  sqlite3_int64 mtime;
+};
+
+static int mu_cachefile_cmp(const void *a, const void *b){
+  const struct mu_CACHEFILE *x = (const struct mu_CACHEFILE *) a;
+  const struct mu_CACHEFILE *y = (const struct mu_CACHEFILE *) b;
+  return (x->mtime>y->mtime)-(x->mtime<y->mtime);
+}
+
+/* removes the least recently used cache databases of cachedir until the rest fit in maxbytes.  Errors only leave more behind */
+static void mu_cache_trim(const char *cachedir, long long maxbytes){
+  DIR *dir = opendir(cachedir);
+  if (NULL==dir)
+    return;
+  struct mu_CACHEFILE *filev = NULL;
+  size_t filec = 0;
+  size_t cap = 0;
+  long long total = 0;
+  struct dirent *e;
+  while ((e = readdir(dir))){
+    size_t len = strlen(e->d_name);
+    struct stat fstats;
+    if ((len!=19) || strcmp(e->d_name+16, ".db"))
+      continue;
+    if (filec==cap){
+      struct mu_CACHEFILE *v = realloc(filev, (cap = 2*cap+64)*sizeof(struct mu_CACHEFILE));
+      if (NULL==v)
+	break;
+      filev = v;
+    }
+    char *name = sqlite3_mprintf("%s/%s", cachedir, e->d_name);
+    if ((NULL==name) || stat(name, &fstats)){
+      sqlite3_free(name);
+      continue;
+    }
+    filev[filec].name = name;
+    filev[filec].bytes = (long long) fstats.st_size;
+    filev[filec].mtime = mu_mtime_ns(&fstats);
+    total += filev[filec].bytes;
+    ++filec;
+  }
+  closedir(dir);
+  size_t i;
+  if (total>maxbytes)
+    qsort(filev, filec, sizeof(struct mu_CACHEFILE), mu_cachefile_cmp);
+  for(i=0;i<filec;++i){
+    if ((total>maxbytes) && (0==unlink(filev[i].name)))
+      total -= filev[i].bytes;
+    sqlite3_free(filev[i].name);
+  }
+  free(filev);
+}
+
+static char * mu_temp_name(const char *dirname, const char *name, int num){
+  const char *fmt = "%s/%s.%.3d";
+  char *s = malloc(1+snprintf(NULL, 0, fmt, dirname, name, num));
+  if (NULL==s){
+    MU_WARN_OOM();
+    return NULL;
+  }
+  sprintf(s, fmt, dirname, name, num);
+  return s;
+}
+
+/* With conf->spillbytes set, each core's map results are a sqlite3 memdb   */
+/* database shared by name between the connections of this process.  The   */
+/* query keeps one connection to it open until the reduce is done, since a */
+/* memdb database is gone once its last connection closes.  A core whose   */
+/* results outgrow spillbytes copies them to a file in a temp directory,   */
+/* made by whichever core spills first, and goes on there.                 */
+
+struct mu_SPILL {
+  pthread_mutex_t lock;
+  long long bytes;
+  const char *tmpdir; /* NULL until a core spills */
+};
+
+static char * mu_memdb_name(int num){
+  static unsigned query = 0;
+  const char *fmt = "file:/multicoresql-%ld-%u.%.3d?vfs=memdb";
+  unsigned id = __sync_fetch_and_add(&query, 1);
+  char *s = malloc(1+snprintf(NULL, 0, fmt, (long) getpid(), id, num));
+  if (NULL==s){
+    MU_WARN_OOM();
+    return NULL;
+  }
+  sprintf(s, fmt, (long) getpid(), id, num);
+  return s;
+}
+
+static sqlite3 * mu_memdb_open(const char *dbname, long long spillbytes){
+  sqlite3 *db = mu_sqlite3_open(dbname);
+  if (NULL==db)
+    return NULL;
+  /* room for the last shard mapped before the core spills */
+  sqlite3_int64 limit = spillbytes+(1LL<<30);
+  sqlite3_file_control(db, "main", SQLITE_FCNTL_SIZE_LIMIT, &limit);
+  return db;
+}
+
+static long long mu_db_bytes(sqlite3 *db){
+  sqlite3_stmt *stmt = NULL;
+  long long bytes = -1;
+  if (SQLITE_OK!=sqlite3_prepare_v2(db, "select page_count*page_size from pragma_page_count(), pragma_page_size();", -1, &stmt, NULL)){
+    MU_WARN("%s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  if (SQLITE_ROW==sqlite3_step(stmt))
+    bytes = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+  return bytes;
+}
+
+static int mu_spill(struct mu_SPILL *spill, sqlite3 **memdb, const char **dbname, int coreid){
+  pthread_mutex_lock(&(spill->lock));
+  if (NULL==spill->tmpdir)
+    spill->tmpdir = mu_create_temp_dir();
+  const char *tmpdir = spill->tmpdir;
+  pthread_mutex_unlock(&(spill->lock));
+  if (NULL==tmpdir){
+    MU_WARN("map thread %.3d could not create a temp directory to spill its results\n", coreid);
+    return -1;
+  }
+  /* vacuum into would write another memdb database, so the pages are copied with the backup api */
+  char *fname = mu_temp_name(tmpdir, "mapsql.db", coreid);
+  sqlite3 *db = (fname)? mu_sqlite3_open(fname): NULL;
+  sqlite3_backup *backup = (db)? sqlite3_backup_init(db, "main", *memdb, "main"): NULL;
+  int status = (backup)? sqlite3_backup_step(backup, -1): SQLITE_ERROR;
+  if ((backup) && (SQLITE_OK!=sqlite3_backup_finish(backup)))
+    status = SQLITE_ERROR;
+  if (SQLITE_DONE!=status){
+    if (db)
+      MU_WARN("%s\n", sqlite3_errmsg(db));
+    MU_WARN("map thread %.3d could not spill its results to %s\n", coreid, (fname)? fname: tmpdir);
+    sqlite3_close(db);
+    free(fname);
+    return -1;
+  }
+  sqlite3_close(db);
+  sqlite3_close(*memdb);
+  *memdb = NULL;
+  free((void *) *dbname);
+  *dbname = fname;
+  return 0;
+}
+
+/* Deadlines and cancellation.  A query stops once mu_cancel() is called   */
+/* or its timeout passes.  Map threads check before each shard, and each   */
+/* connection of the query runs a progress handler that interrupts it.     */
+/* The process engine polls its sqlite3 children and kills them.  With     */
+/* q->partial the timeout only ends the map, and the shards mapped by then */
+/* are reduced.                                                            */
+
+struct mu_STOP {
+  struct mu_QUERY *q;
+  double deadline; /* on the CLOCK_MONOTONIC clock, or 0 for none */
+};
+
+static double mu_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+1e-9*ts.tv_nsec;
+}
+
+void mu_cancel(struct mu_QUERY *q){
+  if (q)
+    q->cancelled = 1;
+}
+
+static void mu_stop_init(struct mu_STOP *stop, struct mu_QUERY *q){
+  stop->q = q;
+  stop->deadline = (q->timeout>0)? mu_now()+q->timeout: 0;
+}
+
+/* returns 1 once the query must stop.  With map set, also once a partial query must stop mapping */
+static int mu_stopped(const struct mu_STOP *stop, int map){
+  if (NULL==stop)
+    return 0;
+  if (stop->q->cancelled)
+    return 1;
+  return (stop->deadline>0) && ((map) || (!stop->q->partial)) && (mu_now()>=stop->deadline);
+}
+
+static int mu_stop_map_progress(void *stop){
+  return mu_stopped((const struct mu_STOP *) stop, 1);
+}
+
+static int mu_stop_progress(void *stop){
+  return mu_stopped((const struct mu_STOP *) stop, 0);
+}
+
+/* interrupts db once the query stops, or no longer for a NULL stop */
+static void mu_stop_db(sqlite3 *db, struct mu_STOP *stop, int map){
+  if (db)
+    sqlite3_progress_handler(db, (stop)? 1000: 0, (map)? mu_stop_map_progress: mu_stop_progress, stop);
+}
+
+static void mu_warn_stopped(const struct mu_STOP *stop){
+  if (stop->q->cancelled)
+    MU_WARN("%s\n", "mu_query() was cancelled by mu_cancel()");
+  else
+    MU_WARN("mu_query() ran past its timeout of %g seconds\n", stop->q->timeout);
+}
+
+/* waits for a started sqlite3 task, killing it if the query stops first.  returns 0 once it exits, -1 if killed */
+/* The wait sleeps on a pidfd, which wakes as soon as the task exits, and looks at the stop every 50ms or at its */
+/* deadline.  Kernels without pidfd_open fall back to polling waitpid.                                          */
+static int mu_wait_task(struct mu_SQLITE3_TASK *task, const struct mu_STOP *stop){
+  if (NULL==stop){
+    waitpid(task->pid, &(task->status), 0);
+    task->reaped = 1;
+    return 0;
+  }
+  int fd = -1;
+#ifdef SYS_pidfd_open
+  fd = (int) syscall(SYS_pidfd_open, task->pid, 0);
+#endif
+  useconds_t nap = 1000;
+  while (0==waitpid(task->pid, &(task->status), WNOHANG)){
+    if (mu_stopped(stop, 0)){
+      kill(task->pid, SIGKILL);
+      waitpid(task->pid, &(task->status), 0);
+      task->reaped = 1;
+      if (fd>=0)
+	close(fd);
+      return -1;
+    }
+    if (fd>=0){
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      int ms = 50;
+      double left = stop->deadline-mu_now();
+      if ((stop->deadline>0) && (1000*left<ms))
+	ms = (left>0)? 1+(int) (1000*left): 0;
+      poll(&pfd, 1, ms);
+    } else {
+      usleep(nap);
+      if (nap<50000)
+	nap *= 2;
+    }
+  }
+  if (fd>=0)
+    close(fd);
+  task->reaped = 1;
+  return 0;
+}
+
+/* Admission control.  With MULTICORE_CORE_BUDGET set, the processes on   */
+/* this host share that many map slots through a System V semaphore set.  */
+/* A map thread holds a slot while it maps one shard, and a process engine */
+/* query holds one per map process until its map is done, so concurrent    */
+/* queries queue for slots instead of oversubscribing the cores.  Waiting  */
+/* threads are granted slots in turn, sharing the cores between queries    */
+/* shard by shard.  A query runs on at most its fair share of the budget   */
+/* among the queries running, and a MU_PRIORITY_LOW query takes a slot     */
+/* only while a quarter of the budget stays free for the others.  SEM_UNDO */
+/* gives back the slots of a process that dies.  Each user has a set of    */
+/* their own, key 0x6d000000 plus the uid and mode 0600, so other users    */
+/* can neither hold its slots nor change its budget.  A process with a     */
+/* different budget changes the set's, once the slots it removes are free. */
+
+#define MU_SLOTS_KEY ((key_t) (0x6d000000 | (getuid() & 0xffffff)))
+#define MU_SLOT_FREE 0
+#define MU_SLOT_QUERIES 1
+#define MU_SLOT_BUDGET 2
+
+static pthread_once_t mu_slots_once = PTHREAD_ONCE_INIT;
+static int mu_slots_id = -1;
+static int mu_slots_budget = 0;
+
+/* sets the budget of the set id, waiting a while for the slots it takes away to be freed.  Returns the budget in effect */
+static int mu_slots_reconcile(int id, int budget){
+  int tries;
+  for(tries=0; tries<500; ++tries){
+    int old = semctl(id, MU_SLOT_BUDGET, GETVAL);
+    if ((old<0) || (old==budget))
+      return old;
+    /* the zero test fails the whole change if another process changed the budget since it was read */
+    struct sembuf ops[4] = { { MU_SLOT_BUDGET, (short) -old, IPC_NOWAIT }, { MU_SLOT_BUDGET, 0, IPC_NOWAIT },
+			     { MU_SLOT_BUDGET, (short) budget, IPC_NOWAIT }, { MU_SLOT_FREE, (short) (budget-old), IPC_NOWAIT } };
+    if (0==semop(id, ops, 4))
+      return budget;
+    if (EAGAIN!=errno)
+      return -1;
+    usleep(10000);
+  }
+  /* too many of the slots to remove are still in use; the next process tries again */
+  return semctl(id, MU_SLOT_BUDGET, GETVAL);
+}
+
+static void mu_slots_init(void){
+  const char *env = getenv("MULTICORE_CORE_BUDGET");
+  int budget = (env)? atoi(env): 0;
+  if (budget<=0)
+    return;
+  mu_slots_budget = budget;
+  int id = semget(MU_SLOTS_KEY, 3, IPC_CREAT|IPC_EXCL|0600);
+  if (id>=0){
+    /* setting the budget with semop marks the set ready for the others */
+    struct sembuf init[2] = { { MU_SLOT_FREE, budget, 0 }, { MU_SLOT_BUDGET, budget, 0 } };
+    if (semop(id, init, 2)){
+      semctl(id, 0, IPC_RMID);
+      return;
+    }
+  } else {
+    if ((EEXIST!=errno) || ((id = semget(MU_SLOTS_KEY, 3, 0))<0))
+      return;
+    struct semid_ds ds;
+    int tries;
+    for(tries=0; tries<5000; ++tries){
+      if (semctl(id, 0, IPC_STAT, &ds))
+	return;
+      if (ds.sem_otime)
+	break;
+      usleep(1000);
+    }
+    if (0==ds.sem_otime)
+      return;
+  }
+  mu_slots_budget = mu_slots_reconcile(id, budget);
+  if (mu_slots_budget>0)
+    mu_slots_id = id;
+}
+
+/* returns 1 when a core budget is set, 0 when not, or -1 on error */
+static int mu_slots(void){
+  pthread_once(&mu_slots_once, mu_slots_init);
+  if (mu_slots_budget<=0)
+    return 0;
+  if (mu_slots_id<0){
+    MU_WARN("%s\n", "mu_query() could not open the semaphore set for MULTICORE_CORE_BUDGET");
+    return -1;
+  }
+  return 1;
+}
+
+/* returns 0 when done, 1 if the query stopped while waiting, or -1 on error */
+static int mu_slots_op(struct sembuf *ops, size_t nops, const struct mu_STOP *stop){
+  struct timespec nap = { 0, 50000000 };
+  while (semtimedop(mu_slots_id, ops, nops, (stop)? &nap: NULL)){
+    if ((EAGAIN==errno) && mu_stopped(stop, 1))
+      return 1;
+    if ((EINTR!=errno) && (EAGAIN!=errno)){
+      MU_WARN("%s\n", "mu_query() lost the semaphore set for MULTICORE_CORE_BUDGET");
+      MU_WARN_IF_ERRNO();
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* waits until n slots are free and takes them, returns 0 on success, 1 if the query stopped first or -1 on error */
+static int mu_slot_take(struct mu_DBCONF *conf, int n, const struct mu_STOP *stop){
+  int on = mu_slots();
+  if ((on<=0) || (n<=0))
+    return on;
+  int reserve = (MU_PRIORITY_LOW==conf->priority)? mu_slots_budget/4: 0;
+  if (n+reserve>mu_slots_budget)
+    reserve = (n<mu_slots_budget)? mu_slots_budget-n: 0;
+  struct sembuf ops[2] = { { MU_SLOT_FREE, (short) -(n+reserve), SEM_UNDO }, { MU_SLOT_FREE, (short) reserve, SEM_UNDO } };
+  return mu_slots_op(ops, (reserve)? 2: 1, stop);
+}
+
+static void mu_slot_give(int n){
+  if ((n<=0) || (mu_slots()<=0))
+    return;
+  struct sembuf op = { MU_SLOT_FREE, (short) n, SEM_UNDO };
+  mu_slots_op(&op, 1, NULL);
+}
+
+/* counts the query as running and returns how many cores it may use, or -1 on error */
+static int mu_admit(int ncores){
+  int on = mu_slots();
+  if (on<=0)
+    return (on)? -1: ncores;
+  struct sembuf op = { MU_SLOT_QUERIES, 1, SEM_UNDO };
+  if (mu_slots_op(&op, 1, NULL))
+    return -1;
+  int running = semctl(mu_slots_id, MU_SLOT_QUERIES, GETVAL);
+  int share = (running>1)? mu_slots_budget/running: mu_slots_budget;
+  if (share<1)
+    share = 1;
+  return (ncores<share)? ncores: share;
+}
+
+static void mu_leave(void){
+  if (mu_slots()<=0)
+    return;
+  struct sembuf op = { MU_SLOT_QUERIES, -1, SEM_UNDO };
+  mu_slots_op(&op, 1, NULL);
+}
+
+struct mu_MAP_WORKER {
+  struct mu_DBCONF *conf;
+  const char *mapsql;
+  const char *createtablesql;
+  const char *combinesql;
+  int is_select;
+  const char *cachequery; /* normalized mapsql and createtablesql when map results are cached, or NULL */
+  int coreid;
+  const char *dbname; /* this core's result database */
+  sqlite3 *memdb; /* keeps dbname in memory while open, or NULL once spilled or for a file */
+  struct mu_SPILL *spill;
+  struct mu_SCHEDULE *sched;
+  struct mu_DONEQ *doneq;
+  struct mu_STOP *stop;
+  int nmapped; /* shards mapped into dbname so far */
+  int status;
+  char *errs; /* copied from this worker thread's error buffer */
+};
+
+static int mu_map_shard(struct mu_MAP_WORKER *w, const char *shard, size_t shardnum, int first){
+  struct mu_CACHEKEY key;
+  struct mu_CACHEKEY *cache = NULL;
+  if ((w->cachequery) && (0==mu_cachekey(&key, w->conf->cachedir, w->cachequery, shard))){
+    int fetched = mu_cache_fetch(&key, w->dbname, w->conf->otablename, first);
+    if (fetched<=0){
+      if (fetched)
+	MU_WARN(" shard %s from cache %s\n", shard, key.name);
+      mu_cachekey_free(&key);
+      return fetched;
+    }
+    cache = &key;
+  }
+  struct mu_WARM *warm = w->conf->warm;
+  sqlite3 *db = NULL;
+  if ((warm) && (warm->sharddb) && (warm->readonly==w->conf->readonly)){
+    pthread_mutex_lock(&(warm->shardlock[shardnum]));
+    db = warm->sharddb[shardnum];
+  } else {
+    warm = NULL;
+    db = mu_shard_open(w->conf, shard);
+    if (NULL==db){
+      if (cache)
+	mu_cachekey_free(cache);
+      return -1;
+    }
+  }
+  mu_stop_db(db, w->stop, 1);
+  int status = 0;
+  int attached = 0;
+  int cached = 0;
+  if ((w->is_select) && (cache)){
+    /* the map result is kept in a new cache database, then copied to this core's results */
+    unlink(cache->tmpname);
+    status = mu_sqlite3_execf(db, "attach database %Q as 'resultdb';", w->dbname);
+    attached = (0==status);
+    if (0==status)
+      status = mu_sqlite3_execf(db, "attach database %Q as mu_cache;", cache->tmpname);
+    cached = (attached) && (0==status);
+    if (0==status)
+      status = mu_sqlite3_execf(db, "create table mu_cache.mu_cache as %s", w->mapsql);
+    if (0==status)
+      status = mu_sqlite3_execf(db,
+				"create table mu_cache.mu_cache_key (query text, shard text, ino integer, bytes integer, mtime integer);\n"
+				"insert into mu_cache.mu_cache_key values (%Q, %Q, %lld, %lld, %lld);\n",
+				cache->query, cache->shard, cache->ino, cache->bytes, cache->mtime);
+    if (0==status)
+      status = mu_sqlite3_execf(db,
+				(first)? "create table resultdb.%s as select * from mu_cache.mu_cache;": "insert into resultdb.%s select * from mu_cache.mu_cache;",
+				w->conf->otablename);
+  } else if (w->is_select){
+    status = mu_sqlite3_execf(db, "attach database %Q as 'resultdb';", w->dbname);
+    attached = (0==status);
+    if (0==status)
+      status = mu_sqlite3_execf(db,
+				(first)? "create table resultdb.%s as %s": "insert into resultdb.%s %s",
+				w->conf->otablename,
+				w->mapsql);
+  } else {
+    status = mu_sqlite3_exec(db, w->mapsql);
+  }
+  if (status)
+    MU_WARN(" shard %s\n", shard);
+  if (warm){
+    /* leave the shared connection as we found it */
+    mu_stop_db(db, NULL, 0);
+    if (!sqlite3_get_autocommit(db))
+      sqlite3_exec(db, "rollback;", NULL, NULL, NULL);
+    if ((cached) && mu_sqlite3_exec(db, "detach database mu_cache;"))
+      status = -1;
+    if ((attached) && mu_sqlite3_exec(db, "detach database resultdb;"))
+      status = -1;
+    pthread_mutex_unlock(&(warm->shardlock[shardnum]));
+  } else {
+    sqlite3_close(db);
+  }
+  if (cache){
+    /* a cache database that fails to appear is only a miss next time */
+    if ((status) || rename(cache->tmpname, cache->name))
+      unlink(cache->tmpname);
+    mu_cachekey_free(cache);
+  }
+  return status;
+}
+
+static int mu_combine_core(struct mu_MAP_WORKER *w){
+  sqlite3 *db = mu_sqlite3_open(w->dbname);
+  if (NULL==db)
+    return -1;
+  mu_stop_db(db, w->stop, 0);
+  int status = (is_mu_select(w->combinesql))?
+    mu_sqlite3_execf(db, mu_combine_select_fmt, w->combinesql, w->conf->otablename, w->conf->otablename):
+    mu_sqlite3_exec(db, w->combinesql);
+  if (status)
+    MU_WARN(" combinesql on map thread %.3d\n", w->coreid);
+  sqlite3_close(db);
+  return status;
+}
+
+static int mu_create_core_table(struct mu_MAP_WORKER *w){
+  sqlite3 *db = mu_sqlite3_open(w->dbname);
+  if (NULL==db)
+    return -1;
+  mu_stop_db(db, w->stop, 0);
+  int status = mu_sqlite3_exec(db, w->createtablesql);
+  if (status)
+    MU_WARN(" createtablesql on map thread %.3d\n", w->coreid);
+  sqlite3_close(db);
+  return status;
+}
+
+static void * mu_map_worker(void *arg){
+  struct mu_MAP_WORKER *w = (struct mu_MAP_WORKER *) arg;
+  const char *shard;
+  size_t shardnum = 0;
+  int created = 0;
+  /* a core budget slot is held while mapping each shard */
+  while (0==w->status){
+    int took = mu_slot_take(w->conf, 1, w->stop);
+    if (took){
+      w->status = (took<0);
+      break;
+    }
+    shard = (mu_stopped(w->stop, 1))? NULL: mu_schedule_next(w->sched, w->coreid, &shardnum);
+    if ((shard) && (w->createtablesql) && (w->is_select) && (!created)){
+      created = 1;
+      w->status = mu_create_core_table(w);
+    }
+    if ((shard) && (0==w->status)){
+      w->status = mu_map_shard(w, shard, shardnum, (0==w->nmapped) && (!created));
+      if (0==w->status)
+	++w->nmapped;
+      if ((0==w->status) && (w->memdb) && (mu_db_bytes(w->memdb)>w->spill->bytes))
+	w->status = mu_spill(w->spill, &(w->memdb), &(w->dbname), w->coreid);
+    }
+    mu_slot_give(1);
+    if (NULL==shard)
+      break;
+  }
+  if ((w->status) && mu_stopped(w->stop, 1)){
+    /* the interrupted shard left no results, and the query warns why it stopped */
+    mu_error_clear();
+    w->status = mu_stopped(w->stop, 0);
+  }
+  if ((0==w->status) && (w->combinesql) && (w->is_select) && (w->nmapped))
+    w->status = mu_combine_core(w);
+  if (w->status)
+    mu_schedule_fail(w->sched);
+  if (mu_error_string()){
+    w->errs = strdup(mu_error_string());
+    mu_error_clear();
+  }
+  mu_doneq_post(w->doneq, w->coreid);
+  return NULL;
+}
+
+/* The reduce reads maptable through a temp view, the union all of the     */
+/* results left in the reduce database and in each attached core database, */
+/* so they are not copied again.  A reduce with any statement but a select */
+/* may modify maptable, which a view can not be, so the attached results   */
+/* are copied into main.maptable for it instead.  sqlite3 attaches at most */
+/* SQLITE_LIMIT_ATTACHED databases, 10 unless built otherwise, and core    */
+/* results are merged down to that many parts first.  With a select        */
+/* combinesql they are merged down to one, combining along the way.        */
+
+static int mu_attach_limit(sqlite3 *db){
+  /* raised as far as this sqlite3 was built to allow */
+  sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, 125);
+  return sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, -1);
+}
+
+static int mu_max_reduce_parts(const char *combinesql){
+  if ((combinesql) && is_mu_select(combinesql))
+    return 1;
+  sqlite3 *db = NULL;
+  int limit = 0;
+  if (SQLITE_OK==sqlite3_open(":memory:", &db))
+    limit = mu_attach_limit(db);
+  sqlite3_close(db);
+  return 1+limit;
+}
+
+/* 1 when every statement of sql, past any sqlite3 shell dot command lines, only reads */
+static int is_mu_select_only(const char *sql){
+  struct mu_TOKENS t;
+  char *s = strdup(sql);
+  if (NULL==s)
+    return 0;
+  char *p = s;
+  while (*p){
+    while ((' '==*p) || ('\t'==*p) || ('\r'==*p))
+      ++p;
+    char *eol = strchr(p, '\n');
+    if ('.'==*p)
+      memset(p, ' ', (eol)? (size_t) (eol-p): strlen(p));
+    p = (eol)? eol+1: p+strlen(p);
+  }
+  int ok = (0==mu_tokenize(s, &t));
+  int i;
+  int start = 1;
+  for(i=0; (i<t.c) && (ok); ++i){
+    /* a with clause may lead to an insert, update or delete */
+    ok = ((!start) || is_mu_tk(&t.v[i], "select") || is_mu_tk(&t.v[i], "values") || is_mu_tk(&t.v[i], "with")) &&
+      (!is_mu_tk(&t.v[i], "insert")) && (!is_mu_tk(&t.v[i], "update")) && (!is_mu_tk(&t.v[i], "delete"));
+    start = (0==t.v[i].depth) && is_mu_tk(&t.v[i], ";");
+  }
+  free(t.v);
+  free(s);
+  return ok;
+}
+
+/* 1 when every statement of sql is a create table or create temp table */
+static int is_mu_create_table_only(const char *sql){
+  struct mu_TOKENS t;
+  if (mu_tokenize(sql, &t))
+    return 0;
+  int ok = 1;
+  int i;
+  int start = 1;
+  for(i=0; (i<t.c) && (ok); ++i){
+    if (start){
+      int k = i+1;
+      if ((k<t.c) && (is_mu_tk(&t.v[k], "temp") || is_mu_tk(&t.v[k], "temporary")))
+	++k;
+      ok = is_mu_tk(&t.v[i], "create") && (k<t.c) && is_mu_tk(&t.v[k], "table");
+    }
+    start = (0==t.v[i].depth) && is_mu_tk(&t.v[i], ";");
+  }
+  free(t.v);
+  return ok;
+}
+
+/* partv[0] is the core whose database the reduce runs in, the others are attached as coredbNNN */
+static int mu_union_view_sql(struct mu_STRBUF *b, const char *otablename, const int *partv, int partc, const char *reducesql){
+  int i;
+  char line[256];
+  if (partc<2)
+    return 0;
+  if (!is_mu_select_only(reducesql)){
+    for(i=1;i<partc;++i){
+      snprintf(line, sizeof(line), "insert into main.%s select * from coredb%.3d.%s;\n", otablename, partv[i], otablename);
+      if (mu_strbuf_adds(b, line))
+	return -1;
+    }
+    return 0;
+  }
+  snprintf(line, sizeof(line), "create temp view %s as select * from main.%s", otablename, otablename);
+  if (mu_strbuf_adds(b, line))
+    return -1;
+  for(i=1;i<partc;++i){
+    snprintf(line, sizeof(line), "\n union all select * from coredb%.3d.%s", partv[i], otablename);
+    if (mu_strbuf_adds(b, line))
+      return -1;
+  }
+  return mu_strbuf_adds(b, ";\n");
+}
+
+/* Tree merge.  Whenever two cores' results are ready, one is folded into  */
+/* the other on a merge thread while the map goes on, and the merged core  */
+/* is ready again once done.  Merges of different pairs run at once, so    */
+/* when the cores finish together the merge is about log2(ncores) deep.    */
+/* A select combinesql is run again on each merged result.                 */
+
+struct mu_MERGE {
+  struct mu_MAP_WORKER *into;
+  struct mu_MAP_WORKER *from;
+  int id; /* posted to the done queue, after the ncores map threads */
+  int status;
+  char *errs;
+};
+
+static void * mu_merge_worker(void *arg){
+  struct mu_MERGE *m = (struct mu_MERGE *) arg;
+  struct mu_MAP_WORKER *w = m->into;
+  const char *otablename = w->conf->otablename;
+  sqlite3 *db = mu_sqlite3_open(w->dbname);
+  mu_stop_db(db, w->stop, 0);
+  m->status = (NULL==db) ||
+    mu_sqlite3_execf(db,
+		     "attach database %Q as 'coredb%.3d';\n"
+		     "insert into %s select * from coredb%.3d.%s;\n"
+		     "detach database 'coredb%.3d';\n",
+		     m->from->dbname, m->from->coreid,
+		     otablename, m->from->coreid, otablename,
+		     m->from->coreid);
+  if ((0==m->status) && (w->combinesql) && is_mu_select(w->combinesql))
+    m->status = mu_sqlite3_execf(db, mu_combine_select_fmt, w->combinesql, otablename, otablename);
+  if (m->status)
+    MU_WARN(" merging map thread %.3d into %.3d\n", m->from->coreid, w->coreid);
+  sqlite3_close(db);
+  if (mu_error_string()){
+    m->errs = strdup(mu_error_string());
+    mu_error_clear();
+  }
+  mu_doneq_post(w->doneq, m->id);
+  return NULL;
+}
+
+/* Sorted runs.  A reduce that only orders maptable, "select * from       */
+/* maptable order by ..." without a limit, is not one sort of every row   */
+/* at the end.  Each core's results are sorted on their own, all at once, */
+/* and the runs are merged through a heap as they are read, straight to   */
+/* the callback.  A sorted export with one key instead indexes each part  */
+/* on the key and cuts the key range at splitters sampled from the        */
+/* indexes, so each core merges and writes a slice of its own, and the    */
+/* slices follow each other in the sort order.                            */
+
+#define MU_SORT_SAMPLES 64 /* per part and slice */
+#define MU_SORT_MAX_RUNS 256 /* connections a merge opens at once; more parts are merged first */
+
+struct mu_SORT {
+  int nkeys;
+  int desc[MU_PLAN_MAX];
+  char *items; /* the keys as leading select items, "k1 as mu_k1, k2 as mu_k2" */
+  char *orderby; /* "1 desc, 2" */
+  char *index; /* "k1 desc, k2" */
+  char *key; /* the first key, which bounds the slices */
+  int nslices; /* 1, or slices of the first key's range, each passed to cb with its own ctxv[] */
+  mu_ROW_CALLBACK cb;
+  void **ctxv;
+  /* set by mu_merge_runs() */
+  struct mu_MAP_WORKER *worker;
+  const int *partv;
+  int partc;
+  struct mu_STOP *stop;
+  int nlive; /* slices with a range, after sampling */
+  struct mu_VALUE *samplev; /* MU_SORT_SAMPLES*nslices per part */
+  int *nsample;
+  struct mu_VALUE *splitv; /* nlive-1 splitters, in output order, then room to sort the samples */
+  sqlite3 **dbv; /* partc runs per slice */
+  sqlite3_stmt **runv;
+  int *rowv; /* runv[] is on a row */
+};
+
+static void mu_free_sort(struct mu_SORT *sort){
+  free(sort->items);
+  free(sort->orderby);
+  free(sort->index);
+  free(sort->key);
+  sort->items = sort->orderby = sort->index = sort->key = NULL;
+}
+
+/* reads the order by of sel into sort, or returns -1 for an order a merge can not follow:
+ * ordinals, collate and nulls first|last */
+static int mu_sort_terms(const struct mu_SELECT *sel, struct mu_SORT *sort){
+  const struct mu_TOKENS *t = &(sel->t);
+  int oat[MU_PLAN_MAX+1];
+  int nterm = (sel->order_a<sel->order_b)? mu_tk_split(t, sel->order_a, sel->order_b, ",", oat, MU_PLAN_MAX): 0;
+  struct mu_STRBUF items = { NULL, 0, 0 };
+  struct mu_STRBUF orderby = { NULL, 0, 0 };
+  struct mu_STRBUF index = { NULL, 0, 0 };
+  struct mu_STRBUF key = { NULL, 0, 0 };
+  int bad = (nterm<=0);
+  int i, k;
+  memset(sort, 0, sizeof(struct mu_SORT));
+  for(i=0; (i<nterm) && (!bad); ++i){
+    int a = oat[i];
+    int b = oat[i+1]-1;
+    int desc = (b>a) && is_mu_tk(&t->v[b-1], "desc");
+    int e = ((desc) || ((b>a) && is_mu_tk(&t->v[b-1], "asc")))? b-1: b;
+    char as[32];
+    char ordinal[32];
+    bad = (e<=a) || ((e==a+1) && (MU_TK_NUMBER==t->v[a].type));
+    for(k=a; (k<e) && (!bad); ++k)
+      bad = (0==t->v[k].depth-t->v[a].depth) && (is_mu_tk(&t->v[k], "collate") || is_mu_tk(&t->v[k], "nulls"));
+    snprintf(as, sizeof(as), " as mu_k%d", i+1);
+    snprintf(ordinal, sizeof(ordinal), "%d%s", i+1, (desc)? " desc": "");
+    sort->desc[i] = desc;
+    bad = bad ||
+      ((i) && (mu_strbuf_adds(&items, ", ") || mu_strbuf_adds(&orderby, ", ") || mu_strbuf_adds(&index, ", "))) ||
+      mu_strbuf_add_tokens(&items, t, a, e) || mu_strbuf_adds(&items, as) ||
+      mu_strbuf_adds(&orderby, ordinal) ||
+      mu_strbuf_add_tokens(&index, t, a, e) || ((desc) && mu_strbuf_adds(&index, " desc")) ||
+      ((0==i) && mu_strbuf_add_tokens(&key, t, a, e));
+  }
+  sort->nkeys = nterm;
+  sort->items = items.s;
+  sort->orderby = orderby.s;
+  sort->index = index.s;
+  sort->key = key.s;
+  if (bad){
+    mu_free_sort(sort);
+    return -1;
+  }
+  return 0;
+}
+
+/* 1 unless createtablesql declares a collation, which the merges' binary comparisons would not follow */
+static int is_mu_collate_free(const char *createtablesql){
+  struct mu_TOKENS ct;
+  if (NULL==createtablesql)
+    return 1;
+  int ok = (0==mu_tokenize(createtablesql, &ct));
+  int i;
+  for(i=0; (i<ct.c) && (ok); ++i)
+    ok = !is_mu_tk(&ct.v[i], "collate");
+  free(ct.v);
+  return ok;
+}
+
+/* plans a merge of sorted runs for a reduce "select * from maptable order by ..." without a limit,
+ * maptable being conf->otablename, or returns -1 */
+static int mu_sort_plan(const struct mu_DBCONF *conf, const struct mu_QUERY *q, struct mu_SORT *sort){
+  struct mu_SELECT sel;
+  if ((NULL==q->reducesql) || (!is_mu_collate_free(q->createtablesql)) || mu_parse_select(q->reducesql, &sel, 1))
+    return -1;
+  const struct mu_TOKENS *t = &(sel.t);
+  int status = -1;
+  if ((sel.items_a+1==sel.items_b) && is_mu_tk(&t->v[sel.items_a], "*") &&
+      (sel.from_a+1==sel.from_b) && is_mu_tk_name(&t->v[sel.from_a], conf->otablename) &&
+      (sel.where_a==sel.where_b) && (sel.group_a==sel.group_b) && (sel.having_a==sel.having_b) &&
+      (sel.limit_a==sel.limit_b))
+    status = mu_sort_terms(&sel, sort);
+  mu_free_select(&sel);
+  return status;
+}
+
+/* null, then numbers, then text, then blobs, as order by ranks them */
+static int mu_type_rank(int type){
+  if (SQLITE_NULL==type)
+    return 0;
+  if ((SQLITE_INTEGER==type) || (SQLITE_FLOAT==type))
+    return 1;
+  return (SQLITE_TEXT==type)? 2: 3;
+}
+
+/* compares column i of the current rows of x and y as order by does with the binary collation */
+static int mu_stmt_cmp(sqlite3_stmt *x, sqlite3_stmt *y, int i){
+  int tx = sqlite3_column_type(x, i);
+  int ty = sqlite3_column_type(y, i);
+  int rank = mu_type_rank(tx);
+  int c = rank-mu_type_rank(ty);
+  if ((c) || (0==rank))
+    return c;
+  if (1==rank){
+    if ((SQLITE_INTEGER==tx) && (SQLITE_INTEGER==ty)){
+      sqlite3_int64 a = sqlite3_column_int64(x, i);
+      sqlite3_int64 b = sqlite3_column_int64(y, i);
+      return (a>b)-(a<b);
+    }
+    long double a = (SQLITE_INTEGER==tx)? (long double) sqlite3_column_int64(x, i): (long double) sqlite3_column_double(x, i);
+    long double b = (SQLITE_INTEGER==ty)? (long double) sqlite3_column_int64(y, i): (long double) sqlite3_column_double(y, i);
+    return (a>b)-(a<b);
+  }
+  const void *a = (2==rank)? (const void *) sqlite3_column_text(x, i): sqlite3_column_blob(x, i);
+  const void *b = (2==rank)? (const void *) sqlite3_column_text(y, i): sqlite3_column_blob(y, i);
+  int na = sqlite3_column_bytes(x, i);
+  int nb = sqlite3_column_bytes(y, i);
+  int n = (na<nb)? na: nb;
+  c = (n>0)? memcmp(a, b, n): 0;
+  return (c)? c: (na>nb)-(na<nb);
+}
+
+static int mu_sample_cmp(const void *a, const void *b){
+  const struct mu_VALUE *x = (const struct mu_VALUE *) a;
+  const struct mu_VALUE *y = (const struct mu_VALUE *) b;
+  int c = mu_type_rank(x->type)-mu_type_rank(y->type);
+  return (c)? c: mu_value_cmp(x, y);
+}
+
+static void mu_bind_value(sqlite3_stmt *stmt, int i, const struct mu_VALUE *v){
+  if (SQLITE_INTEGER==v->type)
+    sqlite3_bind_int64(stmt, i, v->i);
+  else if (SQLITE_FLOAT==v->type)
+    sqlite3_bind_double(stmt, i, v->d);
+  else if (SQLITE_TEXT==v->type)
+    sqlite3_bind_text(stmt, i, v->s, (int) v->n, SQLITE_STATIC);
+}
+
+/* the run of part x sorts before that of part y, ties going to the lower part */
+static int mu_run_less(const struct mu_SORT *sort, sqlite3_stmt **runv, int x, int y){
+  int k;
+  for(k=0;k<sort->nkeys;++k){
+    int c = mu_stmt_cmp(runv[x], runv[y], k);
+    if (c)
+      return (sort->desc[k])? (c>0): (c<0);
+  }
+  return x<y;
+}
+
+static void mu_heap_down(const struct mu_SORT *sort, sqlite3_stmt **runv, int *heap, int n, int i){
+  for(;;){
+    int least = i;
+    int l = 2*i+1;
+    if ((l<n) && mu_run_less(sort, runv, heap[l], heap[least]))
+      least = l;
+    if ((l+1<n) && mu_run_less(sort, runv, heap[l+1], heap[least]))
+      least = l+1;
+    if (least==i)
+      return;
+    int tmp = heap[i];
+    heap[i] = heap[least];
+    heap[least] = tmp;
+    i = least;
+  }
+}
+
+/* indexes one part on the sort keys and samples non-null, non-blob first keys in key order */
+static int mu_sort_part(void *arg, size_t part){
+  struct mu_SORT *sort = (struct mu_SORT *) arg;
+  const char *otablename = sort->worker[0].conf->otablename;
+  int per = MU_SORT_SAMPLES*sort->nslices;
+  struct mu_VALUE *samplev = sort->samplev+part*per;
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_int64 nrows = 0;
+  sqlite3 *db = mu_sqlite3_open(sort->worker[sort->partv[part]].dbname);
+  int status = (NULL==db);
+  mu_stop_db(db, sort->stop, 0);
+  status = status ||
+    mu_sqlite3_execf(db, "create index if not exists mu_sort on %s(%s);", otablename, sort->index);
+  char *sql = (status)? NULL:
+    sqlite3_mprintf("select %s from %s where typeof(%s) in ('integer', 'real', 'text') order by 1;",
+		    sort->key, otablename, sort->key);
+  if ((0==status) && (NULL==sql)){
+    MU_WARN_OOM();
+    status = -1;
+  }
+  if ((0==status) && (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)!=SQLITE_OK)){
+    MU_WARN("sqlite3 reported this error:\n%s\n", sqlite3_errmsg(db));
+    status = -1;
+  }
+  /* the sampled rows are counted once, then every step-th one is kept */
+  int rc = SQLITE_DONE;
+  while ((0==status) && (SQLITE_ROW==(rc = sqlite3_step(stmt))))
+    ++nrows;
+  sqlite3_int64 step = nrows/per+1;
+  sqlite3_int64 r = 0;
+  if ((0==status) && (SQLITE_DONE==rc))
+    sqlite3_reset(stmt);
+  while ((0==status) && (SQLITE_DONE==rc) && (sort->nsample[part]<per) && (SQLITE_ROW==sqlite3_step(stmt))){
+    if ((r++%step)==step/2)
+      mu_value_column(&samplev[sort->nsample[part]++], stmt, 0);
+  }
+  if ((0==status) && (SQLITE_DONE!=rc)){
+    MU_WARN("sqlite3 reported this error:\n%s\n", sqlite3_errmsg(db));
+    status = -1;
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_free(sql);
+  sqlite3_close(db);
+  return status;
+}
+
+/* opens the run of one part for one slice, on its first row */
+static int mu_open_run(void *arg, size_t i){
+  struct mu_SORT *sort = (struct mu_SORT *) arg;
+  const char *otablename = sort->worker[0].conf->otablename;
+  int slice = (int) (i/sort->partc);
+  int part = (int) (i%sort->partc);
+  if (slice>=sort->nlive)
+    return 0;
+  /* ?1 is the splitter before the slice and ?2 the one after it; nulls sort first */
+  const char *range = "";
+  int first = (0==slice);
+  int last = (slice==sort->nlive-1);
+  if ((!first) || (!last)){
+    if (!sort->desc[0])
+      range = (first)? " where %s is null or %s <= ?2": (last)? " where %s > ?1": " where %s > ?1 and %s <= ?2";
+    else
+      range = (first)? " where %s >= ?2": (last)? " where %s < ?1 or %s is null": " where %s < ?1 and %s >= ?2";
+  }
+  char *where = sqlite3_mprintf(range, sort->key, sort->key);
+  char *sql = (where)? sqlite3_mprintf("select %s, * from %s%s order by %s;", sort->items, otablename, where, sort->orderby): NULL;
+  sqlite3_free(where);
+  if (NULL==sql){
+    MU_WARN_OOM();
+    return -1;
+  }
+  sqlite3 *db = sort->dbv[i] = mu_sqlite3_open(sort->worker[sort->partv[part]].dbname);
+  int status = (NULL==db);
+  mu_stop_db(db, sort->stop, 0);
+  if ((0==status) && (sqlite3_prepare_v2(db, sql, -1, &(sort->runv[i]), NULL)!=SQLITE_OK)){
+    MU_WARN("sqlite3 reported this error:\n%s\n", sqlite3_errmsg(db));
+    status = -1;
+  }
+  sqlite3_free(sql);
+  if (status)
+    return -1;
+  if (!first)
+    mu_bind_value(sort->runv[i], 1, &(sort->splitv[slice-1]));
+  if (!last)
+    mu_bind_value(sort->runv[i], 2, &(sort->splitv[slice]));
+  int rc = sqlite3_step(sort->runv[i]);
+  sort->rowv[i] = (SQLITE_ROW==rc);
+  if ((SQLITE_ROW!=rc) && (SQLITE_DONE!=rc)){
+    MU_WARN("sqlite3 reported this error:\n%s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  return 0;
+}
+
+/* passes the rows of one slice to cb in order and returns 0, -1 on error or the nonzero value of cb that stopped it */
+static int mu_merge_slice(void *arg, size_t slice){
+  struct mu_SORT *sort = (struct mu_SORT *) arg;
+  sqlite3_stmt **runv = sort->runv+slice*sort->partc;
+  int *rowv = sort->rowv+slice*sort->partc;
+  int heap[sort->partc];
+  int n = 0;
+  int i;
+  for(i=0;i<sort->partc;++i){
+    if (rowv[i])
+      heap[n++] = i;
+  }
+  if (0==n)
+    return 0;
+  int ncol = sqlite3_column_count(runv[heap[0]])-sort->nkeys;
+  struct mu_COLUMN *colv = calloc((ncol>0)? ncol: 1, sizeof(struct mu_COLUMN));
+  if (NULL==colv){
+    MU_WARN_OOM();
+    return -1;
+  }
+  for(i=0;i<ncol;++i)
+    colv[i].name = sqlite3_column_name(runv[heap[0]], sort->nkeys+i);
+  for(i=n/2-1;i>=0;--i)
+    mu_heap_down(sort, runv, heap, n, i);
+  int stopped = 0;
+  while ((n>0) && (0==stopped)){
+    sqlite3_stmt *run = runv[heap[0]];
+    mu_stmt_columns(run, sort->nkeys, ncol, colv);
+    stopped = sort->cb(sort->ctxv[slice], ncol, colv);
+    if (stopped)
+      break;
+    int rc = sqlite3_step(run);
+    if (SQLITE_ROW!=rc){
+      if (SQLITE_DONE!=rc){
+	MU_WARN("sqlite3 reported this error:\n%s\n", sqlite3_errmsg(sqlite3_db_handle(run)));
+	stopped = -1;
+      }
+      heap[0] = heap[--n];
+    }
+    mu_heap_down(sort, runv, heap, n, 0);
+  }
+  free(colv);
+  return stopped;
+}
+
+/* merges the sorted runs of the parts partv[] of the map results, and returns 0, -1 on error
+ * or the nonzero value of cb that stopped it */
+static int mu_merge_runs(struct mu_SORT *sort, struct mu_MAP_WORKER *worker, const int *partv, int partc, struct mu_STOP *stop){
+  if (0==partc)
+    return 0;
+  int nrun = sort->nslices*partc;
+  int per = MU_SORT_SAMPLES*sort->nslices;
+  int status = 0;
+  int i, j;
+  sort->worker = worker;
+  sort->partv = partv;
+  sort->partc = partc;
+  sort->stop = stop;
+  sort->nlive = 1;
+  sort->dbv = calloc(nrun, sizeof(sqlite3 *));
+  sort->runv = calloc(nrun, sizeof(sqlite3_stmt *));
+  sort->rowv = calloc(nrun, sizeof(int));
+  if (sort->nslices>1){
+    sort->samplev = calloc(per*partc, sizeof(struct mu_VALUE));
+    sort->nsample = calloc(partc, sizeof(int));
+    sort->splitv = calloc(per*partc+sort->nslices, sizeof(struct mu_VALUE));
+  }
+  if ((NULL==sort->dbv) || (NULL==sort->runv) || (NULL==sort->rowv) ||
+      ((sort->nslices>1) && ((NULL==sort->samplev) || (NULL==sort->nsample) || (NULL==sort->splitv)))){
+    MU_WARN_OOM();
+    status = -1;
+  }
+  if ((0==status) && (sort->nslices>1))
+    status = mu_each_shard(partc, partc, mu_sort_part, sort);
+  if ((0==status) && (sort->nslices>1)){
+    /* the samples of every part, sorted, are cut into nslices equal shares */
+    struct mu_VALUE *all = sort->splitv+sort->nslices;
+    int m = 0;
+    for(i=0;i<partc;++i){
+      for(j=0;j<sort->nsample[i];++j)
+	all[m++] = sort->samplev[i*per+j];
+    }
+    qsort(all, m, sizeof(struct mu_VALUE), mu_sample_cmp);
+    if (m>0){
+      sort->nlive = sort->nslices;
+      for(j=0;j+1<sort->nlive;++j)
+	sort->splitv[j] = all[(sort->desc[0])? ((sort->nlive-1-j)*m)/sort->nlive: ((j+1)*m)/sort->nlive];
+    }
+  }
+  if (0==status)
+    status = mu_each_shard(nrun, partc, mu_open_run, sort);
+  if (0==status)
+    status = (1==sort->nlive)? mu_merge_slice(sort, 0): mu_each_shard(sort->nlive, sort->nlive, mu_merge_slice, sort);
+  for(i=0;i<nrun;++i){
+    if (sort->runv)
+      sqlite3_finalize(sort->runv[i]);
+    if (sort->dbv)
+      sqlite3_close(sort->dbv[i]);
+  }
+  for(i=0; (sort->samplev) && (i<per*partc); ++i)
+    free(sort->samplev[i].s);
+  free(sort->samplev);
+  free(sort->nsample);
+  free(sort->splitv);
+  free(sort->dbv);
+  free(sort->runv);
+  free(sort->rowv);
+  sort->samplev = sort->splitv = NULL;
+  sort->nsample = NULL;
+  sort->dbv = NULL;
+  sort->runv = NULL;
+  sort->rowv = NULL;
+  return status;
+}
+
+/* Shuffle.  A reduce that groups maptable by columns, without an order    */
+/* by or limit, keeps every group within one bucket of the hash of its     */
+/* key.  When the map results are large each part is indexed on the bucket */
+/* of its rows, one reducer per core runs the reduce on one bucket of      */
+/* every part at once, and the reducers' outputs are passed on in bucket   */
+/* order instead of funneling every group through one reduce.              */
+
+#define MU_SHUFFLE_MIN_ROWS 100000 /* fewer map result rows are reduced at once */
+
+struct mu_SHUFFLE {
+  char *keys; /* the group by columns, "k1, k2" */
+  char *sql; /* the reduce without its trailing ; */
+  int nbuckets;
+  struct mu_MAP_WORKER *worker;
+  const int *partv;
+  int partc;
+  struct mu_STOP *stop;
+  sqlite3 **dbv; /* nbuckets reducers, each holding its output in temp.mu_reduced */
+};
+
+/* mu_bucket(n, k1, k2, ...) is in [0,n), and alike for keys that group together:
+ * integral floats hash as integers, as 7.0 groups with 7 */
+static void mu_bucket_func(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  sqlite3_int64 n = sqlite3_value_int64(argv[0]);
+  uint64_t h = MU_FNV1A_BASIS;
+  int k;
+  for(k=1;k<argc;++k){
+    sqlite3_value *v = argv[k];
+    int type = sqlite3_value_type(v);
+    sqlite3_int64 i = 0;
+    double d = 0.0;
+    char buf[32];
+    const char *s = NULL;
+    size_t len = 0;
+    if (SQLITE_FLOAT==type){
+      d = sqlite3_value_double(v);
+      if ((d>=-9223372036854775808.0) && (d<9223372036854775808.0) && (d==(double) (sqlite3_int64) d)){
+	type = SQLITE_INTEGER;
+	i = (sqlite3_int64) d;
+      }
+    } else if (SQLITE_INTEGER==type)
+      i = sqlite3_value_int64(v);
+    if (SQLITE_INTEGER==type){
+      snprintf(buf, sizeof(buf), "%lld", (long long) i);
+      s = buf;
+      len = strlen(buf);
+    } else if (SQLITE_FLOAT==type){
+      s = (const char *) &d;
+      len = sizeof(d);
+    } else if (SQLITE_TEXT==type){
+      s = (const char *) sqlite3_value_text(v);
+      len = (size_t) sqlite3_value_bytes(v);
+    } else if (SQLITE_BLOB==type){
+      s = (const char *) sqlite3_value_blob(v);
+      len = (size_t) sqlite3_value_bytes(v);
+    }
+    char tag = (char) ('0'+type);
+    h = mu_fnv1a(mu_fnv1a(mu_fnv1a(h, &tag, 1), (s)? s: "", (s)? len: 0), "\x1f", 1);
+  }
+  sqlite3_result_int(ctx, ((n>0) && (n<=(1<<30)))? mu_hash_shard(h, (int) n): 0);
+}
+
+static sqlite3 * mu_shuffle_open(struct mu_SHUFFLE *sh, const char *dbname){
+  sqlite3 *db = mu_sqlite3_open(dbname);
+  if (NULL==db)
+    return NULL;
+  if (SQLITE_OK!=sqlite3_create_function(db, "mu_bucket", -1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, mu_bucket_func, NULL, NULL)){
+    MU_WARN("sqlite3 reported this error:\n%s\n", sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return NULL;
+  }
+  mu_stop_db(db, sh->stop, 0);
+  return db;
+}
+
+static void mu_free_shuffle(struct mu_SHUFFLE *sh){
+  int i;
+  for(i=0; (sh->dbv) && (i<sh->nbuckets); ++i)
+    sqlite3_close(sh->dbv[i]);
+  free(sh->dbv);
+  free(sh->keys);
+  free(sh->sql);
+  memset(sh, 0, sizeof(struct mu_SHUFFLE));
+}
+
+/* plans a shuffle of the map results in partv[] for a reduce "select ... from maptable [where ...] group by c1, c2 [having ...]",
+ * with no other mention of maptable, into nbuckets buckets, or returns -1 for a reduce run at once.
+ * Each bucket sees only its own groups, so window functions, select distinct and compound selects,
+ * which combine rows of different groups, are run at once */
+static int mu_shuffle_plan(const struct mu_QUERY *q, struct mu_MAP_WORKER *worker, const int *partv, int partc, int nbuckets, struct mu_SHUFFLE *sh){
+  struct mu_SELECT sel;
+  memset(sh, 0, sizeof(struct mu_SHUFFLE));
+  if ((nbuckets<2) || (partc<1) || mu_parse_select(q->reducesql, &sel, 1))
+    return -1;
+  const struct mu_TOKENS *t = &(sel.t);
+  const char *otablename = worker[0].conf->otablename;
+  struct mu_STRBUF keys = { NULL, 0, 0 };
+  struct mu_STRBUF sql = { NULL, 0, 0 };
+  int gat[MU_PLAN_MAX+1];
+  int ngroup = (sel.group_a<sel.group_b)? mu_tk_split(t, sel.group_a, sel.group_b, ",", gat, MU_PLAN_MAX): 0;
+  int ok = (ngroup>0) &&
+    (sel.from_a+1==sel.from_b) && is_mu_tk_name(&t->v[sel.from_a], otablename) &&
+    (sel.order_a==sel.order_b) && (sel.limit_a==sel.limit_b);
+  int i, n;
+  for(i=0; (i<t->c) && (ok); ++i){
+    const struct mu_TOKEN *tk = &t->v[i];
+    ok = ((i==sel.from_a) || (!is_mu_tk_name(tk, otablename))) &&
+      (!is_mu_tk(tk, "over")) && (!is_mu_tk(tk, "window")) &&
+      (!is_mu_tk(tk, "union")) && (!is_mu_tk(tk, "intersect")) && (!is_mu_tk(tk, "except")) &&
+      (!((0==tk->depth) && is_mu_tk(tk, "distinct")));
+  }
+  /* each key is a bare column name; a collation declared by the createtablesql could group differently than the hash */
+  for(i=0; (i<ngroup) && (ok); ++i){
+    const struct mu_TOKEN *tk = &t->v[gat[i]];
+    ok = (gat[i+1]-1==gat[i]+1) && ((MU_TK_WORD==tk->type) || (MU_TK_ID==tk->type)) &&
+      (0==((i) && mu_strbuf_adds(&keys, ", "))) &&
+      (0==mu_strbuf_add_tokens(&keys, t, gat[i], gat[i]+1));
+  }
+  ok = (ok) && is_mu_collate_free(q->createtablesql);
+  for(n=t->c; (n>0) && is_mu_tk(&t->v[n-1], ";"); --n)
+    ;
+  ok = (ok) && (0==mu_strbuf_add_tokens(&sql, t, 0, n));
+  mu_free_select(&sel);
+  sh->keys = keys.s;
+  sh->sql = sql.s;
+  sh->nbuckets = nbuckets;
+  sh->worker = worker;
+  sh->partv = partv;
+  sh->partc = partc;
+  /* the keys must be columns of maptable, and the results large enough to be worth it */
+  sqlite3_int64 nrows = 0;
+  for(i=0; (i<partc) && (ok) && (nrows<MU_SHUFFLE_MIN_ROWS); ++i){
+    sqlite3 *db = mu_sqlite3_open(worker[partv[i]].dbname);
+    sqlite3_stmt *stmt = NULL;
+    char *count = sqlite3_mprintf("select count(*), exists (select %s from main.%s) from main.%s;", sh->keys, otablename, otablename);
+    ok = (NULL!=count) && (NULL!=db) &&
+      (SQLITE_OK==sqlite3_prepare_v2(db, count, -1, &stmt, NULL)) &&
+      (SQLITE_ROW==sqlite3_step(stmt));
+    if (ok)
+      nrows += sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    sqlite3_free(count);
+  }
+  if ((!ok) || (nrows<MU_SHUFFLE_MIN_ROWS)){
+    mu_free_shuffle(sh);
+    return -1;
+  }
+  return 0;
+}
+
+static int mu_shuffle_index(void *arg, size_t i){
+  struct mu_SHUFFLE *sh = (struct mu_SHUFFLE *) arg;
+  const char *otablename = sh->worker[0].conf->otablename;
+  sqlite3 *db = mu_shuffle_open(sh, sh->worker[sh->partv[i]].dbname);
+  int status = (NULL==db) ||
+    mu_sqlite3_execf(db, "create index if not exists mu_shuffle on %s(mu_bucket(%d, %s));", otablename, sh->nbuckets, sh->keys);
+  sqlite3_close(db);
+  return status;
+}
+
+/* runs the reduce on bucket b of every part, through a maptable view of just those rows */
+static int mu_shuffle_bucket(void *arg, size_t b){
+  struct mu_SHUFFLE *sh = (struct mu_SHUFFLE *) arg;
+  const char *otablename = sh->worker[0].conf->otablename;
+  sqlite3 *db = sh->dbv[b] = mu_shuffle_open(sh, sh->worker[sh->partv[0]].dbname);
+  struct mu_STRBUF view = { NULL, 0, 0 };
+  char line[256];
+  int failed = (NULL==db);
+  int i;
+  if (db)
+    mu_attach_limit(db);
+  for(i=1; (i<sh->partc) && (!failed); ++i)
+    failed = mu_sqlite3_execf(db, "attach database %Q as 'coredb%.3d';", sh->worker[sh->partv[i]].dbname, sh->partv[i]);
+  for(i=0; (i<sh->partc) && (!failed); ++i){
+    if (i)
+      snprintf(line, sizeof(line), "\n union all select * from coredb%.3d.%s", sh->partv[i], otablename);
+    else
+      snprintf(line, sizeof(line), "create temp view %s as select * from main.%s", otablename, otablename);
+    snprintf(line+strlen(line), sizeof(line)-strlen(line), " where mu_bucket(%d, ", sh->nbuckets);
+    failed = mu_strbuf_adds(&view, line) || mu_strbuf_adds(&view, sh->keys);
+    snprintf(line, sizeof(line), ")=%d", (int) b);
+    failed = failed || mu_strbuf_adds(&view, line);
+  }
+  failed = failed || mu_strbuf_adds(&view, ";\n") || mu_sqlite3_exec(db, view.s) ||
+    mu_sqlite3_execf(db, "create temp table mu_reduced as %s;", sh->sql);
+  free(view.s);
+  return (failed)? -1: 0;
+}
+
+/* reduces the map results in parts by bucket, and returns 0, -1 on error or the nonzero value of cb that stopped it */
+static int mu_shuffle_reduce(struct mu_SHUFFLE *sh, struct mu_STOP *stop, mu_ROW_CALLBACK cb, void *ctx){
+  int stopped = 0;
+  int b;
+  sh->stop = stop;
+  sh->dbv = calloc(sh->nbuckets, sizeof(sqlite3 *));
+  if (NULL==sh->dbv){
+    MU_WARN_OOM();
+    return -1;
+  }
+  if (mu_each_shard(sh->partc, sh->partc, mu_shuffle_index, sh) ||
+      mu_each_shard(sh->nbuckets, sh->nbuckets, mu_shuffle_bucket, sh))
+    return -1;
+  for(b=0; (b<sh->nbuckets) && (0==stopped); ++b)
+    stopped = mu_sqlite3_exec_rows(sh->dbv[b], "select * from temp.mu_reduced;", cb, ctx);
+  return stopped;
+}
+
+/* a sqlite3 database serialized by sqlite3_serialize() */
+struct mu_IMAGE {
+  unsigned char *bytes; /* from sqlite3_malloc, or NULL for no map results */
+  sqlite3_int64 size;
+};
+
+/* passes the reduce output to cb and returns 0, -1 on error or the nonzero value of cb that stopped it.
+ * Given an image, the map results are instead merged into one database and serialized there, without the reduce.
+ * Given a sort, the reduce is a merge of each part's sorted run, to sort->cb */
+static int mu_run_admitted_threads(struct mu_DBCONF *conf, struct mu_QUERY *q, const char *use, int ncores, mu_ROW_CALLBACK cb, void *ctx, struct mu_IMAGE *image, struct mu_SORT *sort, struct mu_STOP *stop){
+
+  const char *errormsg_on_start = "Fatal error detected by mu_query() attempting to start a map thread ";
+  const char *errormsg_on_finish_map = "Fatal error detected by mu_query() in map task";
+  const char *errormsg_on_finish_reduce = "Fatal error detected by mu_query() in reduce task";
+
+  /* results in memory need a temp directory only if they spill */
+  struct mu_SPILL spill = { PTHREAD_MUTEX_INITIALIZER, conf->spillbytes, NULL };
+  const char *tmpdir = (conf->spillbytes>0)? NULL: mu_create_temp_dir();
+  if ((NULL==tmpdir) && (conf->spillbytes<=0))
+    return -1;
+
+  int icore;
+  int started = 0;
+  int failed = 0;
+  pthread_t tid[ncores];
+  struct mu_MAP_WORKER worker[ncores];
+  memset(worker, 0, sizeof(worker));
+
+  /* map threads post 0..ncores-1 when done, merges ncores and up */
+  int donecore[2*ncores];
+  struct mu_DONEQ doneq = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, donecore };
+  pthread_t mergetid[ncores];
+  struct mu_MERGE merge[ncores];
+  memset(merge, 0, sizeof(merge));
+
+  struct mu_SCHEDULE *sched = mu_schedule_create(ncores, conf->shardc, conf->shardv, conf->shardinfo, use);
+  if (NULL==sched){
+    free((void *) tmpdir);
+    return -1;
+  }
+
+  char *cachequery = NULL;
+  if ((conf->cachedir) && is_mu_select(q->mapsql)){
+    if (mkdir(conf->cachedir, 0700) && (errno!=EEXIST)){
+      MU_WARN("mu_query() could not create the cache directory %s\n", conf->cachedir);
+      MU_WARN_IF_ERRNO();
+      failed = 1;
+    }
+    char *m = mu_normalize_sql(q->mapsql);
+    char *c = mu_normalize_sql(q->createtablesql);
+    cachequery = (m)? sqlite3_mprintf("%s\x1e%s", m, (c)? c: ""): NULL;
+    free(m);
+    free(c);
+  }
+
+  char *topk = (q->combinesql)? NULL: mu_topk_combinesql(conf->otablename, q->reducesql);
+  const char *combinesql = (q->combinesql)? q->combinesql: topk;
+
+  for(icore=0;icore<ncores;++icore){
+    struct mu_MAP_WORKER *w = &worker[icore];
+    w->conf = conf;
+    w->mapsql = q->mapsql;
+    w->createtablesql = q->createtablesql;
+    w->combinesql = combinesql;
+    w->is_select = is_mu_select(q->mapsql);
+    w->cachequery = cachequery;
+    w->coreid = icore;
+    w->dbname = (tmpdir)? mu_temp_name(tmpdir, "mapsql.db", icore): mu_memdb_name(icore);
+    w->spill = &spill;
+    w->sched = sched;
+    w->doneq = &doneq;
+    w->stop = stop;
+    if (NULL==w->dbname){
+      failed = 1;
+      break;
+    }
+    if ((NULL==tmpdir) && (NULL==(w->memdb = mu_memdb_open(w->dbname, conf->spillbytes)))){
+      failed = 1;
+      break;
+    }
+  }
+
+  for(icore=0; (icore<ncores) && (!failed); ++icore){
+    if ( (conf->warm)?
+	 mu_pool_submit(conf->warm, mu_map_worker, &worker[icore]):
+	 pthread_create(&tid[icore], NULL, mu_map_worker, &worker[icore]) ){
+      MU_WARN("%s\n", errormsg_on_start);
+      mu_schedule_fail(sched);
+      failed = 1;
+      break;
+    }
+    ++started;
+  }
+
+  /* ready[] holds the cores whose results are complete and not being merged */
+
+  int ready[ncores];
+  int nready = 0;
+  int nmerge = 0;
+  int running = started;
+  int maxparts = (image)? 1: mu_max_reduce_parts(combinesql);
+  if ((sort) && (maxparts>1)){
+    /* each part is one sorted run, and each slice opens one connection per part */
+    maxparts = ncores;
+    if (maxparts*sort->nslices>MU_SORT_MAX_RUNS)
+      maxparts = (MU_SORT_MAX_RUNS/sort->nslices>1)? MU_SORT_MAX_RUNS/sort->nslices: 1;
+  }
+  int halted = 0; /* stopped by mu_cancel() or the timeout */
+  int k;
+  for(k=0; running>0; ++k){
+    int id = mu_doneq_wait(&doneq, k);
+    --running;
+    if ((!halted) && mu_stopped(stop, 0)){
+      mu_warn_stopped(stop);
+      mu_schedule_fail(sched);
+      failed = halted = 1;
+    }
+    if (id>=ncores){
+      struct mu_MERGE *m = &merge[id-ncores];
+      if (NULL==conf->warm)
+	pthread_join(mergetid[id-ncores], NULL);
+      if ((m->errs) && (!halted))
+	MU_WARN("%s", m->errs);
+      if ((m->status) && (!halted)){
+	MU_WARN("%s\n", errormsg_on_finish_reduce);
+	mu_schedule_fail(sched);
+	failed = 1;
+      }
+      ready[nready++] = m->into->coreid;
+    } else {
+      icore = id;
+      if (NULL==conf->warm)
+	pthread_join(tid[icore], NULL);
+      struct mu_MAP_WORKER *w = &worker[icore];
+      q->nmapped += w->nmapped;
+      if ((w->errs) && (!halted))
+	MU_WARN("%s", w->errs);
+      if (w->status){
+	if (!halted){
+	  MU_WARN("%s\n", errormsg_on_finish_map);
+	  MU_WARN("map thread %.3d\n", icore);
+	}
+	failed = 1;
+	continue;
+      }
+      if (((NULL==q->reducesql) && (NULL==image) && (NULL==sort)) || (!w->is_select) || (0==w->nmapped))
+	continue;
+      ready[nready++] = icore;
+    }
+    /* every running map or merge thread may still add one more part */
+    while ((nready>=2) && (nready+running>maxparts) && (!failed)){
+      struct mu_MERGE *m = &merge[nmerge];
+      m->into = &worker[ready[nready-2]];
+      m->from = &worker[ready[nready-1]];
+      m->id = ncores+nmerge;
+      if ( (conf->warm)?
+	   mu_pool_submit(conf->warm, mu_merge_worker, m):
+	   pthread_create(&mergetid[nmerge], NULL, mu_merge_worker, m) ){
+	MU_WARN("%s\n", errormsg_on_start);
+	mu_schedule_fail(sched);
+	failed = 1;
+	break;
+      }
+      nready -= 2;
+      ++nmerge;
+      ++running;
+    }
+  }
+
+  sqlite3 *db = NULL;
+  int stopped = 0;
+  struct mu_SHUFFLE shuffle;
+  /* a partial query that mapped no shard reduces an empty maptable, or returns no rows when its columns are unknown */
+  int empty = (!failed) && (q->partial) && (0==nready) && (NULL==image) && is_mu_select(q->mapsql);
+  if ((empty) && (q->createtablesql)){
+    /* core 0 may have created it before the deadline stopped its first shard */
+    db = mu_sqlite3_open(worker[0].dbname);
+    int exists = (db) && (SQLITE_OK==sqlite3_table_column_metadata(db, NULL, conf->otablename, NULL, NULL, NULL, NULL, NULL, NULL));
+    sqlite3_close(db);
+    db = NULL;
+    failed = (!exists) && mu_create_core_table(&worker[0]);
+    ready[nready++] = 0;
+    empty = 0;
+  }
+  if (empty)
+    stopped = 0;
+  else if ((!failed) && (image) && (nready)){
+    db = mu_sqlite3_open(worker[ready[0]].dbname);
+    image->bytes = (db)? sqlite3_serialize(db, "main", &(image->size), 0): NULL;
+    failed = (NULL==image->bytes);
+    if (failed)
+      MU_WARN("%s\n", "Fatal error detected by mu_query() serializing the map results");
+  } else if ((!failed) && (sort)){
+    stopped = mu_merge_runs(sort, worker, ready, nready, stop);
+    if ((-1==stopped) && mu_stopped(stop, 0)){
+      mu_warn_stopped(stop);
+      halted = 1;
+    }
+    if (-1==stopped){
+      MU_WARN("%s\n", errormsg_on_finish_reduce);
+      failed = 1;
+    }
+  } else if ((!failed) && (q->reducesql) && (NULL==image) && (cb) &&
+	     (0==mu_shuffle_plan(q, worker, ready, nready, ncores, &shuffle))){
+    stopped = mu_shuffle_reduce(&shuffle, stop, cb, ctx);
+    mu_free_shuffle(&shuffle);
+    if ((-1==stopped) && mu_stopped(stop, 0)){
+      mu_warn_stopped(stop);
+      halted = 1;
+    }
+    if (-1==stopped){
+      MU_WARN("%s\n", errormsg_on_finish_reduce);
+      failed = 1;
+    }
+  } else if ((!failed) && (q->reducesql) && (NULL==image)){
+    db = mu_sqlite3_open(worker[(nready)? ready[0]: 0].dbname);
+    struct mu_STRBUF view = { NULL, 0, 0 };
+    if (db)
+      mu_attach_limit(db);
+    mu_stop_db(db, stop, 0);
+    for(k=1; (k<nready) && (!failed); ++k)
+      failed = mu_sqlite3_execf(db, "attach database %Q as 'coredb%.3d';", worker[ready[k]].dbname, ready[k]);
+    failed = failed || (NULL==db) ||
+      mu_union_view_sql(&view, conf->otablename, ready, nready, q->reducesql) ||
+      ((view.s) && mu_sqlite3_exec(db, view.s));
+    if (!failed)
+      stopped = mu_sqlite3_exec_rows(db, q->reducesql, cb, ctx);
+    free(view.s);
+    if ((-1==stopped) && mu_stopped(stop, 0)){
+      mu_warn_stopped(stop);
+      halted = 1;
+    }
+    if ((failed) || (-1==stopped))
+      MU_WARN("%s\n", errormsg_on_finish_reduce);
+    failed = failed || (-1==stopped);
+  }
+  sqlite3_close(db);
+
+  for(icore=0;icore<ncores;++icore){
+    sqlite3_close(worker[icore].memdb);
+    free((void *) worker[icore].dbname);
+    free(worker[icore].errs);
+    free(merge[icore].errs);
+  }
+  mu_schedule_free(sched);
+  free(topk);
+  if ((cachequery) && (conf->cachebytes>0))
+    mu_cache_trim(conf->cachedir, conf->cachebytes);
+  sqlite3_free(cachequery);
+  if (NULL==tmpdir)
+    tmpdir = spill.tmpdir;
+
+  if (failed){
+    /* a failed query leaves its temp files to look at, a stopped one does not */
+    if ((halted) && (tmpdir))
+      mu_remove_temp_dir(tmpdir);
+    free((void *) tmpdir);
+    return -1;
+  }
+  if (tmpdir)
+    mu_remove_temp_dir(tmpdir);
+  free((void *) tmpdir);
+  return stopped;
+}
+
+/* Each core's results are merged by sqlite3 processes in rounds.  In the   */
+/* round with step s, core i+s is folded into core i for every i that is a  */
+/* multiple of 2s, all at once, so core 0 holds everything after about     */
+/* log2(ncores) rounds, or fewer once at most maxparts are left.  A select  */
+/* combinesql is run again on each merged result.                           */
+
+static int mu_write_merge_task(struct mu_DBCONF *conf, struct mu_SQLITE3_TASK *task, int from, const char *fromdbname, const char *combinesql){
+  const char *ext = mu_sqlite3_extensions();
+  FILE *f = mu_fopen(task->iname, "w");
+  if (NULL==f)
+    return -1;
+  MU_FPRINTF(task->iname, -1, f, "%s\n", ".bail on");
+  if (ext)
+    MU_FPRINTF(task->iname, -1, f, "%s\n", ext);
+  MU_FPRINTF(task->iname, -1, f,
+	     "attach database '%s' as 'coredb%.3d';\n"
+	     "insert into %s select * from coredb%.3d.%s;\n"
+	     "detach database 'coredb%.3d';\n",
+	     fromdbname, from,
+	     conf->otablename, from, conf->otablename,
+	     from);
+  if ((combinesql) && is_mu_select(combinesql))
+    MU_FPRINTF(task->iname, -1, f, mu_combine_select_fmt, combinesql, conf->otablename, conf->otablename);
+  MU_FCLOSE_W(task->iname, -1, f);
+  return 0;
+}
+
+/* a sort is planned here for a reduce that only orders maptable, when there is no sort given */
+static int mu_run_query_threads(struct mu_DBCONF *conf, struct mu_QUERY *q, const char *use, int ncores, mu_ROW_CALLBACK cb, void *ctx, struct mu_IMAGE *image, struct mu_SORT *sort){
+  struct mu_STOP stop;
+  mu_stop_init(&stop, q);
+  size_t i;
+  q->nshards = 0;
+  q->nmapped = 0;
+  for(i=0;i<conf->shardc;++i)
+    q->nshards += (0!=use[i]);
+  int share = mu_admit(ncores);
+  if (share<0)
+    return -1;
+  struct mu_SORT plan;
+  void *ctxv[1] = { ctx };
+  if ((NULL==sort) && (cb) && (NULL==image) && (0==mu_sort_plan(conf, q, &plan))){
+    plan.nslices = 1;
+    plan.cb = cb;
+    plan.ctxv = ctxv;
+    sort = &plan;
+  }
+  int status = mu_run_admitted_threads(conf, q, use, share, cb, ctx, image, sort, &stop);
+  mu_leave();
+  if (sort==&plan)
+    mu_free_sort(&plan);
+  return status;
+}
+
+/* returns the step between the cores left holding results, or -1 on error */
+static int mu_merge_tasks(struct mu_DBCONF *conf, const char *tmpdir, struct mu_SQLITE3_TASK **core, int ncores, const char *combinesql, int maxparts, const struct mu_STOP *stop){
+  const char *errormsg_on_start = "Fatal error detected by mu_query() attempting to start sqlite3 ";
+  const char *errormsg_on_finish_merge = "Fatal error detected by mu_query() in merge task";
+  struct mu_SQLITE3_TASK *merge[ncores];
+  int failed = 0;
+  int ntask = 0;
+  int step;
+  for(step=1; ((ncores+step-1)/step>maxparts) && (!failed); step*=2){
+    int i;
+    int n = 0;
+    for(i=0; (i+step<ncores) && (!failed); i+=2*step){
+      struct mu_SQLITE3_TASK *task = mu_define_task(tmpdir, core[i]->dbname, "mergesql", ntask++);
+      failed = (NULL==task) ||
+	mu_write_merge_task(conf, task, i+step, core[i+step]->dbname, combinesql) ||
+	mu_start_task(task, errormsg_on_start);
+      if (task)
+	merge[n++] = task;
+    }
+    /* every started sqlite3 is waited for, even after a failure, or killed once the query stops */
+    for(i=0;i<n;++i){
+      if ((merge[i]->pid) && (mu_wait_task(merge[i], stop) || mu_finish_task(merge[i], errormsg_on_finish_merge)))
+	failed = 1;
+      mu_free_task(merge[i]);
+    }
+  }
+  return (failed)? -1: step;
+}
+
+static int mu_run_agents(struct mu_DBCONF *conf, struct mu_QUERY *q, mu_ROW_CALLBACK cb, void *ctx);
+
+int mu_query_uses_threads(struct mu_DBCONF *conf, const struct mu_QUERY *q){
+  /* map results are only cached, kept in memory or reduced in part by the thread engine, so each selects it */
+  return (conf) && (q) &&
+    ((MU_ENGINE_THREADS==conf->engine) || (conf->cachedir) || (conf->spillbytes>0) || (conf->agents) || (q->partial)) &&
+    is_mu_dot_free(q->mapsql) &&
+    is_mu_dot_free(q->createtablesql) &&
+    is_mu_dot_free(q->combinesql) &&
+    is_mu_dot_free(q->reducesql);
+}
+
+int mu_run_query_cb(struct mu_DBCONF *conf, struct mu_QUERY *q, mu_ROW_CALLBACK cb, void *ctx){
+  if (NULL==conf){
+    MU_WARN("%s\n", mu_error_null_dbconf);
+    return -1;
+  }
+  if ((NULL==q) || (NULL==q->mapsql)){
+    MU_WARN("%s\n", mu_error_null_query);
+    return -1;
+  }
+  if ( !(is_mu_dot_free(q->mapsql) &&
+	 is_mu_dot_free(q->createtablesql) &&
+	 is_mu_dot_free(q->combinesql) &&
+	 is_mu_dot_free(q->reducesql)) ){
+    MU_WARN("%s\n", "mu_run_query_cb() runs queries in this process and can not run sqlite3 shell dot commands such as .mode");
+    return -1;
+  }
+  if (conf->agents)
+    return mu_run_agents(conf, q, cb, ctx);
+  char use[conf->shardc];
+  size_t nuse = mu_prune_shards(conf, q->mapsql, use);
+  int ncores = (((size_t) conf->ncores)>nuse)? (int) nuse: conf->ncores;
+  return mu_run_query_threads(conf, q, use, ncores, cb, ctx, NULL, NULL);
+}
+
+char * mu_run_query(struct mu_DBCONF *conf, struct mu_QUERY *q)
+{
+
+  if (NULL==conf){
+    MU_WARN("%s\n", mu_error_null_dbconf);
+    return NULL;
+  }
+
+  if (NULL==q){
+    MU_WARN("%s\n", mu_error_null_query);
+    return NULL;
+  }
+
+  /* unpack the query. check existence of mapsql, always required. */
+
+  const char *mapsql = q->mapsql;
+  if (NULL==mapsql){
+    MU_WARN("%s\n", mu_error_null_query);
+    return NULL;
+  }
+
+  const char *reducesql = q->reducesql;
+  const char *createtablesql = q->createtablesql;
+
+  if (conf->agents){
+    struct mu_STRBUF out = { NULL, 0, 0 };
+    if (mu_run_agents(conf, q, mu_text_row, &out)){
+      free(out.s);
+      return NULL;
+    }
+    return out.s;
+  }
+
+  /* shards that can not hold rows for the query are left out */
+  char use[conf->shardc];
+  size_t nuse = mu_prune_shards(conf, mapsql, use);
+  int ncores = (((size_t) conf->ncores)>nuse)? (int) nuse: conf->ncores;
+
+  if (mu_query_uses_threads(conf, q)){
+    struct mu_STRBUF out = { NULL, 0, 0 };
+    if (mu_run_query_threads(conf, q, use, ncores, mu_text_row, &out, NULL, NULL)){
+      free(out.s);
+      return NULL;
+    }
+    return out.s;
+  }
+
+  struct mu_STOP stop;
+  mu_stop_init(&stop, q);
+  q->nshards = nuse;
+  q->nmapped = 0;
+
+  /* map processes hold their core budget slots until the map is done */
+  int admitted = 1;
+  ncores = mu_admit(ncores);
+  if (ncores<0)
+    return NULL;
+  int slots = 0;
+
+  const char *tmpdir = mu_create_temp_dir();
+  if (NULL==tmpdir){
+    mu_leave();
+    return NULL;
+  }
+
+  int icore;
+
+  struct mu_SQLITE3_TASK *mapsql_task[ncores];
+  for(icore=0;icore<ncores;++icore){
+    mapsql_task[icore] =
+      mu_define_task(tmpdir, NULL, "mapsql", icore);
+    if (NULL==mapsql_task[icore]){
+      mu_leave();
+      return NULL;
+    }
+  }
+
+  struct mu_SQLITE3_TASK *reducesql_task =
+    mu_define_task(tmpdir,mapsql_task[0]->dbname,"reducesql",0);
+  if (NULL==reducesql_task){
+    mu_leave();
+    return NULL;
+  }
+
+  FILE *reducef = NULL;
+  const char * rname = reducesql_task->iname;
+
+  size_t cursor = 0; // for reduce
+  size_t bufsize = (reducesql)? ((1024*ncores)+strlen(reducesql)) :0;
+  char *buf = NULL;
+
+  const char *ext = mu_sqlite3_extensions();
+
+  struct mu_SCHEDULE *sched = mu_schedule_create(ncores, conf->shardc, conf->shardv, conf->shardinfo, use);
+
+  char *topk = (q->combinesql)? NULL: mu_topk_combinesql(conf->otablename, reducesql);
+  const char *combinesql = (q->combinesql)? q->combinesql: topk;
+
+#define MU_FREE_Q() do { \
+    int i;							\
+    for(i=0;i<ncores;++i){				\
+      mu_free_task(mapsql_task[i]);				\
+    }								\
+    mu_free_task(reducesql_task);				\
+    if (reducesql) free(buf);					\
+    mu_schedule_free(sched);					\
+    free(topk);							\
+    free((void *) tmpdir);					\
+    mu_slot_give(slots);					\
+    if (admitted) mu_leave();					\
+  } while(0)							\
+
+  /* a stopped query kills its sqlite3 processes and removes its temp files */
+#define MU_STOP_Q() do {						\
+    mu_warn_stopped(&stop);					\
+    mu_remove_temp_dir(tmpdir);					\
+    MU_FREE_Q();						\
+  } while(0)							\
+
+
+  if (NULL==sched){
+    MU_FREE_Q();
+    return NULL;
+  }
+
+  if (reducesql){
+    buf = malloc(bufsize);
+    if (NULL==buf){
+      MU_WARN_OOM();
+      MU_FREE_Q();
+      return NULL;
+    }
+    MU_PRINTBUF("%s\n",".bail on");
+    if (ext)
+      MU_PRINTBUF("%s\n", ext);
+  }
+
+  const size_t coredbnamesize = 255;
+
+  const char *errormsg_on_start = "Fatal error detected by mu_query() attempting to start sqlite3 ";
+  const char *errormsg_on_finish_map = "Fatal error detected by mu_query() in map task";
+  const char *errormsg_on_finish_reduce = "Fatal error detected by mu_query() in reduce task";
+
+  int took = mu_slot_take(conf, ncores, &stop);
+  if (took>0){
+    MU_STOP_Q();
+    return NULL;
+  }
+  if (took<0){
+    MU_FREE_Q();
+    return NULL;
+  }
+  slots = ncores;
+
+  for(icore=0;icore<ncores;++icore){
+    int shardc = (int) (sched->end[icore] - sched->head[icore]);
+    const char **shardv = sched->shardv + sched->head[icore];
+
+    int makestatus = mu_makeQueryCoreFile(conf,
+					  mapsql_task[icore]->iname,
+					  mapsql_task[icore]->dbname,
+					  shardc,
+					  shardv,
+					  mapsql,
+					  createtablesql,
+					  combinesql);
+    if (makestatus){
+      MU_FREE_Q();
+      return NULL;
+    }
+    if (mu_start_task(mapsql_task[icore], errormsg_on_start)){
+      MU_FREE_Q();
+      return NULL;
+    }
+  }
+
+  char *result = NULL;
+
+  // wait for workers
+
+  int halted = 0;
+  for(icore=0;icore<ncores;++icore){
+    if (mu_wait_task(mapsql_task[icore], &stop)){
+      halted = 1;
+      continue;
+    }
+    if ((!halted) && mu_finish_task(mapsql_task[icore], errormsg_on_finish_map)){
+      MU_FREE_Q();
+      return NULL;
+    }
+  }
+  if (halted){
+    MU_STOP_Q();
+    return NULL;
+  }
+  q->nmapped = nuse;
+  mu_slot_give(slots);
+  slots = 0;
+  mu_leave();
+  admitted = 0;
+
+  if (reducesql){
+    int step = mu_merge_tasks(conf, tmpdir, mapsql_task, ncores, combinesql, mu_max_reduce_parts(combinesql), &stop);
+    if ((step<0) && mu_stopped(&stop, 0)){
+      MU_STOP_Q();
+      return NULL;
+    }
+    if (step<0){
+      MU_FREE_Q();
+      return NULL;
+    }
+    int partc = 0;
+    int partv[ncores];
+    struct mu_STRBUF view = { NULL, 0, 0 };
+    for(icore=0;icore<ncores;icore+=step){
+      if (icore>0)
+	MU_PRINTBUF("attach database '%s' as 'coredb%.3d';\n",
+		    mapsql_task[icore]->dbname,
+		    icore);
+      partv[partc++] = icore;
+    }
+    if (mu_union_view_sql(&view, conf->otablename, partv, partc, reducesql)){
+      free(view.s);
+      MU_FREE_Q();
+      return NULL;
+    }
+    if (view.s)
+      MU_PRINTBUF("%s", view.s);
+    free(view.s);
+    reducef = mu_fopen(rname, "w");
+    if (NULL==reducef){
+      MU_FREE_Q();
+      return NULL;
+    }
+    MU_PRINTBUF("%s\n", reducesql);
+    if (cursor>bufsize){
+      MU_WARN("%s\n", "An unusual error occurred.  The map query may have begun processing, but the reduce query was not processed.");
+      MU_FREE_Q();
+      return NULL;
+    }
+    int written = fputs(buf, reducef);
+    if (written<=0){
+      MU_WARN_FNAME(rname);
+      MU_WARN_IF_ERRNO();
+      MU_FREE_Q();
+      return NULL;
+    }
+    MU_FCLOSE_W(rname, NULL, reducef);
+    if (mu_start_task(reducesql_task, errormsg_on_start)){
+      MU_FREE_Q();
+      return NULL;
+    }
+    if (mu_wait_task(reducesql_task, &stop)){
+      MU_STOP_Q();
+      return NULL;
+    }
+    if (mu_finish_task(reducesql_task, errormsg_on_finish_reduce)){
+      MU_FREE_Q();
+      return NULL;
+    }
+    result = mu_read_small_file(reducesql_task->oname);
+  }
+  mu_remove_temp_dir(tmpdir);
+  MU_FREE_Q();
+  return result;
+}
+
+/* Asynchronous queries.  mu_submit_query() runs mu_run_query() on a new   */
+/* thread.  When the query is done the thread writes one byte to a pipe,   */
+/* so the read end can wait in poll(), epoll or an event loop, and         */
+/* mu_wait() joins the thread and hands over its result and errors.        */
+
+struct mu_ASYNC {
+  pthread_t tid;
+  struct mu_DBCONF *conf;
+  struct mu_QUERY *q;
+  int pipefd[2];
+  volatile int done;
+  char *result;
+  char *errs; /* copied from the query thread's error buffer */
+};
+
+static void * mu_async_query(void *arg){
+  struct mu_ASYNC *a = (struct mu_ASYNC *) arg;
+  a->result = mu_run_query(a->conf, a->q);
+  if (mu_error_string()){
+    a->errs = strdup(mu_error_string());
+    mu_error_clear();
+  }
+  __sync_synchronize();
+  a->done = 1;
+  char c = 1;
+  while ((write(a->pipefd[1], &c, 1)<0) && (EINTR==errno))
+    ;
+  return NULL;
+}
+
+struct mu_ASYNC * mu_submit_query(struct mu_DBCONF *conf, struct mu_QUERY *q){
+  if (NULL==conf){
+    MU_WARN("%s\n", mu_error_null_dbconf);
+    return NULL;
+  }
+  if (NULL==q){
+    MU_WARN("%s\n", mu_error_null_query);
+    return NULL;
+  }
+  struct mu_ASYNC *a = calloc(1, sizeof(struct mu_ASYNC));
+  if (NULL==a){
+    MU_WARN_OOM();
+    return NULL;
+  }
+  a->conf = conf;
+  a->q = q;
+  if (pipe(a->pipefd)){
+    MU_WARN("%s\n", "mu_submit_query() could not create a pipe");
+    MU_WARN_IF_ERRNO();
+    free(a);
+    return NULL;
+  }
+  fcntl(a->pipefd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(a->pipefd[1], F_SETFD, FD_CLOEXEC);
+  if (pthread_create(&(a->tid), NULL, mu_async_query, a)){
+    MU_WARN("%s\n", "mu_submit_query() could not start a query thread");
+    close(a->pipefd[0]);
+    close(a->pipefd[1]);
+    free(a);
+    return NULL;
+  }
+  return a;
+}
+
+int mu_poll(struct mu_ASYNC *a){
+  int done = (a) && (a->done);
+  __sync_synchronize();
+  return done;
+}
+
+int mu_async_fd(struct mu_ASYNC *a){
+  return (a)? a->pipefd[0]: -1;
+}
+
+char * mu_wait(struct mu_ASYNC *a){
+  if (NULL==a)
+    return NULL;
+  pthread_join(a->tid, NULL);
+  if (a->errs)
+    MU_WARN("%s", a->errs);
+  char *result = a->result;
+  close(a->pipefd[0]);
+  close(a->pipefd[1]);
+  free(a->errs);
+  free(a);
+  return result;
+}
+
+/* Map-only export.  Each core runs mapsql on the shards it is scheduled   */
+/* and writes the rows straight to its own part file in outdir, so rows    */
+/* never pass through a reducer.  The manifest, written once every core is */
+/* done, lists the parts with their row and byte counts.                  */
+
+struct mu_EXPORT_WORKER {
+  struct mu_DBCONF *conf;
+  const char *mapsql;
+  int format;
+  int coreid;
+  struct mu_SCHEDULE *sched;
+  char *fname;
+  FILE *f;
+  long long rows;
+  char *columns; /* column names separated by '|', from the first row written */
+  int status;
+  char *errs;
+};
+
+static const char * mu_export_ext(int format){
+  return (MU_EXPORT_TSV==format)? "tsv": (MU_EXPORT_BINARY==format)? "rows": "csv";
+}
+
+static int mu_export_csv_field(FILE *f, const char *v, size_t n){
+  int quote = (NULL!=memchr(v, ',', n)) || (NULL!=memchr(v, '"', n)) || (NULL!=memchr(v, '\n', n)) || (NULL!=memchr(v, '\r', n));
+  if (!quote)
+    return (n==fwrite(v, 1, n, f))? 0: -1;
+  if (EOF==putc('"', f))
+    return -1;
+  size_t i;
+  for(i=0;i<n;++i)
+    if ( (('"'==v[i]) && (EOF==putc('"', f))) || (EOF==putc(v[i], f)) )
+      return -1;
+  return (EOF==putc('"', f))? -1: 0;
+}
+
+/* tsv has no quoting, so tabs and line ends in values are written as \t \n \r and backslashes as \\ */
+static int mu_export_tsv_field(FILE *f, const char *v, size_t n){
+  size_t i;
+  for(i=0;i<n;++i){
+    const char *esc = ('\t'==v[i])? "\\t": ('\n'==v[i])? "\\n": ('\r'==v[i])? "\\r": ('\\'==v[i])? "\\\\": NULL;
+    if ((esc)? (2!=fwrite(esc, 1, 2, f)): (EOF==putc(v[i], f)))
+      return -1;
+  }
+  return 0;
+}
+
+/* binary rows are a uint32 column count, then per value a type byte and */
+/* an int64 or double, or a uint32 length and the bytes, or nothing for   */
+/* null, all in this machine's byte order                                 */
+static int mu_export_binary_row(FILE *f, int ncol, const struct mu_COLUMN *colv){
+  uint32_t n = (uint32_t) ncol;
+  if (1!=fwrite(&n, sizeof(n), 1, f))
+    return -1;
+  int i;
+  for(i=0;i<ncol;++i){
+    const struct mu_COLUMN *c = &colv[i];
+    unsigned char type = (unsigned char) c->type;
+    int bad = (1!=fwrite(&type, 1, 1, f));
+    if (MU_INTEGER==c->type){
+      int64_t v = (int64_t) c->i;
+      bad = bad || (1!=fwrite(&v, sizeof(v), 1, f));
+    } else if (MU_FLOAT==c->type){
+      bad = bad || (1!=fwrite(&(c->d), sizeof(c->d), 1, f));
+    } else if ((MU_TEXT==c->type) || (MU_BLOB==c->type)){
+      uint32_t len = (uint32_t) c->n;
+      bad = bad || (1!=fwrite(&len, sizeof(len), 1, f)) || ((len) && (1!=fwrite(c->s, len, 1, f)));
+    }
+    if (bad)
+      return -1;
+  }
+  return 0;
+}
+
+static int mu_export_row(void *ctx, int ncol, const struct mu_COLUMN *colv){
+  struct mu_EXPORT_WORKER *w = (struct mu_EXPORT_WORKER *) ctx;
+  int i;
+  int bad = 0;
+  if (NULL==w->columns){
+    struct mu_STRBUF b = { NULL, 0, 0 };
+    for(i=0; (i<ncol) && (!bad); ++i)
+      bad = ((i>0) && mu_strbuf_add(&b, "|", 1)) || mu_strbuf_adds(&b, (colv[i].name)? colv[i].name: "");
+    w->columns = (b.s)? b.s: strdup("");
+    if ((bad) || (NULL==w->columns))
+      return -1;
+  }
+  if (MU_EXPORT_BINARY==w->format)
+    bad = mu_export_binary_row(w->f, ncol, colv);
+  else {
+    char sep = (MU_EXPORT_TSV==w->format)? '\t': ',';
+    char buf[64];
+    for(i=0; (i<ncol) && (!bad); ++i){
+      size_t n;
+      const char *v = mu_column_text(&colv[i], buf, sizeof(buf), &n);
+      bad = ((i>0) && (EOF==putc(sep, w->f))) ||
+	((MU_EXPORT_TSV==w->format)? mu_export_tsv_field(w->f, v, n): mu_export_csv_field(w->f, v, n));
+    }
+    bad = bad || (EOF==putc('\n', w->f));
+  }
+  if (bad){
+    MU_WARN_FNAME(w->fname);
+    MU_WARN_IF_ERRNO();
+    return -1;
+  }
+  ++w->rows;
+  return 0;
+}
+
+static int mu_export_shard(struct mu_EXPORT_WORKER *w, const char *shard, size_t shardnum){
+  struct mu_WARM *warm = w->conf->warm;
+  sqlite3 *db = NULL;
+  if ((warm) && (warm->sharddb)){
+    pthread_mutex_lock(&(warm->shardlock[shardnum]));
+    db = warm->sharddb[shardnum];
+  } else {
+    warm = NULL;
+    db = mu_sqlite3_open(shard);
+    if (NULL==db)
+      return -1;
+  }
+  int status = mu_sqlite3_exec_rows(db, w->mapsql, mu_export_row, w);
+  if (status)
+    MU_WARN(" shard %s\n", shard);
+  if (warm){
+    if (!sqlite3_get_autocommit(db))
+      sqlite3_exec(db, "rollback;", NULL, NULL, NULL);
+    pthread_mutex_unlock(&(warm->shardlock[shardnum]));
+  } else {
+    sqlite3_close(db);
+  }
+  return status;
+}
+
+static void * mu_export_worker(void *arg){
+  struct mu_EXPORT_WORKER *w = (struct mu_EXPORT_WORKER *) arg;
+  const char *shard;
+  size_t shardnum = 0;
+  w->f = mu_fopen(w->fname, "w");
+  w->status = (NULL==w->f);
+  if (w->f)
+    setvbuf(w->f, NULL, _IOFBF, 1<<20);
+  while ((0==w->status) && (0==(w->status = mu_slot_take(w->conf, 1, NULL)))){
+    shard = mu_schedule_next(w->sched, w->coreid, &shardnum);
+    if (shard)
+      w->status = mu_export_shard(w, shard, shardnum);
+    mu_slot_give(1);
+    if (NULL==shard)
+      break;
+  }
+  if ((w->f) && fclose(w->f)){
+    MU_WARN(mu_error_fclose, w->fname);
+    MU_WARN_IF_ERRNO();
+    w->status = -1;
+  }
+  if (w->status)
+    mu_schedule_fail(w->sched);
+  if (mu_error_string()){
+    w->errs = strdup(mu_error_string());
+    mu_error_clear();
+  }
+  return NULL;
+}
+
+static int mu_write_export_manifest(const char *outdir, int format, struct mu_EXPORT_WORKER *worker, int ncores){
+  char *fname = mu_cat(outdir, "/manifest.txt");
+  if (NULL==fname)
+    return -1;
+  FILE *f = mu_fopen(fname, "w");
+  if (NULL==f){
+    free(fname);
+    return -1;
+  }
+  const char *columns = NULL;
+  int icore;
+  for(icore=0; (icore<ncores) && (NULL==columns); ++icore)
+    columns = worker[icore].columns;
+  int bad = (fprintf(f, "# multicoresql export format %s columns %s\n", mu_export_ext(format), (columns)? columns: "")<0);
+  for(icore=0; (icore<ncores) && (!bad); ++icore){
+    struct stat fstats;
+    const char *part = strrchr(worker[icore].fname, '/');
+    bad = (stat(worker[icore].fname, &fstats)) ||
+      (fprintf(f, "%s\t%lld\t%lld\n", part+1, worker[icore].rows, (long long) fstats.st_size)<0);
+  }
+  if (fclose(f))
+    bad = 1;
+  if (bad){
+    MU_WARN_FNAME(fname);
+    MU_WARN_IF_ERRNO();
+  }
+  free(fname);
+  return (bad)? -1: 0;
+}
+
+/* A mapsql ending in order by, without a limit, is exported as a sort: the  */
+/* map runs without the order by, into each core's results, and the sorted  */
+/* runs are merged into the parts, which follow each other in that order.   */
+/* With one key each core writes a slice of the key range, else core 0      */
+/* writes them all.                                                         */
+
+static int mu_export_sorted(struct mu_DBCONF *conf, const struct mu_SELECT *sel, const char *outdir, int format, const char *use, int ncores){
+  struct mu_SORT sort;
+  if (mu_sort_terms(sel, &sort)){
+    MU_WARN("%s\n", "mu_export_query() sorts by expressions of the output columns, and not by ordinals, collate or nulls first|last");
+    return -1;
+  }
+  struct mu_STRBUF map = { NULL, 0, 0 };
+  int failed = mu_strbuf_add_tokens(&map, &(sel->t), 0, sel->order_a-2) || mu_strbuf_adds(&map, ";");
+  struct mu_QUERY q;
+  memset(&q, 0, sizeof(q));
+  q.mapsql = map.s;
+  int nslices = (1==sort.nkeys)? ncores: 1;
+  struct mu_EXPORT_WORKER worker[nslices];
+  void *ctxv[nslices];
+  int i;
+  memset(worker, 0, sizeof(worker));
+  for(i=0; (i<nslices) && (!failed); ++i){
+    struct mu_EXPORT_WORKER *w = &worker[i];
+    char part[32];
+    snprintf(part, sizeof(part), "/part-%.3d.%s", i, mu_export_ext(format));
+    w->conf = conf;
+    w->format = format;
+    w->coreid = i;
+    w->fname = mu_cat(outdir, part);
+    w->f = (w->fname)? mu_fopen(w->fname, "w"): NULL;
+    failed = (NULL==w->f);
+    if (w->f)
+      setvbuf(w->f, NULL, _IOFBF, 1<<20);
+    ctxv[i] = w;
+  }
+  sort.nslices = nslices;
+  sort.cb = mu_export_row;
+  sort.ctxv = ctxv;
+  if ((!failed) && mu_run_query_threads(conf, &q, use, ncores, NULL, NULL, NULL, &sort))
+    failed = 1;
+  for(i=0;i<nslices;++i){
+    struct mu_EXPORT_WORKER *w = &worker[i];
+    if ((w->f) && fclose(w->f)){
+      MU_WARN(mu_error_fclose, w->fname);
+      MU_WARN_IF_ERRNO();
+      failed = 1;
+    }
+  }
+  if (!failed)
+    failed = mu_write_export_manifest(outdir, format, worker, nslices);
+  for(i=0;i<nslices;++i){
+    free(worker[i].fname);
+    free(worker[i].columns);
+  }
+  free(map.s);
+  mu_free_sort(&sort);
+  return (failed)? -1: 0;
+}
+
+int mu_export_query(struct mu_DBCONF *conf, const char *mapsql, const char *outdir, int format){
+  if (NULL==conf){
+    MU_WARN("%s\n", mu_error_null_dbconf);
+    return -1;
+  }
+  if ((NULL==mapsql) || (NULL==outdir) || (!is_mu_select(mapsql)) || (!is_mu_dot_free(mapsql))){
+    MU_WARN("%s\n", "mu_export_query() requires an output directory and a mapsql select without sqlite3 shell dot commands");
+    return -1;
+  }
+  if (mkdir(outdir, 0755) && (errno!=EEXIST)){
+    MU_WARN("mu_export_query() could not create the output directory %s\n", outdir);
+    MU_WARN_IF_ERRNO();
+    return -1;
+  }
+  char use[conf->shardc];
+  size_t nuse = mu_prune_shards(conf, mapsql, use);
+  int ncores = (((size_t) conf->ncores)>nuse)? (int) nuse: conf->ncores;
+  struct mu_SELECT sel;
+  if ((ncores>0) && (0==mu_parse_select(mapsql, &sel, 1))){
+    int sorted = (sel.order_a<sel.order_b) && (sel.limit_a==sel.limit_b);
+    int status = (sorted)? mu_export_sorted(conf, &sel, outdir, format, use, ncores): 0;
+    mu_free_select(&sel);
+    if (sorted)
+      return status;
+  }
+  int nw = (ncores>0)? ncores: 1;
+  struct mu_EXPORT_WORKER worker[nw];
+  pthread_t tid[nw];
+  memset(worker, 0, sizeof(worker));
+  struct mu_SCHEDULE *sched = (ncores>0)? mu_schedule_create(ncores, conf->shardc, conf->shardv, conf->shardinfo, use): NULL;
+  if ((ncores>0) && (NULL==sched))
+    return -1;
+  int failed = 0;
+  int started = 0;
+  int icore;
+  for(icore=0; (icore<ncores) && (!failed); ++icore){
+    struct mu_EXPORT_WORKER *w = &worker[icore];
+    char part[32];
+    snprintf(part, sizeof(part), "/part-%.3d.%s", icore, mu_export_ext(format));
+    w->conf = conf;
+    w->mapsql = mapsql;
+    w->format = format;
+    w->coreid = icore;
+    w->sched = sched;
+    w->fname = mu_cat(outdir, part);
+    failed = (NULL==w->fname);
+  }
+  for(icore=0; (icore<ncores) && (!failed); ++icore){
+    if (pthread_create(&tid[icore], NULL, mu_export_worker, &worker[icore])){
+      MU_WARN("%s\n", "mu_export_query() could not start an export thread");
+      mu_schedule_fail(sched);
+      failed = 1;
+      break;
+    }
+    ++started;
+  }
+  for(icore=0;icore<started;++icore){
+    struct mu_EXPORT_WORKER *w = &worker[icore];
+    pthread_join(tid[icore], NULL);
+    if (w->errs)
+      MU_WARN("%s", w->errs);
+    if (w->status){
+      MU_WARN("mu_export_query() failed on export thread %.3d\n", icore);
+      failed = 1;
+    }
+  }
+  if (!failed)
+    failed = mu_write_export_manifest(outdir, format, worker, started);
+  for(icore=0;icore<nw;++icore){
+    free(worker[icore].fname);
+    free(worker[icore].columns);
+    free(worker[icore].errs);
+  }
+  mu_schedule_free(sched);
+  return (failed)? -1: 0;
+}
+
+/* Parallel csv import.  The csv file is mapped into memory and split into ranges */
+/* that begin on a row, one per core.  Each thread parses its range, deals the     */
+/* rows out to random shards, or by the hash of their key, in batches, and inserts */
+/* each batch into the shard's database, which stays in one transaction until     */
+/* every thread is done.                                                           */
+
+struct mu_SHARDWRITER {
+  pthread_mutex_t lock;
+  sqlite3 *db;
+  sqlite3_stmt *insert;
+};
+
+struct mu_CSV_IMPORT {
+  const char *end;
+  char sep;
+  int ncol;
+  int shardc;
+  size_t batchsize;
+  struct mu_SHARDWRITER *writer;
+  char **names; /* file names of the shards when appending, NULL for new shards 000, 001, ... */
+  struct mu_PARTITION part; /* part.nkey is 0 for random shards */
+  int keypos[MU_KEY_MAX]; /* column number of each key column */
+  volatile int failed;
+};
+
+struct mu_CSV_WORKER {
+  struct mu_CSV_IMPORT *imp;
+  const char *begin;
+  const char *end;
+  unsigned int seed;
+  int quoted;
+  size_t badrows;
+  int status;
+  char *errs;
+};
+
+/* rows are batched as ncol fields, each a size_t length followed by the bytes */
+#define MU_CSV_NULL ((size_t) -1)
+
+static int mu_csv_schema(const char *schema, char *sep, struct mu_STRBUF *sql){
+  /* The sqlite3 shell splits imported fields on its .separator, which a schema   */
+  /* may set with .mode or .separator.  Any other dot command, such as .read,     */
+  /* needs the shell, so the schema is then left to the sqlite3 process import. */
+  const char *p = schema;
+  while (*p){
+    const char *e = strchr(p, '\n');
+    size_t n = (e)? (size_t) (e-p+1): strlen(p);
+    const char *s = p;
+    while ((' '==*s) || ('\t'==*s))
+      ++s;
+    if ('.'==*s){
+      char line[256], cmd[16], arg[16], extra[16];
+      if (n>=sizeof(line))
+	return -1;
+      memcpy(line, s, n-(s-p));
+      line[n-(s-p)] = 0;
+      int k = sscanf(line, ".%15s %15s %15s", cmd, arg, extra);
+      if (k!=2)
+	return -1;
+      if (0==strcmp(cmd, "mode")){
+	if (0==strcmp(arg, "csv"))
+	  *sep = ',';
+	else if (0==strcmp(arg, "tabs"))
+	  *sep = '\t';
+	else if (0==strcmp(arg, "list"))
+	  *sep = '|';
+	else
+	  return -1;
+      } else if (0==strcmp(cmd, "separator")){
+	char *a = arg;
+	size_t alen = strlen(a);
+	if ((alen>=2) && (('"'==a[0]) || ('\''==a[0])) && (a[0]==a[alen-1])){
+	  a[alen-1] = 0;
+	  ++a;
+	}
+	if (0==strcmp(a, "\\t"))
+	  *sep = '\t';
+	else if ((1==strlen(a)) && ('"'!=a[0]))
+	  *sep = a[0];
+	else
+	  return -1;
+      } else
+	return -1;
+    } else if (mu_strbuf_add(sql, p, n))
+      return -1;
+    p += n;
+  }
+  return 0;
+}
+
+static const char * mu_csv_row(const char *p, const char *end, char sep, int ncol, struct mu_STRBUF *b, int *nfields){
+  /* Reads the row at p as the sqlite3 shell's .import does:  fields end at sep,    */
+  /* a field may be quoted with " (with "" for a literal "), and a \r before the    */
+  /* newline is dropped.  Appends the first ncol fields to b, if any, padding with  */
+  /* NULLs.  Returns the start of the next row, or NULL if out of memory.           */
+  int n = 0;
+  int more = 1;
+  while (more){
+    int keep = (b) && (n<ncol);
+    size_t off = (keep)? b->len: 0;
+    size_t len = 0;
+    if ((keep) && mu_strbuf_add(b, (const char *) &len, sizeof(len)))
+      return NULL;
+    const char *q;
+    if ((p<end) && ('"'==*p)){
+      ++p;
+      while (1){
+	q = memchr(p, '"', (size_t) (end-p));
+	if (NULL==q)
+	  q = end;
+	if ((keep) && mu_strbuf_add(b, p, (size_t) (q-p)))
+	  return NULL;
+	if ((q+1<end) && ('"'==q[1])){
+	  if ((keep) && mu_strbuf_add(b, "\"", 1))
+	    return NULL;
+	  p = q+2;
+	  continue;
+	}
+	p = (q<end)? q+1: end;
+	break;
+      }
+    }
+    q = p;
+    while ((q<end) && (sep!=*q) && ('\n'!=*q))
+      ++q;
+    const char *e = q;
+    if ((e>p) && ((e==end) || ('\n'==*e)) && ('\r'==e[-1]))
+      --e;
+    if (keep){
+      if (mu_strbuf_add(b, p, (size_t) (e-p)))
+	return NULL;
+      len = b->len-off-sizeof(len);
+      memcpy(b->s+off, &len, sizeof(len));
+    }
+    ++n;
+    more = ((q<end) && (sep==*q));
+    p = (q<end)? q+1: end;
+  }
+  if (b){
+    size_t null = MU_CSV_NULL;
+    int i;
+    for(i=n;i<ncol;++i)
+      if (mu_strbuf_add(b, (const char *) &null, sizeof(null)))
+	return NULL;
+  }
+  *nfields = n;
+  return p;
+}
+
+static int mu_csv_flush(struct mu_CSV_IMPORT *imp, int ishard, struct mu_STRBUF *b, size_t nrows){
+  struct mu_SHARDWRITER *sw = &(imp->writer[ishard]);
+  const char *p = b->s;
+  int status = 0;
+  size_t r;
+  pthread_mutex_lock(&(sw->lock));
+  for(r=0;(r<nrows) && (0==status);++r){
+    int i;
+    for(i=0;i<imp->ncol;++i){
+      size_t len;
+      memcpy(&len, p, sizeof(len));
+      p += sizeof(len);
+      if (MU_CSV_NULL==len)
+	sqlite3_bind_null(sw->insert, i+1);
+      else {
+	sqlite3_bind_text(sw->insert, i+1, p, (int) len, SQLITE_STATIC);
+	p += len;
+      }
+    }
+    if (sqlite3_step(sw->insert)!=SQLITE_DONE){
+      MU_WARN("mu_create_shards_from_csv() could not insert a row into shard %.3d\n", ishard);
+      MU_WARN("sqlite3 reported this error:\n%s\n", sqlite3_errmsg(sw->db));
+      status = -1;
+    }
+    sqlite3_reset(sw->insert);
+  }
+  pthread_mutex_unlock(&(sw->lock));
+  b->len = 0;
+  return status;
+}
+
+/* the shard of a row batched in b as ncol fields */
+static int mu_csv_key_shard(struct mu_CSV_IMPORT *imp, const char *b){
+  const char *field[MU_KEY_MAX+1];
+  size_t len[MU_KEY_MAX+1];
+  int i, k;
+  for(i=0;i<imp->ncol;++i){
+    size_t n;
+    memcpy(&n, b, sizeof(n));
+    b += sizeof(n);
+    for(k=0;k<imp->part.nkey;++k){
+      if (imp->keypos[k]==i){
+	field[k] = b;
+	len[k] = (MU_CSV_NULL==n)? 0: n;
+      }
+    }
+    if (MU_CSV_NULL!=n)
+      b += n;
+  }
+  uint64_t h = MU_FNV1A_BASIS;
+  char buf[256];
+  for(k=0;k<imp->part.nkey;++k){
+    const char *c = mu_key_canon(imp->part.keytype[k], field[k], &len[k], buf, sizeof(buf));
+    if (k)
+      h = mu_fnv1a(h, "\x1f", 1);
+    h = mu_fnv1a(h, c, len[k]);
+  }
+  return mu_hash_shard(h, imp->shardc);
+}
+
+static void * mu_csv_quote_scan(void *arg){
+  struct mu_CSV_WORKER *w = (struct mu_CSV_WORKER *) arg;
+  w->quoted = (NULL!=memchr(w->begin, '"', (size_t) (w->end-w->begin)));
+  return NULL;
+}
+
+static void * mu_csv_worker(void *arg){
+  struct mu_CSV_WORKER *w = (struct mu_CSV_WORKER *) arg;
+  struct mu_CSV_IMPORT *imp = w->imp;
+  struct mu_STRBUF *batch = calloc((size_t) imp->shardc, sizeof(struct mu_STRBUF));
+  size_t *nrows = calloc((size_t) imp->shardc, sizeof(size_t));
+  if ((NULL==batch) || (NULL==nrows)){
+    MU_WARN_OOM();
+    w->status = -1;
+  }
+  struct mu_STRBUF row = { NULL, 0, 0 };
+  const char *p = w->begin;
+  int ishard;
+  while ((0==w->status) && (p<w->end) && (!imp->failed)){
+    int nfields = 0;
+    if (imp->part.nkey){
+      row.len = 0;
+      p = mu_csv_row(p, imp->end, imp->sep, imp->ncol, &row, &nfields);
+      ishard = (p)? mu_csv_key_shard(imp, row.s): 0;
+      if ((p) && mu_strbuf_add(&batch[ishard], row.s, row.len))
+	p = NULL;
+    } else {
+      ishard = (int) (((unsigned int) rand_r(&(w->seed))) % ((unsigned int) imp->shardc));
+      p = mu_csv_row(p, imp->end, imp->sep, imp->ncol, &batch[ishard], &nfields);
+    }
+    if (NULL==p){
+      w->status = -1;
+      break;
+    }
+    if (nfields!=imp->ncol)
+      ++w->badrows;
+    ++nrows[ishard];
+    if (batch[ishard].len>=imp->batchsize){
+      w->status = mu_csv_flush(imp, ishard, &batch[ishard], nrows[ishard]);
+      nrows[ishard] = 0;
+    }
+  }
+  for(ishard=0;(batch) && (nrows) && (ishard<imp->shardc);++ishard){
+    if ((0==w->status) && (!imp->failed) && (nrows[ishard]))
+      w->status = mu_csv_flush(imp, ishard, &batch[ishard], nrows[ishard]);
+    free(batch[ishard].s);
+  }
+  free(batch);
+  free(nrows);
+  free(row.s);
+  if (w->status)
+    imp->failed = 1;
+  if (mu_error_string()){
+    w->errs = strdup(mu_error_string());
+    mu_error_clear();
+  }
+  return NULL;
+}
+
+static int mu_csv_open_writer(struct mu_CSV_IMPORT *imp, int ishard, const char *createsql, const char *tablename, const char *dbDir){
+  struct mu_SHARDWRITER *sw = &(imp->writer[ishard]);
+  char *dbname = (imp->names)? sqlite3_mprintf("%s/%s", dbDir, imp->names[ishard]): sqlite3_mprintf("%s/%.3d", dbDir, ishard);
+  if (NULL==dbname){
+    MU_WARN_OOM();
+    return -1;
+  }
+  sw->db = mu_sqlite3_open(dbname);
+  sqlite3_free(dbname);
+  if (NULL==sw->db)
+    return -1;
+  /* an appended shard already has the table, unless it is new */
+  if ( ((NULL==imp->names) ||
+	(SQLITE_OK!=sqlite3_table_column_metadata(sw->db, NULL, tablename, NULL, NULL, NULL, NULL, NULL, NULL))) &&
+       mu_sqlite3_exec(sw->db, createsql) )
+    return -1;
+  if (0==imp->ncol){
+    sqlite3_stmt *stmt = NULL;
+    char *sql = sqlite3_mprintf("select * from \"%w\";", tablename);
+    if ((NULL==sql) || (sqlite3_prepare_v2(sw->db, sql, -1, &stmt, NULL)!=SQLITE_OK)){
+      MU_WARN("mu_create_shards_from_csv() could not find the table %s created by the schema\n", tablename);
+      MU_WARN("%s\n", sqlite3_errmsg(sw->db));
+      sqlite3_free(sql);
+      return -1;
+    }
+    imp->ncol = sqlite3_column_count(stmt);
+    sqlite3_finalize(stmt);
+    sqlite3_free(sql);
+  }
+  struct mu_STRBUF sql = { NULL, 0, 0 };
+  char *into = sqlite3_mprintf("insert into \"%w\" values(?", tablename);
+  int i;
+  int failed = (NULL==into) || mu_strbuf_adds(&sql, into);
+  for(i=1;(i<imp->ncol) && (!failed);++i)
+    failed = mu_strbuf_adds(&sql, ",?");
+  failed = (failed) || mu_strbuf_adds(&sql, ");");
+  sqlite3_free(into);
+  if ((!failed) && (sqlite3_prepare_v2(sw->db, sql.s, -1, &(sw->insert), NULL)!=SQLITE_OK)){
+    MU_WARN("sqlite3 reported this error:\n%s\n", sqlite3_errmsg(sw->db));
+    failed = 1;
+  }
+  free(sql.s);
+  if ((failed) || mu_sqlite3_exec(sw->db, "begin;"))
+    return -1;
+  return 0;
+}
+
+/* finds the key columns of keycols in the table just created in db, and how to hash them */
+static int mu_csv_keys(struct mu_CSV_IMPORT *imp, sqlite3 *db, const char *tablename, const char *keycols){
+  char *cols = strdup(keycols);
+  if (NULL==cols){
+    MU_WARN_OOM();
+    return -1;
+  }
+  sqlite3_stmt *stmt = NULL;
+  char *sql = sqlite3_mprintf("select * from \"%w\";", tablename);
+  int status = ((NULL==sql) || (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)!=SQLITE_OK))? -1: 0;
+  char *save = NULL;
+  char *col = strtok_r(cols, ", ", &save);
+  imp->part.tablename = (char *) tablename;
+  imp->part.shardc = imp->shardc;
+  while ((col) && (0==status)){
+    int i;
+    for(i=0; (i<imp->ncol) && (0!=strcasecmp(col, sqlite3_column_name(stmt, i))); ++i)
+      ;
+    if ((i==imp->ncol) || (imp->part.nkey>=MU_KEY_MAX)){
+      MU_WARN("mu_create_shards_from_csv() can not partition by %s, it is not one of the columns of table %s or there are more than %d key columns\n", col, tablename, MU_KEY_MAX);
+      status = -1;
+      break;
+    }
+    const char *decltype = NULL;
+    const char *collation = NULL;
+    sqlite3_table_column_metadata(db, NULL, tablename, sqlite3_column_name(stmt, i), &decltype, &collation, NULL, NULL, NULL);
+    /* the affinity rules of sqlite3, in their order of precedence */
+    char type = MU_KEY_NUMERIC;
+    if ((decltype) && strcasestr(decltype, "int"))
+      type = MU_KEY_NUMERIC;
+    else if ((NULL==decltype) || (0==*decltype) ||
+	     strcasestr(decltype, "char") || strcasestr(decltype, "clob") || strcasestr(decltype, "text") || strcasestr(decltype, "blob"))
+      type = ((collation) && strcasecmp(collation, "binary"))? MU_KEY_OTHER: MU_KEY_TEXT;
+    imp->keypos[imp->part.nkey] = i;
+    imp->part.keycol[imp->part.nkey] = strdup(sqlite3_column_name(stmt, i));
+    imp->part.keytype[imp->part.nkey++] = type;
+    col = strtok_r(NULL, ", ", &save);
+  }
+  if ((0==status) && (0==imp->part.nkey)){
+    MU_WARN("%s\n", "mu_create_shards_from_csv() received an empty list of partition key columns");
+    status = -1;
+  }
+  sqlite3_finalize(stmt);
+  free(cols);
+  sqlite3_free(sql);
+  return status;
+}
+
+struct mu_APPEND_TARGET {
+  const char *name;
+  long long bytes;
+};
+
+static int mu_cmp_append_target(const void *a, const void *b){
+  long long x = ((const struct mu_APPEND_TARGET *) a)->bytes;
+  long long y = ((const struct mu_APPEND_TARGET *) b)->bytes;
+  return (x>y)-(x<y);
+}
+
+static void mu_free_names(char **names){
+  char **p;
+  for(p=names; (p) && (*p); ++p)
+    free(*p);
+  free(names);
+}
+
+/* chooses the shards of dbDir that rows appended to tablename go to, as a NULL terminated list of names in *names.
+ * A partitioned table keeps its hash rule, so its rows go to its shards by key, with the key columns in *keycols.
+ * Otherwise rows go to the shardc smallest shards under maxbytes (0 for no limit), and new shards numbered after
+ * the existing ones when there are not enough of those.  returns the number of shards, or -1 on error */
+static int mu_append_targets(const char *dbDir, const char *tablename, int shardc, long long maxbytes, char ***names, char **keycols){
+  size_t cursor = mu_error_cursor;
+  struct mu_DBCONF *conf = mu_opendb(dbDir);
+  if (NULL==conf)
+    mu_error_cursor = cursor; /* an empty directory has nothing to append to yet */
+  struct mu_PARTITION *part;
+  for(part=(conf)? conf->partition: NULL; (part) && strcasecmp(part->tablename, tablename); part=part->next)
+    ;
+  int n = (part)? part->shardc: shardc;
+  size_t nshard = (conf)? conf->shardc: 0;
+  struct mu_APPEND_TARGET *t = malloc((nshard+1)*sizeof(struct mu_APPEND_TARGET));
+  *names = calloc((size_t) n+1, sizeof(char *));
+  *keycols = NULL;
+  int status = ((NULL==t) || (NULL==*names))? -1: 0;
+  if (status)
+    MU_WARN_OOM();
+  int i;
+  if ((0==status) && (part)){
+    struct mu_STRBUF cols = { NULL, 0, 0 };
+    for(i=0; (i<part->nkey) && (0==status); ++i)
+      status = ((i) && mu_strbuf_adds(&cols, ",")) || mu_strbuf_adds(&cols, part->keycol[i]);
+    *keycols = cols.s;
+    for(i=0; (i<n) && (0==status); ++i)
+      status = (NULL==((*names)[i] = malloc(16))) || (snprintf((*names)[i], 16, "%.3d", i)<0);
+  } else if (0==status){
+    size_t k;
+    size_t ntarget = 0;
+    long next = 0;
+    for(k=0;k<nshard;++k){
+      const char *base = strrchr(conf->shardv[k], '/');
+      base = (base)? base+1: conf->shardv[k];
+      char *end;
+      long num = strtol(base, &end, 10);
+      if ((0==*end) && (num>=next))
+	next = num+1;
+      struct stat fstats;
+      long long bytes = (conf->shardinfo)? conf->shardinfo[k].bytes: ((stat(conf->shardv[k], &fstats))? 0: (long long) fstats.st_size);
+      if ((maxbytes<=0) || (bytes<maxbytes)){
+	t[ntarget].name = base;
+	t[ntarget++].bytes = bytes;
+      }
+    }
+    qsort(t, ntarget, sizeof(struct mu_APPEND_TARGET), mu_cmp_append_target);
+    for(i=0; (i<n) && (0==status); ++i){
+      if ((size_t) i<ntarget)
+	status = (NULL==((*names)[i] = strdup(t[i].name)));
+      else
+	status = (NULL==((*names)[i] = malloc(32))) || (snprintf((*names)[i], 32, "%.3ld", next++)<0);
+    }
+  }
+  if (status){
+    mu_free_names(*names);
+    *names = NULL;
+    free(*keycols);
+    *keycols = NULL;
+  }
+  free(t);
+  mu_free_dbconf(conf);
+  return (status)? -1: n;
+}
+
+static int mu_import_csv(const char *csvname, int skip, const char *createsql, char sep, const char *tablename, const char *dbDir, int shardc, const char *keycols, char **names){
+  int fd = open(csvname, O_RDONLY);
+  struct stat st;
+  if ((fd<0) || fstat(fd, &st)){
+    MU_WARN_FNAME(csvname);
+    MU_WARN_IF_ERRNO();
+    if (fd>=0)
+      close(fd);
+    return -1;
+  }
+  size_t size = (size_t) st.st_size;
+  const char *map = "";
+  if (size>0){
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED==map){
+      MU_WARN("mu_create_shards_from_csv() could not map the csv file %s into memory\n", csvname);
+      MU_WARN_IF_ERRNO();
+      close(fd);
+      return -1;
+    }
+    madvise((void *) map, size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  struct mu_CSV_IMPORT imp;
+  memset(&imp, 0, sizeof(imp));
+  imp.end = map+size;
+  imp.sep = sep;
+  imp.shardc = shardc;
+  imp.names = names;
+  /* bound the rows each thread holds back, whatever the number of shards */
+  imp.batchsize = (32*1024*1024)/((size_t) shardc);
+  if (imp.batchsize<16*1024)
+    imp.batchsize = 16*1024;
+  imp.writer = calloc((size_t) shardc, sizeof(struct mu_SHARDWRITER));
+  int failed = (NULL==imp.writer);
+  if (failed)
+    MU_WARN_OOM();
+  int ishard;
+  int opened = 0;
+  for(ishard=0;(ishard<shardc) && (!failed);++ishard){
+    pthread_mutex_init(&(imp.writer[ishard].lock), NULL);
+    ++opened;
+    failed = mu_csv_open_writer(&imp, ishard, createsql, tablename, dbDir);
+    if ((0==ishard) && (!failed) && (keycols))
+      failed = mu_csv_keys(&imp, imp.writer[0].db, tablename, keycols);
+  }
+
+  const char *start = map;
+  int i;
+  for(i=0;(i<skip) && (start<imp.end);++i){
+    const char *nl = memchr(start, '\n', (size_t) (imp.end-start));
+    start = (nl)? nl+1: imp.end;
+  }
+
+  /* one range per core, but no range much smaller than a few megabytes */
+  long int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if ((ncpu<=0) || (ncpu>255))
+    ncpu = 2;
+  size_t remaining = (size_t) (imp.end-start);
+  int nthreads = (int) ((remaining/(4*1024*1024))+1);
+  if (nthreads>ncpu)
+    nthreads = (int) ncpu;
+  pthread_t tid[nthreads];
+  struct mu_CSV_WORKER worker[nthreads];
+  memset(worker, 0, sizeof(worker));
+  unsigned int seed = mu_get_random_seed();
+  int started = 0;
+  int quoted = 0;
+  for(i=0;i<nthreads;++i){
+    worker[i].imp = &imp;
+    worker[i].begin = start+(remaining/nthreads)*i;
+    worker[i].end = (i+1<nthreads)? start+(remaining/nthreads)*(i+1): imp.end;
+    worker[i].seed = seed+7919*i;
+  }
+
+  /* A newline inside a quoted field does not end a row, so when the file has */
+  /* quotes the ranges are cut by reading rows from the start instead.        */
+  for(i=0;(i<nthreads) && (!failed);++i){
+    if (pthread_create(&tid[i], NULL, mu_csv_quote_scan, &worker[i])){
+      MU_WARN("%s\n", "mu_create_shards_from_csv() could not start a thread");
+      failed = 1;
+      break;
+    }
+    ++started;
+  }
+  for(i=0;i<started;++i){
+    pthread_join(tid[i], NULL);
+    quoted = (quoted) || (worker[i].quoted);
+  }
+  const char *p = start;
+  for(i=1;(i<nthreads) && (!failed);++i){
+    const char *cut = worker[i].begin;
+    if (quoted){
+      int nfields;
+      while (p<cut)
+	p = mu_csv_row(p, imp.end, sep, 0, NULL, &nfields);
+    } else if (p<cut){
+      const char *nl = memchr(cut-1, '\n', (size_t) (imp.end-cut+1));
+      p = (nl)? nl+1: imp.end;
+    }
+    worker[i-1].end = p;
+    worker[i].begin = p;
+  }
+
+  started = 0;
+  for(i=0;(i<nthreads) && (!failed);++i){
+    if (pthread_create(&tid[i], NULL, mu_csv_worker, &worker[i])){
+      MU_WARN("%s\n", "mu_create_shards_from_csv() could not start a thread");
+      imp.failed = 1;
+      failed = 1;
+      break;
+    }
+    ++started;
+  }
+  size_t badrows = 0;
+  for(i=0;i<started;++i){
+    pthread_join(tid[i], NULL);
+    if (worker[i].errs)
+      MU_WARN("%s", worker[i].errs);
+    free(worker[i].errs);
+    failed = (failed) || (worker[i].status);
+    badrows += worker[i].badrows;
+  }
+
+  for(ishard=0;ishard<opened;++ishard){
+    struct mu_SHARDWRITER *sw = &(imp.writer[ishard]);
+    sqlite3_finalize(sw->insert);
+    if ((!failed) && mu_sqlite3_exec(sw->db, "commit;")){
+      MU_WARN("mu_create_shards_from_csv() could not save shard %.3d\n", ishard);
+      failed = 1;
+    }
+    sqlite3_close(sw->db);
+    pthread_mutex_destroy(&(sw->lock));
+  }
+  free(imp.writer);
+  if (size>0)
+    munmap((void *) map, size);
+  if ((!failed) && (imp.part.nkey))
+    failed = mu_catalog_save(dbDir, &(imp.part));
+  for(i=0;i<imp.part.nkey;++i)
+    free(imp.part.keycol[i]);
+
+  if (failed){
+    MU_WARN("%s\n", "Fatal Error detected by mu_create_shards_from_csv().  An Error occurred while creating the shard databases.  You should delete any newly generated shard databases and run again after fixing any correctable errors.");
+    return -1;
+  }
+  if (badrows){
+    /* the sqlite3 shell warns, fills missing fields with NULL and ignores extras */
+    MU_WARN("mu_create_shards_from_csv() found %zu rows in %s that did not have the %d columns of table %s.  Missing columns were filled with NULL and extra columns were ignored.\n", badrows, csvname, imp.ncol, tablename);
+    return -1;
+  }
+  return 0;
+}
+
+/* Parallel split of a sqlite3 table by its shardid column.  The table is read    */
+/* once, by one thread per core, each reading its own range of rowids and dealing */
+/* the rows out in batches to the shard named by their shardid.  A shard database */
+/* is created when its first row is seen and stays in one transaction until every */
+/* thread is done.                                                                */
+
+struct mu_SPLITSHARD {
+  char *id;
+  size_t len;
+  int num; /* order in which the shard was first seen */
+  int valid; /* 0 for a shardid that is not a usable file name, whose rows are ignored */
+  struct mu_SHARDWRITER w;
+};
+
+/* an open addressing hash table from shardid to shard */
+struct mu_SHARDIDS {
+  size_t cap;
+  size_t n;
+  struct mu_SPLITSHARD **v;
+};
+
+struct mu_SPLIT {
+  const char *dbname;
+  const char *tablename;
+  const char *dbdir;
+  int append; /* add rows to the table in shards that have it already */
+  int ncol;
+  int shardcol;
+  long int max_shards;
+  pthread_mutex_t lock; /* guards ids and shard */
+  struct mu_SHARDIDS ids;
+  struct mu_SPLITSHARD **shard; /* by num */
+  size_t cap;
+  volatile size_t nshard;
+  volatile int failed;
+};
+
+struct mu_SPLIT_READER {
+  struct mu_SPLIT *split;
+  int ranged;
+  sqlite3_int64 lo;
+  sqlite3_int64 hi;
+  int status;
+  char *errs;
+};
+
+static struct mu_SPLITSHARD ** mu_shardids_slot(struct mu_SHARDIDS *ids, const char *id, size_t len){
+  size_t i = (size_t) (mu_fnv1a(MU_FNV1A_BASIS, id, len) & (ids->cap-1));
+  while ((ids->v[i]) && ((ids->v[i]->len!=len) || memcmp(ids->v[i]->id, id, len)))
+    i = (i+1) & (ids->cap-1);
+  return &(ids->v[i]);
+}
+
+static struct mu_SPLITSHARD * mu_shardids_find(const struct mu_SHARDIDS *ids, const char *id, size_t len){
+  return (ids->cap)? *mu_shardids_slot((struct mu_SHARDIDS *) ids, id, len): NULL;
+}
+
+/* adds s, doubling the table when it is half full.  returns 0 on success */
+static int mu_shardids_add(struct mu_SHARDIDS *ids, struct mu_SPLITSHARD *s){
+  if (2*(ids->n+1)>ids->cap){
+    struct mu_SHARDIDS bigger = { (ids->cap)? 2*ids->cap: 64, 0, NULL };
+    bigger.v = calloc(bigger.cap, sizeof(struct mu_SPLITSHARD *));
+    if (NULL==bigger.v){
+      MU_WARN_OOM();
+      return -1;
+    }
+    size_t i;
+    for(i=0;i<ids->cap;++i){
+      if (ids->v[i])
+	*mu_shardids_slot(&bigger, ids->v[i]->id, ids->v[i]->len) = ids->v[i];
+    }
+    bigger.n = ids->n;
+    free(ids->v);
+    *ids = bigger;
+  }
+  *mu_shardids_slot(ids, s->id, s->len) = s;
+  ++ids->n;
+  return 0;
+}
+
+static int mu_split_open_writer(struct mu_SPLIT *split, struct mu_SPLITSHARD *s){
+  struct mu_SHARDWRITER *sw = &(s->w);
+  char *dbname = sqlite3_mprintf("%s/%s", split->dbdir, s->id);
+  if (NULL==dbname){
+    MU_WARN_OOM();
+    return -1;
+  }
+  sw->db = mu_sqlite3_open(dbname);
+  sqlite3_free(dbname);
+  /* the shard table has the columns "create table as select" gives them, as before */
+  if (NULL==sw->db)
+    return -1;
+  if ( ((!split->append) ||
+	(SQLITE_OK!=sqlite3_table_column_metadata(sw->db, NULL, split->tablename, NULL, NULL, NULL, NULL, NULL, NULL))) &&
+       mu_sqlite3_execf(sw->db,
+		       "attach database %Q as mu_source;\n"
+		       "create table main.\"%w\" as select * from mu_source.\"%w\" where 0;\n"
+		       "detach database mu_source;\n",
+		       split->dbname, split->tablename, split->tablename) )
+    return -1;
+  struct mu_STRBUF sql = { NULL, 0, 0 };
+  char *into = sqlite3_mprintf("insert into \"%w\" values(?", split->tablename);
+  int i;
+  int failed = (NULL==into) || mu_strbuf_adds(&sql, into);
+  for(i=1;(i<split->ncol) && (!failed);++i)
+    failed = mu_strbuf_adds(&sql, ",?");
+  failed = (failed) || mu_strbuf_adds(&sql, ");");
+  sqlite3_free(into);
+  if ((!failed) && (sqlite3_prepare_v2(sw->db, sql.s, -1, &(sw->insert), NULL)!=SQLITE_OK)){
+    MU_WARN("sqlite3 reported this error:\n%s\n", sqlite3_errmsg(sw->db));
+    failed = 1;
+  }
+  free(sql.s);
+  if ((failed) || mu_sqlite3_exec(sw->db, "begin;"))
+    return -1;
+  return 0;
+}
+
+/* the shard for shardid id, created on first sight.  NULL on error */
+static struct mu_SPLITSHARD * mu_split_shard(struct mu_SPLIT *split, const char *id, size_t len){
+  pthread_mutex_lock(&(split->lock));
+  struct mu_SPLITSHARD *s = mu_shardids_find(&(split->ids), id, len);
+  if (s){
+    pthread_mutex_unlock(&(split->lock));
+    return s;
+  }
+  if ((split->max_shards>0) && ((long int) split->nshard>=split->max_shards)){
+    MU_WARN("mu_create_shards_from_sqlite_table() found more distinct values of shardid than the approximately %ld shards that can be open at once\n", split->max_shards);
+    pthread_mutex_unlock(&(split->lock));
+    return NULL;
+  }
+  if ((split->nshard==split->cap)){
+    size_t cap = (split->cap)? 2*split->cap: 64;
+    struct mu_SPLITSHARD **bigger = realloc(split->shard, cap*sizeof(struct mu_SPLITSHARD *));
+    if (NULL==bigger){
+      MU_WARN_OOM();
+      pthread_mutex_unlock(&(split->lock));
+      return NULL;
+    }
+    split->shard = bigger;
+    split->cap = cap;
+  }
+  s = calloc(1, sizeof(struct mu_SPLITSHARD));
+  char *dup = malloc(len+1);
+  if ((NULL==s) || (NULL==dup) || mu_shardids_add(&(split->ids), s)){
+    MU_WARN_OOM();
+    free(s);
+    free(dup);
+    pthread_mutex_unlock(&(split->lock));
+    return NULL;
+  }
+  memcpy(dup, id, len);
+  dup[len] = 0;
+  s->id = dup;
+  s->len = len;
+  s->num = (int) split->nshard;
+  s->valid = (strlen(dup)==len) && ok_mu_shard_name(dup);
+  pthread_mutex_init(&(s->w.lock), NULL);
+  split->shard[split->nshard++] = s;
+  int failed = 0;
+  if (s->valid)
+    failed = mu_split_open_writer(split, s);
+  else
+    MU_WARN("Warning: mu_create_shards_from_sqlite_table() will ignore all data rows tagged with shardid %s .  Valid shard names may contain 0-9,a-z,A-Z,-,_, or . but may not begin with . \n", dup);
+  pthread_mutex_unlock(&(split->lock));
+  return (failed)? NULL: s;
+}
+
+/* rows are batched as ncol fields, each a type byte followed by the value */
+static int mu_split_add(struct mu_STRBUF *b, sqlite3_stmt *stmt, int ncol){
+  int i;
+  for(i=0;i<ncol;++i){
+    char type = (char) sqlite3_column_type(stmt, i);
+    if (mu_strbuf_add(b, &type, 1))
+      return -1;
+    if (SQLITE_INTEGER==type){
+      sqlite3_int64 v = sqlite3_column_int64(stmt, i);
+      if (mu_strbuf_add(b, (const char *) &v, sizeof(v)))
+	return -1;
+    } else if (SQLITE_FLOAT==type){
+      double v = sqlite3_column_double(stmt, i);
+      if (mu_strbuf_add(b, (const char *) &v, sizeof(v)))
+	return -1;
+    } else if (SQLITE_NULL!=type){
+      const char *v = (SQLITE_TEXT==type)? (const char *) sqlite3_column_text(stmt, i): sqlite3_column_blob(stmt, i);
+      size_t n = (size_t) sqlite3_column_bytes(stmt, i);
+      if (mu_strbuf_add(b, (const char *) &n, sizeof(n)) || ((n) && mu_strbuf_add(b, v, n)))
+	return -1;
+    }
+  }
+  return 0;
+}
+
+static int mu_split_flush(struct mu_SPLIT *split, struct mu_SPLITSHARD *s, struct mu_STRBUF *b, size_t nrows){
+  struct mu_SHARDWRITER *sw = &(s->w);
+  const char *p = b->s;
+  int status = 0;
+  size_t r;
+  pthread_mutex_lock(&(sw->lock));
+  for(r=0;(r<nrows) && (0==status);++r){
+    int i;
+    for(i=0;i<split->ncol;++i){
+      char type = *p++;
+      if (SQLITE_INTEGER==type){
+	sqlite3_int64 v;
+	memcpy(&v, p, sizeof(v));
+	p += sizeof(v);
+	sqlite3_bind_int64(sw->insert, i+1, v);
+      } else if (SQLITE_FLOAT==type){
+	double v;
+	memcpy(&v, p, sizeof(v));
+	p += sizeof(v);
+	sqlite3_bind_double(sw->insert, i+1, v);
+      } else if (SQLITE_NULL==type)
+	sqlite3_bind_null(sw->insert, i+1);
+      else {
+	size_t n;
+	memcpy(&n, p, sizeof(n));
+	p += sizeof(n);
+	if (SQLITE_TEXT==type)
+	  sqlite3_bind_text(sw->insert, i+1, p, (int) n, SQLITE_STATIC);
+	else
+	  sqlite3_bind_blob(sw->insert, i+1, p, (int) n, SQLITE_STATIC);
+	p += n;
+      }
+    }
+    if (sqlite3_step(sw->insert)!=SQLITE_DONE){
+      MU_WARN("mu_create_shards_from_sqlite_table() could not insert a row into shard %s\n", s->id);
+      MU_WARN("sqlite3 reported this error:\n%s\n", sqlite3_errmsg(sw->db));
+      status = -1;
+    }
+    sqlite3_reset(sw->insert);
+  }
+  pthread_mutex_unlock(&(sw->lock));
+  b->len = 0;
+  return status;
+}
+
+static void * mu_split_reader(void *arg){
+  struct mu_SPLIT_READER *r = (struct mu_SPLIT_READER *) arg;
+  struct mu_SPLIT *split = r->split;
+  struct mu_SHARDIDS seen = { 0, 0, NULL }; /* shards this thread has met, so the lock is only taken for new ones */
+  struct mu_SPLITSHARD **shard = NULL; /* by num, as split->shard may move while others add to it */
+  struct mu_STRBUF *batch = NULL;
+  size_t *nrows = NULL;
+  size_t nbatch = 0;
+  sqlite3_stmt *stmt = NULL;
+  sqlite3 *db = mu_sqlite3_open(split->dbname);
+  char *sql = sqlite3_mprintf((r->ranged)? "select * from \"%w\" where rowid between ?1 and ?2;": "select * from \"%w\";", split->tablename);
+  if ((NULL==db) || (NULL==sql) || (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)!=SQLITE_OK)){
+    MU_WARN("mu_create_shards_from_sqlite_table() could not read table %s of %s\n", split->tablename, split->dbname);
+    if (db)
+      MU_WARN("%s\n", sqlite3_errmsg(db));
+    r->status = -1;
+  }
+  sqlite3_free(sql);
+  if (r->ranged){
+    sqlite3_bind_int64(stmt, 1, r->lo);
+    sqlite3_bind_int64(stmt, 2, r->hi);
+  }
+  int rc = SQLITE_DONE;
+  while ((0==r->status) && (!split->failed) && ((rc = sqlite3_step(stmt))==SQLITE_ROW)){
+    const char *id = (const char *) sqlite3_column_text(stmt, split->shardcol);
+    size_t len = (size_t) sqlite3_column_bytes(stmt, split->shardcol);
+    if ((NULL==id) || (0==len))
+      continue;
+    struct mu_SPLITSHARD *s = mu_shardids_find(&seen, id, len);
+    if (NULL==s){
+      if ((NULL==(s = mu_split_shard(split, id, len))) || mu_shardids_add(&seen, s)){
+	r->status = -1;
+	break;
+      }
+      if ((size_t) s->num>=nbatch){
+	size_t n = 2*((size_t) s->num+1);
+	struct mu_STRBUF *b = realloc(batch, n*sizeof(struct mu_STRBUF));
+	size_t *c = (b)? realloc(nrows, n*sizeof(size_t)): NULL;
+	struct mu_SPLITSHARD **p = (c)? realloc(shard, n*sizeof(struct mu_SPLITSHARD *)): NULL;
+	if (b)
+	  batch = b;
+	if (c)
+	  nrows = c;
+	if (NULL==p){
+	  MU_WARN_OOM();
+	  r->status = -1;
+	  break;
+	}
+	shard = p;
+	memset(batch+nbatch, 0, (n-nbatch)*sizeof(struct mu_STRBUF));
+	memset(nrows+nbatch, 0, (n-nbatch)*sizeof(size_t));
+	memset(shard+nbatch, 0, (n-nbatch)*sizeof(struct mu_SPLITSHARD *));
+	nbatch = n;
+      }
+      shard[s->num] = s;
+    }
+    if (!s->valid)
+      continue;
+    if (mu_split_add(&batch[s->num], stmt, split->ncol)){
+      r->status = -1;
+      break;
+    }
+    ++nrows[s->num];
+    /* bound the rows each thread holds back, whatever the number of shards */
+    size_t batchsize = (32*1024*1024)/split->nshard;
+    if (batch[s->num].len>=((batchsize<16*1024)? 16*1024: batchsize)){
+      r->status = mu_split_flush(split, s, &batch[s->num], nrows[s->num]);
+      nrows[s->num] = 0;
+    }
+  }
+  if ((0==r->status) && (!split->failed) && (rc!=SQLITE_DONE)){
+    MU_WARN("mu_create_shards_from_sqlite_table() could not read table %s of %s\n", split->tablename, split->dbname);
+    MU_WARN("sqlite3 reported this error:\n%s\n", sqlite3_errmsg(db));
+    r->status = -1;
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  size_t i;
+  for(i=0;i<nbatch;++i){
+    if ((0==r->status) && (!split->failed) && (nrows[i]))
+      r->status = mu_split_flush(split, shard[i], &batch[i], nrows[i]);
+    free(batch[i].s);
+  }
+  free(batch);
+  free(nrows);
+  free(shard);
+  free(seen.v);
+  if (r->status)
+    split->failed = 1;
+  if (mu_error_string()){
+    r->errs = strdup(mu_error_string());
+    mu_error_clear();
+  }
+  return NULL;
+}
+
+static int mu_split_sqlite_table(const char *dbname, const char *tablename, const char *dbdir, int append){
+  struct mu_SPLIT split;
+  memset(&split, 0, sizeof(split));
+  split.append = append;
+  split.dbname = dbname;
+  split.tablename = tablename;
+  split.dbdir = dbdir;
+  split.shardcol = -1;
+  /* each shard holds its database and journal open until the end */
+  split.max_shards = sysconf(_SC_OPEN_MAX);
+  split.max_shards = (split.max_shards>20)? (split.max_shards-10)/2: 0;
+
+  struct stat fstats;
+  if (stat(dbname, &fstats)){
+    MU_WARN_FNAME(dbname);
+    MU_WARN_IF_ERRNO();
+    return -1;
+  }
+  sqlite3 *db = mu_sqlite3_open(dbname);
+  if (NULL==db)
+    return -1;
+  sqlite3_stmt *stmt = NULL;
+  char *sql = sqlite3_mprintf("select * from \"%w\";", tablename);
+  if ((NULL==sql) || (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)!=SQLITE_OK)){
+    MU_WARN("Fatal Error in mu_create_shards_from_sqlite_table().  Could not read table %s of %s\n", tablename, dbname);
+    MU_WARN("%s\n", sqlite3_errmsg(db));
+    sqlite3_free(sql);
+    sqlite3_close(db);
+    return -1;
+  }
+  sqlite3_free(sql);
+  split.ncol = sqlite3_column_count(stmt);
+  int i;
+  for(i=0;i<split.ncol;++i){
+    if (0==strcasecmp(sqlite3_column_name(stmt, i), "shardid"))
+      split.shardcol = i;
+  }
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+  if (split.shardcol<0){
+    MU_WARN("Fatal Error in mu_create_shards_from_sqlite_table().  Table %s has no shardid column.  Before calling mu_create_shards_from_sqlite_table() make sure that the shardid column exists and has values to indicate a shardid for each row of the table.\n", tablename);
+    sqlite3_close(db);
+    return -1;
+  }
+
+  /* one range of rowids per core.  A table without rowids is read by one thread. */
+  long int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if ((ncpu<=0) || (ncpu>255))
+    ncpu = 2;
+  int nthreads = 1;
+  sqlite3_int64 lo = 0, hi = -1;
+  sql = sqlite3_mprintf("select min(rowid), max(rowid) from \"%w\";", tablename);
+  if ((sql) && (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)==SQLITE_OK) && (sqlite3_step(stmt)==SQLITE_ROW) &&
+      (SQLITE_INTEGER==sqlite3_column_type(stmt, 0))){
+    lo = sqlite3_column_int64(stmt, 0);
+    hi = sqlite3_column_int64(stmt, 1);
+    nthreads = (int) ncpu;
+    if ((sqlite3_uint64) (hi-lo)<(sqlite3_uint64) nthreads)
+      nthreads = (int) (hi-lo)+1;
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_free(sql);
+  sqlite3_close(db);
+
+  pthread_t tid[nthreads];
+  struct mu_SPLIT_READER reader[nthreads];
+  memset(reader, 0, sizeof(reader));
+  sqlite3_uint64 span = ((sqlite3_uint64) (hi-lo))/((sqlite3_uint64) nthreads)+1;
+  for(i=0;i<nthreads;++i){
+    reader[i].split = &split;
+    reader[i].ranged = (hi>=lo);
+    reader[i].lo = (sqlite3_int64) ((sqlite3_uint64) lo+span*i);
+    reader[i].hi = (i+1<nthreads)? (sqlite3_int64) ((sqlite3_uint64) lo+span*(i+1)-1): hi;
+  }
+  pthread_mutex_init(&(split.lock), NULL);
+  int failed = 0;
+  int started = 0;
+  for(i=0;i<nthreads;++i){
+    if (pthread_create(&tid[i], NULL, mu_split_reader, &reader[i])){
+      MU_WARN("%s\n", "mu_create_shards_from_sqlite_table() could not start a thread");
+      split.failed = 1;
+      failed = 1;
+      break;
+    }
+    ++started;
+  }
+  for(i=0;i<started;++i){
+    pthread_join(tid[i], NULL);
+    if (reader[i].errs)
+      MU_WARN("%s", reader[i].errs);
+    free(reader[i].errs);
+    failed = (failed) || (reader[i].status);
+  }
+
+  size_t n;
+  int nvalid = 0;
+  for(n=0;n<split.nshard;++n){
+    struct mu_SPLITSHARD *s = split.shard[n];
+    struct mu_SHARDWRITER *sw = &(s->w);
+    sqlite3_finalize(sw->insert);
+    if ((!failed) && (sw->db) && mu_sqlite3_exec(sw->db, "commit;")){
+      MU_WARN("mu_create_shards_from_sqlite_table() could not save shard %s\n", s->id);
+      failed = 1;
+    }
+    sqlite3_close(sw->db);
+    pthread_mutex_destroy(&(sw->lock));
+    nvalid += s->valid;
+    free(s->id);
+    free(s);
+  }
+  free(split.shard);
+  free(split.ids.v);
+  pthread_mutex_destroy(&(split.lock));
+  if ((!failed) && (0==nvalid)){
+    MU_WARN("%s\n", "Fatal Error in mu_create_shards_from_sqlite_table().  While reading the shardid column of the table, there were no usable values. All values read were either NULL or blank string. Before calling mu_create_shards_from_sqlite_table() make sure that the shardid column exists and has values to indicate a shardid for each row of the table.");
+    return -1;
+  }
+  if (failed){
+    MU_WARN("%s\n", "Fatal Error detected by mu_create_shards_from_sqlite_table() while creating the shard databases.  You should probably delete the newly created shard databases and run this creation task again after reviewing the messages below and fixing any correctable errors.");
+    return -1;
+  }
+  return 0;
+}
+
+/* Query service.  Requests and responses are sequences of fields, each sent as
+ *   name length\n
+ *   <length bytes>\n
+ * A request carries mapsql, and optionally createtablesql, combinesql and
+ * reducesql, and ends with a "run" field.  The response carries an optional
+ * "result" and an optional "error", and ends with an "end" field.  A client may
+ * send any number of requests on one connection.
+ * A request ending with a "map" field instead runs only the map, and combine,
+ * on the server's shards.  Its response carries the merged maptable as a
+ * serialized sqlite3 database in a "mapdb" field, unless there were no results.
+ * An agent started with MULTICORE_AGENT_TOKEN also wants a "token" field with
+ * the same value in each request.  A request's fields may hold at most
+ * MU_REQUEST_MAX bytes each.
+ */
+
+#define MU_REQUEST_MAX ((size_t) 1<<24)
+#define MU_RESPONSE_MAX ((size_t) 1<<32)
+
+static int mu_map_image(struct mu_DBCONF *conf, struct mu_QUERY *q, struct mu_IMAGE *im);
+
+static int mu_write_all(int fd, const char *buf, size_t len){
+  while (len>0){
+    ssize_t n = write(fd, buf, len);
+    if (n<0){
+      if (EINTR==errno)
+	continue;
+      MU_WARN("%s\n", "A write to a multicoresql socket failed.");
+      MU_WARN_IF_ERRNO();
+      return -1;
+    }
+    buf += n;
+    len -= (size_t) n;
+  }
+  return 0;
+}
+
+static int mu_send_field(int fd, const char *name, const char *value, size_t len){
+  char header[64];
+  int n = snprintf(header, sizeof(header), "%s %zu\n", name, len);
+  if ( mu_write_all(fd, header, (size_t) n) ||
+       ((len) && mu_write_all(fd, value, len)) ||
+       mu_write_all(fd, "\n", 1) )
+    return -1;
+  return 0;
+}
+
+static int mu_send_sfield(int fd, const char *name, const char *value){
+  return (value)? mu_send_field(fd, name, value, strlen(value)): 0;
+}
+
+/* reads one field of at most maxlen bytes into name and a malloc'd, null terminated *value.  Returns 1, or 0 at end of file, or -1 */
+static int mu_recv_field(FILE *f, char *name, char **value, size_t *len, size_t maxlen){
+  *value = NULL;
+  int n = fscanf(f, "%31s %zu", name, len);
+  if (EOF==n)
+    return 0;
+  if ((2!=n) || ('\n'!=fgetc(f)) || (*len>maxlen)){
+    MU_WARN("%s\n", "Received a malformed or oversized message on a multicoresql socket.");
+    return -1;
+  }
+  /* the buffer grows with the bytes that arrive, not with the length the peer claims */
+  size_t cap = (*len<65536)? *len: 65536;
+  size_t got = 0;
+  *value = malloc(cap+1);
+  while ((*value) && (got<*len)){
+    if (got==cap){
+      cap = (2*cap<*len)? 2*cap: *len;
+      char *v = realloc(*value, cap+1);
+      if (NULL==v){
+	free(*value);
+	*value = NULL;
+	break;
+      }
+      *value = v;
+    }
+    size_t r = fread(*value+got, 1, cap-got, f);
+    if (0==r)
+      break;
+    got += r;
+  }
+  if (NULL==*value){
+    MU_WARN_OOM();
+    return -1;
+  }
+  if ((got != *len) || ('\n'!=fgetc(f))){
+    MU_WARN("%s\n", "A multicoresql socket closed in the middle of a message.");
+    free(*value);
+    *value = NULL;
+    return -1;
+  }
+  (*value)[*len] = 0;
+  return 1;
+}
+
+/* copies sql strings as they are; a server must not read files named by its clients */
+static struct mu_QUERY * mu_new_query(const char *mapsql, const char *createtablesql, const char *combinesql, const char *reducesql){
+  struct mu_QUERY *q = calloc(1, sizeof(struct mu_QUERY));
+  if (NULL==q){
+    MU_WARN_OOM();
+    return NULL;
+  }
+  q->mapsql = (mapsql)? strdup(mapsql): NULL;
+  q->createtablesql = (createtablesql)? strdup(createtablesql): NULL;
+  q->combinesql = (combinesql)? strdup(combinesql): NULL;
+  q->reducesql = (reducesql)? strdup(reducesql): NULL;
+  return q;
+}
+
+static void mu_free_query(struct mu_QUERY *q){
+  if (q){
+    free((void *) q->mapsql);
+    free((void *) q->createtablesql);
+    free((void *) q->combinesql);
+    free((void *) q->reducesql);
+    free(q);
+  }
+}
+
+struct mu_CLIENT {
+  struct mu_DBCONF *conf;
+  int fd;
+  int maponly; /* an agent's client, answered only with map results */
+  const char *token; /* the agent's MULTICORE_AGENT_TOKEN, or NULL */
+};
+
+/* compares the whole of both tokens, so the time taken does not tell how much of a guess was right */
+static int is_mu_token_equal(const char *a, const char *b){
+  size_t na = strlen(a);
+  size_t nb = strlen(b);
+  size_t i;
+  unsigned char diff = (na!=nb);
+  for(i=0;i<na;++i)
+    diff |= (unsigned char) (a[i]^b[(nb)? i%nb: 0]);
+  return (0==diff);
+}
+
+static void * mu_serve_client(void *arg){
+  struct mu_CLIENT *client = (struct mu_CLIENT *) arg;
+  int fd = client->fd;
+  FILE *f = fdopen(dup(fd), "r");
+  const char *names[] = { "mapsql", "createtablesql", "combinesql", "reducesql", "token", NULL };
+  char *fields[5] = { NULL, NULL, NULL, NULL, NULL };
+  char name[32];
+  char *value;
+  size_t len;
+  int i;
+  int got;
+  int sent;
+  while ((f) && ((got = mu_recv_field(f, name, &value, &len, MU_REQUEST_MAX)) > 0)){
+    for(i=0; (names[i]) && strcmp(name, names[i]); ++i)
+      ;
+    if (names[i]){
+      free(fields[i]);
+      fields[i] = value;
+      continue;
+    }
+    free(value);
+    if (strcmp(name, "run") && strcmp(name, "map"))
+      continue;
+    mu_error_clear();
+    struct mu_QUERY *q = mu_new_query(fields[0], fields[1], fields[2], fields[3]);
+    if ((client->token) && ((NULL==fields[4]) || (!is_mu_token_equal(fields[4], client->token)))){
+      /* no second guess on this connection */
+      MU_WARN("%s\n", "A multicoresql agent refused a request without its MULTICORE_AGENT_TOKEN");
+      mu_send_sfield(fd, "error", mu_error_string());
+      mu_send_field(fd, "end", NULL, 0);
+      sent = -1;
+    } else if ((client->maponly) && strcmp(name, "map")){
+      MU_WARN("%s\n", "A multicoresql agent only answers map requests");
+      sent = mu_send_sfield(fd, "error", mu_error_string()) ||
+	mu_send_field(fd, "end", NULL, 0);
+    } else if (0==strcmp(name, "map")){
+      struct mu_IMAGE image = { NULL, 0 };
+      if (q)
+	mu_map_image(client->conf, q, &image);
+      sent = ((image.bytes) && mu_send_field(fd, "mapdb", (const char *) image.bytes, (size_t) image.size)) ||
+	mu_send_sfield(fd, "error", mu_error_string()) ||
+	mu_send_field(fd, "end", NULL, 0);
+      sqlite3_free(image.bytes);
+    } else {
+      /* a dot command would send the client's sql to a sqlite3 shell, which runs .system and .shell */
+      char *result = NULL;
+      if ((q) && !(is_mu_dot_free(q->mapsql) &&
+		   is_mu_dot_free(q->createtablesql) &&
+		   is_mu_dot_free(q->combinesql) &&
+		   is_mu_dot_free(q->reducesql)))
+	MU_WARN("%s\n", "The multicoresql server runs queries in its own process and can not run sqlite3 shell dot commands such as .mode");
+      else if (q)
+	result = mu_run_query(client->conf, q);
+      sent = mu_send_sfield(fd, "result", result) ||
+	mu_send_sfield(fd, "error", mu_error_string()) ||
+	mu_send_field(fd, "end", NULL, 0);
+      free(result);
+    }
+    mu_free_query(q);
+    for(i=0;i<4;++i){
+      free(fields[i]);
+      fields[i] = NULL;
+    }
+    if (sent)
+      break;
+  }
+  for(i=0;i<5;++i)
+    free(fields[i]);
+  if (f)
+    fclose(f);
+  close(fd);
+  free(client);
+  mu_error_clear();
+  return NULL;
+}
+
+static int mu_unix_address(const char *socketname, struct sockaddr_un *addr){
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  if ((NULL==socketname) || (strlen(socketname) >= sizeof(addr->sun_path))){
+    MU_WARN("Error: the socket name is missing or too long: %s\n", (socketname)? socketname: "(null)");
+    return -1;
+  }
+  strcpy(addr->sun_path, socketname);
+  return 0;
+}
+
+static int mu_serve_socket(struct mu_DBCONF *conf, int sd, const char *socketname, int maponly, const char *token);
+
+int mu_serve(struct mu_DBCONF *conf, const char *socketname){
+  struct sockaddr_un addr;
+  if (NULL==conf){
+    MU_WARN("%s\n", mu_error_null_dbconf);
+    return -1;
+  }
+  if (mu_unix_address(socketname, &addr))
+    return -1;
+  signal(SIGPIPE, SIG_IGN);
+  int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sd<0){
+    MU_WARN("%s\n", "mu_serve() could not create a socket");
+    MU_WARN_IF_ERRNO();
+    return -1;
+  }
+  unlink(socketname);
+  if (bind(sd, (struct sockaddr *) &addr, sizeof(addr)) || listen(sd, 64)){
+    MU_WARN("mu_serve() could not listen on %s\n", socketname);
+    MU_WARN_IF_ERRNO();
+    close(sd);
+    return -1;
+  }
+  return mu_serve_socket(conf, sd, socketname, 0, NULL);
+}
+
+/* serves the clients connecting to the listening socket sd, one thread each, only with map results when maponly
+ * and only to requests carrying token when it is not NULL.  Only returns on error */
+static int mu_serve_socket(struct mu_DBCONF *conf, int sd, const char *socketname, int maponly, const char *token){
+  for(;;){
+    int fd = accept(sd, NULL, NULL);
+    if (fd<0){
+      if ((EINTR==errno) || (ECONNABORTED==errno))
+	continue;
+      MU_WARN("mu_serve() stopped accepting connections on %s\n", socketname);
+      MU_WARN_IF_ERRNO();
+      close(sd);
+      return -1;
+    }
+    struct mu_CLIENT *client = malloc(sizeof(struct mu_CLIENT));
+    pthread_t tid;
+    if (NULL==client){
+      close(fd);
+      continue;
+    }
+    client->conf = conf;
+    client->fd = fd;
+    client->maponly = maponly;
+    client->token = token;
+    if (pthread_create(&tid, NULL, mu_serve_client, client)){
+      close(fd);
+      free(client);
+      continue;
+    }
+    pthread_detach(tid);
+  }
+}
+
+char * mu_remote_query(const char *socketname, struct mu_QUERY *q){
+  struct sockaddr_un addr;
+  if (NULL==q){
+    MU_WARN("%s\n", mu_error_null_query);
+    return NULL;
+  }
+  if (mu_unix_address(socketname, &addr))
+    return NULL;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if ((fd<0) || connect(fd, (struct sockaddr *) &addr, sizeof(addr))){
+    MU_WARN("Error: could not connect to the multicoresql server at %s\n", socketname);
+    MU_WARN_IF_ERRNO();
+    if (fd>=0)
+      close(fd);
+    return NULL;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  char *result = NULL;
+  FILE *f = NULL;
+  if ( mu_send_sfield(fd, "mapsql", q->mapsql) ||
+       mu_send_sfield(fd, "createtablesql", q->createtablesql) ||
+       mu_send_sfield(fd, "combinesql", q->combinesql) ||
+       mu_send_sfield(fd, "reducesql", q->reducesql) ||
+       mu_send_field(fd, "run", NULL, 0) ||
+       (NULL==(f = fdopen(fd, "r"))) ){
+    close(fd);
+    return NULL;
+  }
+  char name[32];
+  char *value;
+  size_t len;
+  int got;
+  while ((got = mu_recv_field(f, name, &value, &len, MU_RESPONSE_MAX)) > 0){
+    if (0==strcmp(name, "result")){
+      free(result);
+      result = value;
+    } else {
+      if (0==strcmp(name, "error"))
+	MU_WARN("%s", value);
+      free(value);
+      if (0==strcmp(name, "end"))
+	break;
+    }
+  }
+  if (got<=0)
+    MU_WARN("Error: the multicoresql server at %s closed the connection before answering\n", socketname);
+  fclose(f);
+  return result;
+}
+
+/* Agents.  An agent is a mu_serve_agent() server on a TCP address, owning   */
+/* the shards of its own directory.  A coordinator sends the map to every   */
+/* agent in conf->agents at once, each on its own thread.  It deserializes  */
+/* the merged maptable each agent returns into an in-memory database, and   */
+/* runs the reduce over all of them as in mu_run_query_threads().           */
+
+static int mu_map_image(struct mu_DBCONF *conf, struct mu_QUERY *q, struct mu_IMAGE *im){
+  im->bytes = NULL;
+  im->size = 0;
+  if ( !(is_mu_dot_free(q->mapsql) &&
+	 is_mu_dot_free(q->createtablesql) &&
+	 is_mu_dot_free(q->combinesql)) ){
+    MU_WARN("%s\n", "A multicoresql agent runs queries in its own process and can not run sqlite3 shell dot commands such as .mode");
+    return -1;
+  }
+  /* a peer may only read the shards, not write them or attach other files */
+  if ( (NULL==q->mapsql) || (!is_mu_select_only(q->mapsql)) ||
+       ((q->createtablesql) && (!is_mu_create_table_only(q->createtablesql))) ||
+       ((q->combinesql) && (!is_mu_select_only(q->combinesql))) ){
+    MU_WARN("%s\n", "A multicoresql agent only runs select maps and combines, after create table statements");
+    return -1;
+  }
+  char use[conf->shardc];
+  size_t nuse = mu_prune_shards(conf, q->mapsql, use);
+  int ncores = (((size_t) conf->ncores)>nuse)? (int) nuse: conf->ncores;
+  if (ncores<1)
+    return 0;
+  return mu_run_query_threads(conf, q, use, ncores, NULL, NULL, im, NULL);
+}
+
+/* splits "host:port", or ":port" or "port" for localhost, and resolves it */
+static struct addrinfo * mu_tcp_address(const char *address){
+  char host[256] = "";
+  const char *colon = (address)? strrchr(address, ':'): NULL;
+  const char *port = (colon)? colon+1: address;
+  if ((NULL==address) || (0==*port) || ((colon) && ((size_t) (colon-address) >= sizeof(host)))){
+    MU_WARN("Error: expected a host:port address, got %s\n", (address)? address: "(null)");
+    return NULL;
+  }
+  if (colon)
+    memcpy(host, address, (size_t) (colon-address));
+  struct addrinfo hints;
+  struct addrinfo *ai = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int rc = getaddrinfo((*host)? host: "localhost", port, &hints, &ai);
+  if (rc){
+    MU_WARN("Error: could not resolve %s: %s\n", address, gai_strerror(rc));
+    return NULL;
+  }
+  return ai;
+}
+
+/* 1 for an address in 127.0.0.0/8 or ::1 */
+static int is_mu_loopback(const struct sockaddr *sa){
+  if (AF_INET==sa->sa_family)
+    return (127==(ntohl(((const struct sockaddr_in *) sa)->sin_addr.s_addr)>>24));
+  if (AF_INET6==sa->sa_family)
+    return IN6_IS_ADDR_LOOPBACK(&(((const struct sockaddr_in6 *) sa)->sin6_addr));
+  return 0;
+}
+
+int mu_serve_agent(struct mu_DBCONF *conf, const char *address){
+  if (NULL==conf){
+    MU_WARN("%s\n", mu_error_null_dbconf);
+    return -1;
+  }
+  struct addrinfo *ai = mu_tcp_address(address);
+  if (NULL==ai)
+    return -1;
+  const char *token = getenv("MULTICORE_AGENT_TOKEN");
+  if ((token) && (0==*token))
+    token = NULL;
+  if ((NULL==token) && (!is_mu_loopback(ai->ai_addr))){
+    MU_WARN("mu_serve_agent() will not serve %s to other hosts without environment variable MULTICORE_AGENT_TOKEN\n", address);
+    freeaddrinfo(ai);
+    return -1;
+  }
+  conf->readonly = 1;
+  signal(SIGPIPE, SIG_IGN);
+  int one = 1;
+  int sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if ( (sd<0) ||
+       setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+       bind(sd, ai->ai_addr, ai->ai_addrlen) ||
+       listen(sd, 64) ){
+    MU_WARN("mu_serve_agent() could not listen on %s\n", address);
+    MU_WARN_IF_ERRNO();
+    if (sd>=0)
+      close(sd);
+    freeaddrinfo(ai);
+    return -1;
+  }
+  freeaddrinfo(ai);
+  return mu_serve_socket(conf, sd, address, 1, token);
+}
+
+struct mu_AGENT_CALL {
+  const char *address; /* points into the copy of conf->agents */
+  struct mu_QUERY *q;
+  char *mapdb; /* the agent's serialized maptable, or NULL when it had no results */
+  size_t size;
+  int status;
+  char *errs;
+};
+
+static void * mu_agent_call(void *arg){
+  struct mu_AGENT_CALL *a = (struct mu_AGENT_CALL *) arg;
+  struct mu_QUERY *q = a->q;
+  struct addrinfo *ai = mu_tcp_address(a->address);
+  int fd = (ai)? socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol): -1;
+  FILE *f = NULL;
+  a->status = -1;
+  if ((ai) && ((fd<0) || connect(fd, ai->ai_addr, ai->ai_addrlen))){
+    MU_WARN("Error: could not connect to the multicoresql agent at %s\n", a->address);
+    MU_WARN_IF_ERRNO();
+  } else if ( (ai) &&
+	      (0==mu_send_sfield(fd, "token", getenv("MULTICORE_AGENT_TOKEN"))) &&
+	      (0==mu_send_sfield(fd, "mapsql", q->mapsql)) &&
+	      (0==mu_send_sfield(fd, "createtablesql", q->createtablesql)) &&
+	      (0==mu_send_sfield(fd, "combinesql", q->combinesql)) &&
+	      (0==mu_send_field(fd, "map", NULL, 0)) &&
+	      (NULL!=(f = fdopen(fd, "r"))) ){
+    char name[32];
+    char *value;
+    size_t len;
+    int got;
+    int failed = 0;
+    while ((got = mu_recv_field(f, name, &value, &len, MU_RESPONSE_MAX)) > 0){
+      if (0==strcmp(name, "mapdb")){
+	free(a->mapdb);
+	a->mapdb = value;
+	a->size = len;
+	continue;
+      }
+      if (0==strcmp(name, "error")){
+	MU_WARN("%s", value);
+	failed = 1;
+      }
+      free(value);
+      if (0==strcmp(name, "end"))
+	break;
+    }
+    if (got<=0)
+      MU_WARN("Error: the multicoresql agent at %s closed the connection before answering\n", a->address);
+    else if (0==failed)
+      a->status = 0;
+  }
+  if (a->status)
+    MU_WARN("map on the multicoresql agent at %s\n", a->address);
+  if (f)
+    fclose(f);
+  else if (fd>=0)
+    close(fd);
+  if (ai)
+    freeaddrinfo(ai);
+  if (mu_error_string()){
+    a->errs = strdup(mu_error_string());
+    mu_error_clear();
+  }
+  return NULL;
+}
+
+/* loads a serialized database as schema of db, which takes the copy it is given */
+static int mu_deserialize(sqlite3 *db, const char *schema, const char *bytes, size_t size){
+  unsigned char *copy = sqlite3_malloc64(size);
+  if (NULL==copy){
+    MU_WARN_OOM();
+    return -1;
+  }
+  memcpy(copy, bytes, size);
+  if (SQLITE_OK!=sqlite3_deserialize(db, schema, copy, (sqlite3_int64) size, (sqlite3_int64) size,
+				     SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE)){
+    MU_WARN("Could not load the map results of an agent: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  return 0;
+}
+
+static int mu_run_agents(struct mu_DBCONF *conf, struct mu_QUERY *q, mu_ROW_CALLBACK cb, void *ctx){
+  const char *errormsg_on_finish_reduce = "Fatal error detected by mu_query() in reduce task";
+  if ( !(is_mu_dot_free(q->mapsql) &&
+	 is_mu_dot_free(q->createtablesql) &&
+	 is_mu_dot_free(q->combinesql) &&
+	 is_mu_dot_free(q->reducesql)) ){
+    MU_WARN("%s\n", "Queries sent to multicoresql agents can not run sqlite3 shell dot commands such as .mode");
+    return -1;
+  }
+  char *list = strdup(conf->agents);
+  if (NULL==list){
+    MU_WARN_OOM();
+    return -1;
+  }
+  int nagent = 1;
+  char *p;
+  for(p=list; *p; ++p)
+    nagent += (','==*p);
+  struct mu_AGENT_CALL call[nagent];
+  pthread_t tid[nagent];
+  memset(call, 0, sizeof(call));
+  int started = 0;
+  int failed = 0;
+  int i;
+  char *save = NULL;
+  for(p = strtok_r(list, ", ", &save); p; p = strtok_r(NULL, ", ", &save)){
+    call[started].address = p;
+    call[started].q = q;
+    if (pthread_create(&tid[started], NULL, mu_agent_call, &call[started])){
+      MU_WARN("Error: could not start a thread to call the multicoresql agent at %s\n", p);
+      failed = 1;
+      break;
+    }
+    ++started;
+  }
+  for(i=0;i<started;++i){
+    pthread_join(tid[i], NULL);
+    if (call[i].errs)
+      MU_WARN("%s", call[i].errs);
+    failed = failed || call[i].status;
+  }
+
+  /* the first result is the reduce database, the next ones are attached */
+  /* up to the attach limit and the rest are copied into the first        */
+  sqlite3 *db = NULL;
+  int stopped = 0;
+  if ((!failed) && (q->reducesql)){
+    int partv[nagent];
+    int partc = 0;
+    int limit = 0;
+    db = mu_sqlite3_open(":memory:");
+    failed = (NULL==db);
+    if (db)
+      limit = mu_attach_limit(db);
+    for(i=0; (i<started) && (!failed); ++i){
+      if (NULL==call[i].mapdb)
+	continue;
+      if (0==partc){
+	failed = mu_deserialize(db, "main", call[i].mapdb, call[i].size);
+      } else if (partc<limit){
+	/* one attachment is kept free for copying the rest */
+	char schema[24];
+	snprintf(schema, sizeof(schema), "coredb%.3d", i);
+	failed = mu_sqlite3_execf(db, "attach database ':memory:' as %s;", schema) ||
+	  mu_deserialize(db, schema, call[i].mapdb, call[i].size);
+      } else {
+	failed = mu_sqlite3_exec(db, "attach database ':memory:' as mu_agent;") ||
+	  mu_deserialize(db, "mu_agent", call[i].mapdb, call[i].size) ||
+	  mu_sqlite3_execf(db,
+			   "insert into main.%s select * from mu_agent.%s;\n"
+			   "detach database mu_agent;\n",
+			   conf->otablename, conf->otablename);
+	continue;
+      }
+      free(call[i].mapdb);
+      call[i].mapdb = NULL;
+      partv[partc++] = i;
+    }
+    struct mu_STRBUF view = { NULL, 0, 0 };
+    failed = failed ||
+      mu_union_view_sql(&view, conf->otablename, partv, partc, q->reducesql) ||
+      ((view.s) && mu_sqlite3_exec(db, view.s));
+    if ((!failed) && (partc))
+      stopped = mu_sqlite3_exec_rows(db, q->reducesql, cb, ctx);
+    free(view.s);
+    if ((failed) || (-1==stopped))
+      MU_WARN("%s\n", errormsg_on_finish_reduce);
+    failed = failed || (-1==stopped);
+  }
+  sqlite3_close(db);
+  for(i=0;i<started;++i){
+    free(call[i].mapdb);
+    free(call[i].errs);
+  }
+  free(list);
+  return (failed)? -1: stopped;
+}
+
+struct mu_DBCONF * mu_open_agents(const char *agents){
+  if ((NULL==agents) || (0==*agents)){
+    MU_WARN("%s\n", "Fatal: mu_open_agents received no agent addresses");
+    return NULL;
+  }
+  struct mu_DBCONF *c = calloc(1, sizeof(struct mu_DBCONF));
+  if (NULL==c){
+    MU_WARN_OOM();
+    return NULL;
+  }
+  c->otablename = "maptable";
+  c->ncores = 1;
+  c->engine = MU_ENGINE_THREADS;
+  c->agents = agents;
+  c->isopen = 1;
+  return c;
 }
@@ -16,6 +16,14 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <time.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
 
 struct mu_SQLITE3_TASK {
   pid_t pid;
@@ -28,6 +36,7 @@ struct mu_SQLITE3_TASK {
   const char *ename;
   const char *pname;
   const char *dbname;
+  int reaped;
 };
 
 const char *mu_error_string();
@@ -39,6 +48,49 @@ int mu_create_shards_from_sqlite_table(const char *dbname, const char *tablename
 
 int mu_create_shards_from_csv(const char *csvname, int skip, const char *schemaname, const char *tablename, const char *dbDir, int shardc);
 
+/** adds the rows of table tablename in sqlite3 database dbname to the shards in dbdir named by their shardid column, in one pass on all cores.
+ * Shards that do not exist yet, or lack the table, are created.  returns 0 on success */
+int mu_append_shards_from_sqlite_table(const char *dbname, const char *tablename, const char *dbdir);
+
+/** adds the rows of csvname to table tablename in the existing shards of dbDir, on all cores with one transaction per shard.
+ * A table partitioned by key keeps its partitioning.  Otherwise the rows are dealt at random to the shardc smallest shards
+ * smaller than maxbytes, or any size when maxbytes is 0, and to new shards when there are fewer than shardc of those.
+ * The schema must be one mu_create_shards_from_csv() imports without the sqlite3 shell.  returns 0 on success */
+int mu_append_shards_from_csv(const char *csvname, int skip, const char *schemaname, const char *tablename, const char *dbDir, int shardc, long long maxbytes);
+
+/** records in the catalog of dbdir the min, max and null count in every shard of each column of tablename in cols, a comma separated list.
+ * mu_run_query() then skips shards that can not match simple where terms on those columns, such as "col >= 1000 and col < 2000". returns 0 on success */
+int mu_index_shards(const char *dbdir, const char *tablename, const char *cols);
+
+/** lists the shards of dbdir, with the size, row count, schema hash and modification time of each, in the file .multicoresql.manifest
+ * in dbdir.  mu_opendb() then reads that one file instead of listing the directory.  The shard builders call this when they finish,
+ * so it is only needed after adding, removing or changing shard files by other means.  returns 0 on success */
+int mu_write_manifest(const char *dbdir);
+
+/** like mu_create_shards_from_csv(), but each row goes to the shard given by a hash of its keycols, a comma separated list of column names.
+ * The key is recorded in the catalog file .multicoresql.catalog in dbDir, so queries can skip shards and group by the key on the shards */
+int mu_create_partitioned_shards_from_csv(const char *csvname, int skip, const char *schemaname, const char *tablename, const char *dbDir, int shardc, const char *keycols);
+
+/** execution backends for mu_run_query(), selected by mu_DBCONF.engine */
+#define MU_ENGINE_PROCESS 0 /**< fork one sqlite3 shell process per core, driven by generated command files */
+#define MU_ENGINE_THREADS 1 /**< run the map on a pool of threads inside this process, one libsqlite3 connection each */
+
+/** priority classes for sharing the host's MULTICORE_CORE_BUDGET between queries, selected by mu_DBCONF.priority */
+#define MU_PRIORITY_NORMAL 0 /**< take any free map slot */
+#define MU_PRIORITY_LOW 1 /**< take a map slot only while a quarter of the budget stays free for normal queries */
+
+struct mu_WARM;
+struct mu_PARTITION;
+struct mu_ZONEMAP;
+
+/** what the shard manifest records about each shard */
+struct mu_SHARDINFO {
+  long long bytes; /**< size of the shard file */
+  long long rows; /**< rows in all tables of the shard */
+  unsigned long long schemahash; /**< hash of the shard's schema, equal for shards holding the same tables */
+  long long mtime; /**< modification time of the shard file, in nanoseconds since the epoch */
+};
+
 /** Database conf 
 
  */
@@ -50,6 +102,17 @@ struct mu_DBCONF {
   int ncores; /**< number of simultaneous processes to run for queries */
   size_t shardc; /**< count of sqlite3 database shard files */
   const char **shardv; /**< file names of sqlite3 database shards  */
+  int engine; /**< MU_ENGINE_PROCESS or MU_ENGINE_THREADS.  Initially MU_ENGINE_THREADS if environment variable MULTICORE_ENGINE=threads */
+  struct mu_WARM *warm; /**< thread pool and open shard connections kept between queries, set by mu_warm_db() */
+  struct mu_PARTITION *partition; /**< hash partitioned tables, read from the shard directory's catalog by mu_opendb() */
+  struct mu_ZONEMAP *zonemap; /**< per shard min and max of indexed columns, read from the catalog by mu_opendb() */
+  struct mu_SHARDINFO *shardinfo; /**< one per shard of shardv, read from the manifest by mu_opendb(), or NULL when the directory has none */
+  const char *cachedir; /**< directory keeping each shard's map results between queries, reused while the shard is unchanged, or NULL for no cache.  Initially environment variable MULTICORE_CACHE.  Cached queries run on MU_ENGINE_THREADS, so mapsql must give the same rows each time it runs on an unchanged shard */
+  long long cachebytes; /**< after each cached query, the databases in cachedir used longest ago are removed until the rest take at most cachebytes, or 0 for no limit.  Initially environment variable MULTICORE_CACHE_MB in megabytes, or 1024 */
+  long long spillbytes; /**< when above 0, each core keeps its map results in memory and writes them to a temp file only once they grow past spillbytes.  0 writes them to temp files from the start.  Initially environment variable MULTICORE_SPILL_MB in megabytes.  Set, queries run on MU_ENGINE_THREADS */
+  const char *agents; /**< comma separated host:port addresses of mu_serve_agent() servers, each owning its own shards, or NULL.  When set, mu_run_query() sends the map to every agent instead of running it on shardv, and runs only the reduce here.  Initially environment variable MULTICORE_AGENTS */
+  int priority; /**< MU_PRIORITY_NORMAL or MU_PRIORITY_LOW, used when environment variable MULTICORE_CORE_BUDGET limits the map slots shared by all queries on this host.  Initially MU_PRIORITY_LOW if environment variable MULTICORE_PRIORITY=low */
+  int readonly; /**< when 1, shards are opened read only.  Initially 0, set by mu_serve_agent() */
 };
 
 /** open database directory */
@@ -57,18 +120,112 @@ struct mu_DBCONF * mu_opendb(
 	      const char *dbdir     /**< [in] /path/to/directory of sqlite3 shards */
 	      );
 
+/** starts a pool of conf->ncores threads and opens every shard, keeping both for the life of the process
+ * so later MU_ENGINE_THREADS queries skip thread startup, opening shards and reading their schema. returns 0 on success */
+int mu_warm_db(struct mu_DBCONF *conf);
+
 struct mu_QUERY {
   const char *mapsql; /**< REQUIRED sqlite command(s)/statement(s) to map over shards */
-  const char *createtablesql; /**< OPTIONAL sqlite CREATE TABLE statement to create the table format used to hold collected mapsql results.  You should name this table "maptable". i.e. "create table maptable ( blah, blah, blah );"  */
-  const char *reducesql; /**< OPTIONAL sqlite statements to apply against the results collected in maptable from running the mapsql statement in all shards.  Necessary for reducing the collected mapsql results down to a final answer.  */
+  const char *createtablesql; /**< OPTIONAL sqlite CREATE TABLE statement to create the table format used to hold collected mapsql results.  You should name this table "maptable". i.e. "create table maptable ( blah, blah, blah );"  Runs on each core's result database before any shard is mapped; without it maptable is created from the first shard's results. */
+  const char *reducesql; /**< OPTIONAL sqlite statements to apply against the results collected in maptable from running the mapsql statement in all shards.  Necessary for reducing the collected mapsql results down to a final answer.  A reduce of only select statements reads maptable through a temp view over each core's results; any other reduce gets them copied into one maptable first.  */
+  const char *combinesql; /**< OPTIONAL sqlite statements run once on each core's maptable after its shards are mapped and before the reduce.  A select replaces that core's maptable with its result, e.g. "select k, sum(c) as c from maptable group by k;"  With a select, core results are merged in pairs before the reduce and it is run again on each merged pair, so it must be reapplicable to its own output */
+  double timeout; /**< OPTIONAL seconds the query may run, or 0 for no limit.  Past it the query fails, its sqlite3 processes are killed or its connections interrupted, and its temp files are removed */
+  int partial; /**< OPTIONAL with a timeout, instead of failing, stop mapping when the time is up and reduce the results of the shards mapped so far.  The reduce itself is not timed.  Runs on MU_ENGINE_THREADS */
+  volatile int cancelled; /**< set by mu_cancel() */
+  size_t nshards; /**< set by mu_run_query() to the number of shards the query had to map, after leaving out those that can not match */
+  size_t nmapped; /**< set by mu_run_query() to the number of shards whose map results reached the reduce, less than nshards only for a partial result */
 };
 
+/** stops q, running on another thread, as soon as possible.  Its sqlite3 processes are killed or its connections interrupted, its temp files removed,
+ * and its mu_run_query() fails.  q stays cancelled.  Safe to call from any thread, e.g. with mu_submit_query() */
+void mu_cancel(struct mu_QUERY *q);
+
 /** reads sql commands from strings or files and packs into a new query object */
 struct mu_QUERY  * mu_create_query(const char *mapsql_or_fname,
 				 const char *createtablesql_or_fname,
 				 const char *reducesql_or_fname);
 
+/** plans a single select, splitting its aggregates into a map query of partial aggregates per shard and a reduce query that merges them.
+ * Supports where, group by, having, order by, limit and the aggregates sum, count, avg, min, max and total. conf may be NULL.
+ * When conf says the table is hash partitioned on columns that are all grouped by, the whole select runs on the shards instead */
+struct mu_QUERY * mu_plan_query(struct mu_DBCONF *conf, const char *selectsql_or_fname);
+
+/** sets the optional per-core combine stage of a query from a sql string or file. returns 0 on success */
+int mu_query_set_combinesql(struct mu_QUERY *q, const char *combinesql_or_fname);
+
 /** run a map query, and optionally a reduce query against the shard collection in conf */
 char * mu_run_query(struct mu_DBCONF *conf, struct mu_QUERY *q);
 
+/** value types of a mu_COLUMN, numbered as sqlite3 numbers them */
+#define MU_INTEGER 1
+#define MU_FLOAT 2
+#define MU_TEXT 3
+#define MU_BLOB 4
+#define MU_NULL 5
+
+/** one value of a row of query output */
+struct mu_COLUMN {
+  const char *name; /**< column name */
+  int type; /**< MU_INTEGER, MU_FLOAT, MU_TEXT, MU_BLOB or MU_NULL */
+  long long i; /**< value of an MU_INTEGER */
+  double d; /**< value of an MU_FLOAT */
+  const char *s; /**< bytes of an MU_TEXT, nul terminated, or of an MU_BLOB.  Valid only until the callback returns */
+  size_t n; /**< length of s in bytes */
+};
+
+/** receives one row of query output, ncol values in colv.  A nonzero return stops the query */
+typedef int (*mu_ROW_CALLBACK)(void *ctx, int ncol, const struct mu_COLUMN *colv);
+
+struct mu_ASYNC;
+
+/** starts running a query like mu_run_query() on a new thread and returns at once with a handle for mu_poll(), mu_async_fd() and mu_wait(),
+ * or NULL on error.  conf and q must stay valid until mu_wait() returns.  Several queries may run at once on the same conf */
+struct mu_ASYNC * mu_submit_query(struct mu_DBCONF *conf, struct mu_QUERY *q);
+
+/** returns 1 if the submitted query is done, so mu_wait() will not block, or 0 if it is still running */
+int mu_poll(struct mu_ASYNC *a);
+
+/** returns a file descriptor that becomes readable when the submitted query is done, for poll(), select(), epoll or an event loop.
+ * It belongs to the handle and is closed by mu_wait() */
+int mu_async_fd(struct mu_ASYNC *a);
+
+/** waits for the submitted query to finish, frees the handle and returns the result as mu_run_query() would, adding the query's errors to mu_error_string() */
+char * mu_wait(struct mu_ASYNC *a);
+
+/** runs a query like mu_run_query(), passing each row of the reduce output to cb as it is produced instead of collecting a string.
+ * Runs on MU_ENGINE_THREADS whatever conf->engine says, so the queries can not use sqlite3 shell dot commands.
+ * returns 0 on success, -1 on error, or the nonzero value returned by cb to stop the query */
+int mu_run_query_cb(struct mu_DBCONF *conf, struct mu_QUERY *q, mu_ROW_CALLBACK cb, void *ctx);
+
+/** mu_ROW_CALLBACK writing each row to the FILE * file as the sqlite3 shell lists it, values separated by '|' */
+int mu_print_row(void *file, int ncol, const struct mu_COLUMN *colv);
+
+/** returns 1 when mu_run_query() would run q on MU_ENGINE_THREADS, so its output is the same as mu_run_query_cb() with mu_print_row() */
+int mu_query_uses_threads(struct mu_DBCONF *conf, const struct mu_QUERY *q);
+
+/** file formats of mu_export_query() */
+#define MU_EXPORT_CSV 0 /**< comma separated, quoted as RFC 4180 quotes fields */
+#define MU_EXPORT_TSV 1 /**< tab separated, with tab, newline, return and backslash in values written as \\t \\n \\r \\\\ */
+#define MU_EXPORT_BINARY 2 /**< rows of a uint32 column count, then each value as a type byte and an int64, a double, or a uint32 length and bytes, in native byte order */
+
+/** runs the select mapsql on every shard, each core writing its rows to its own file outdir/part-NNN.csv, .tsv or .rows in the given format,
+ * without a reduce.  outdir/manifest.txt then lists each part with its rows and bytes, after a comment line naming the format and columns.
+ * returns 0 on success */
+int mu_export_query(struct mu_DBCONF *conf, const char *mapsql, const char *outdir, int format);
+
+/** serves queries from clients of mu_remote_query() on a unix domain socket, one thread per client.  Only returns on error */
+int mu_serve(struct mu_DBCONF *conf, const char *socketname);
+
+/** runs a query on the mu_serve() server listening on socketname.  Returns the result like mu_run_query() */
+char * mu_remote_query(const char *socketname, struct mu_QUERY *q);
+
+/** serves, on the TCP address "host:port" or ":port" for localhost, only map requests, answered with the merged map results of conf's shards.
+ * Shards are opened read only.  Maps and combines other than select statements, and queries with sqlite3 shell dot commands, are refused.
+ * When environment variable MULTICORE_AGENT_TOKEN is set, requests without the same token are refused; it must be set to serve a host
+ * other than localhost.  Only returns on error */
+int mu_serve_agent(struct mu_DBCONF *conf, const char *address);
+
+/** returns a conf with no shards of its own whose queries run on the agents listed in agents, like conf->agents */
+struct mu_DBCONF * mu_open_agents(const char *agents);
+
 #endif /* LIBMULTICORESQL_H */
@@ -29,10 +29,22 @@ int main(int argc, char **argv){
   char *tablename = NULL;  /* -t */
   char *mapsql = NULL; /* -m */
   char *reducesql = NULL; /* -r */
+  char *combinesql = NULL; /* -k */
+  char *selectsql = NULL; /* -q */
+  char *socketname = NULL; /* -s */
   int verbose = 0; /* -v */
   int ncores = 0; /* -c */
+  char *engine = NULL; /* -e */
+  char *cachedir = NULL; /* -C */
+  double spillmb = -1; /* -M */
+  char *outdir = NULL; /* -o */
+  char *agents = NULL; /* -A */
+  int format = MU_EXPORT_CSV; /* -F */
+  char *priority = NULL; /* -P */
+  double timeout = 0; /* -T */
+  int partial = 0; /* -p */
 
-  const char *getopt_options = "c:d:t:m:r:v";
+  const char *getopt_options = "A:c:C:d:e:F:k:M:o:pP:q:s:t:T:m:r:v";
   int c;
 
   opterr = 1;
@@ -45,18 +57,64 @@ int main(int argc, char **argv){
 	if (ncores>0) break;
 	fprintf(stderr,"Option -c requires positive number, got %s \n", optarg);
 	return 1;
+      case 'C':
+	cachedir = optarg;
+	break;
+      case 'A':
+	agents = optarg;
+	break;
+      case 'o':
+	outdir = optarg;
+	break;
+      case 'F':
+	format = (0==strcmp(optarg,"csv"))? MU_EXPORT_CSV: (0==strcmp(optarg,"tsv"))? MU_EXPORT_TSV: (0==strcmp(optarg,"binary"))? MU_EXPORT_BINARY: -1;
+	if (format>=0) break;
+	fprintf(stderr,"Option -F requires csv, tsv or binary, got %s \n", optarg);
+	return 1;
+      case 'M':
+	spillmb = strtod(optarg,NULL);
+	if (spillmb>=0) break;
+	fprintf(stderr,"Option -M requires a number of megabytes, got %s \n", optarg);
+	return 1;
       case 'd':
 	dbname = optarg;
 	break;
+      case 'e':
+	engine = optarg;
+	if ((0==strcmp(engine,"threads")) || (0==strcmp(engine,"process"))) break;
+	fprintf(stderr,"Option -e requires threads or process, got %s \n", optarg);
+	return 1;
+      case 'P':
+	priority = optarg;
+	if ((0==strcmp(priority,"low")) || (0==strcmp(priority,"normal"))) break;
+	fprintf(stderr,"Option -P requires low or normal, got %s \n", optarg);
+	return 1;
       case 't':
 	tablename = optarg;
 	break;
+      case 'T':
+	timeout = strtod(optarg,NULL);
+	if (timeout>0) break;
+	fprintf(stderr,"Option -T requires a positive number of seconds, got %s \n", optarg);
+	return 1;
+      case 'p':
+	partial = 1;
+	break;
       case 'm':
 	mapsql = optarg;
 	break;
       case 'r':
 	reducesql = optarg;
 	break;
+      case 'k':
+	combinesql = optarg;
+	break;
+      case 'q':
+	selectsql = optarg;
+	break;
+      case 's':
+	socketname = optarg;
+	break;
       case 'v':
 	verbose = 1;
 	break;	
@@ -72,27 +130,89 @@ int main(int argc, char **argv){
 	abort();
       }
 
+  if ((selectsql) && ((mapsql) || (reducesql))){
+    fprintf(stderr,"%s\n","Option -q plans its own map and reduce queries and can not be used with -m or -r");
+    return 1;
+  }
+
+  if ((outdir) && ((NULL==mapsql) || (reducesql) || (selectsql) || (combinesql) || (socketname) || (agents))){
+    fprintf(stderr,"%s\n","Option -o exports the rows of the -m map query and can not be used with -r, -k, -q, -s or -A");
+    return 1;
+  }
+
+  if (socketname){
+    /* client of a running sqlsd server, which has the database open already */
+    struct mu_QUERY *q = (selectsql)? mu_plan_query(NULL, selectsql): mu_create_query(mapsql, NULL, reducesql);
+    if ((q) && (combinesql) && mu_query_set_combinesql(q, combinesql))
+      q = NULL;
+    char *qresult = (q)? mu_remote_query(socketname, q): NULL;
+    if (qresult)
+      fputs(qresult, stdout);
+    const char *qerror = mu_error_string();
+    if (qerror)
+      fputs(qerror, stderr);
+    return (qerror)? 1: 0;
+  }
+
   struct mu_DBCONF * conf = NULL;
 
-  if ( (conf = mu_opendb(dbname)) != NULL){
+  /* with -A and no -d, every shard is on the agents */
+  conf = ((agents) && (NULL==dbname))? mu_open_agents(agents): mu_opendb(dbname);
+  if (conf != NULL){
+    if (agents)
+      conf->agents = agents;
     if (ncores)
       conf->ncores = ncores;
+    if (engine)
+      conf->engine = (0==strcmp(engine,"threads"))? MU_ENGINE_THREADS: MU_ENGINE_PROCESS;
+    if (cachedir)
+      conf->cachedir = cachedir;
+    if (spillmb>=0)
+      conf->spillbytes = (long long) (1024.0*1024.0*spillmb);
+    if (priority)
+      conf->priority = (0==strcmp(priority,"low"))? MU_PRIORITY_LOW: MU_PRIORITY_NORMAL;
     if (verbose){
       fprintf(stdout,"sqls \n");
       fprintf(stdout,"number of cores (-c): %d\n",conf->ncores); 
+      fprintf(stdout,"engine          (-e): %s\n",(conf->engine==MU_ENGINE_THREADS)? "threads": "process");
       if (dbname) fprintf(stdout,"dbname              : %s \n",dbname);
       if (tablename) fprintf(stdout,"tablename           : %s \n",tablename);
-      if (mapsql) fprintf(stdout,"mapsql:\n%s\n",mapsql);
-      if (reducesql) fprintf(stdout,"reducesql:\n%s\n",reducesql);
     }
-    char *qresult =  mu_run_query(conf,
-				  mu_create_query(mapsql, NULL, reducesql)
-				  );
-    if (qresult)
-      fputs(qresult, stdout);
+    if (outdir){
+      /* -m may name a sql file */
+      struct mu_QUERY *q = mu_create_query(mapsql, NULL, NULL);
+      int status = (q)? mu_export_query(conf, q->mapsql, outdir, format): -1;
+      if (status)
+	fputs(mu_error_string(), stderr);
+      return (status)? 1: 0;
+    }
+    struct mu_QUERY *q = (selectsql)? mu_plan_query(conf, selectsql): mu_create_query(mapsql, NULL, reducesql);
+    if ((verbose) && (q)){
+      if (selectsql) fprintf(stdout,"selectsql:\n%s\n",selectsql);
+      fprintf(stdout,"mapsql:\n%s\n",q->mapsql);
+      if (q->createtablesql) fprintf(stdout,"createtablesql:\n%s\n",q->createtablesql);
+      if ((combinesql) || (q->combinesql)) fprintf(stdout,"combinesql:\n%s\n",(combinesql)? combinesql: q->combinesql);
+      if (q->reducesql) fprintf(stdout,"reducesql:\n%s\n",q->reducesql);
+    }
+    if ((q) && (combinesql) && mu_query_set_combinesql(q, combinesql))
+      q = NULL;
+    if (q){
+      q->timeout = timeout;
+      q->partial = partial;
+    }
+    /* rows from the in-process engine are written as they come */
+    if ((q) && mu_query_uses_threads(conf, q))
+      mu_run_query_cb(conf, q, mu_print_row, stdout);
+    else {
+      char *qresult =  mu_run_query(conf, q);
+      if (qresult)
+	fputs(qresult, stdout);
+    }
     const char *qerror = mu_error_string();
     if (qerror)
       fputs(qerror, stderr);
+    else if ((q) && (q->nmapped<q->nshards))
+      fprintf(stderr, "partial result from %zu of %zu shards\n", q->nmapped, q->nshards);
   } else {
     fprintf(stderr, "error opening database %s \n",dbname);
   }
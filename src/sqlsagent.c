@@ -0,0 +1,96 @@
+/* sqlsagent.c 
+   Copyright 2015 Paul Brewer <drpaulbrewer@eaftc.com> Economic and Financial Technology Consulting LLC
+   License:  MIT
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+ documentation files (the "Software"), to deal in the Software without restriction, including without limitation 
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and 
+to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO 
+THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS 
+OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "multicoresql.h"
+
+int main(int argc, char **argv){
+  char *dbname = NULL;  /* -d */
+  char *address = NULL; /* -l */
+  int ncores = 0; /* -c */
+
+  const char *getopt_options = "c:d:l:";
+  int c;
+
+  opterr = 1;
+
+  while ((c = getopt(argc, argv, getopt_options)) != -1)
+    switch(c)
+      {
+      case 'c':
+	ncores = (int) strtol(optarg,NULL,10);
+	if (ncores>0) break;
+	fprintf(stderr,"Option -c requires positive number, got %s \n", optarg);
+	return 1;
+      case 'd':
+	dbname = optarg;
+	break;
+      case 'l':
+	address = optarg;
+	break;
+      case '?':
+	if (strchr(getopt_options,c))
+	  fprintf(stderr,"Option -%c missing valid setting\n", optopt);
+	else if (isprint(optopt))
+	  fprintf(stderr,"Unknown option -%c \n",optopt);
+	else
+	  fprintf(stderr, "Unknown option character");
+	return 1;
+      default:
+	abort();
+      }
+
+  if ((NULL==dbname) || (NULL==address)){
+    fprintf(stderr,"%s\n%s\n",
+	    "usage: sqlsagent -d dbdir -l [host]:port [-c cores]",
+	    "Then run queries on all agents with: sqls -A host1:port,host2:port -m mapsql -r reducesql");
+    return 1;
+  }
+
+  struct mu_DBCONF * conf = mu_opendb(dbname);
+  if (NULL==conf){
+    fprintf(stderr, "error opening database %s \n",dbname);
+    const char *err = mu_error_string();
+    if (err)
+      fputs(err, stderr);
+    return 1;
+  }
+  if (ncores)
+    conf->ncores = ncores;
+  conf->engine = MU_ENGINE_THREADS;
+  /* as mu_serve_agent() would, so the warm connections are read only too */
+  conf->readonly = 1;
+  if (mu_warm_db(conf)){
+    fputs(mu_error_string(), stderr);
+    return 1;
+  }
+  /* an agent runs its own shards, it does not pass queries on to other agents */
+  conf->agents = NULL;
+  fprintf(stderr,"sqlsagent: serving %s with %d threads on %s\n", dbname, conf->ncores, address);
+  mu_serve_agent(conf, address);
+  const char *err = mu_error_string();
+  if (err)
+    fputs(err, stderr);
+  return 1;
+}
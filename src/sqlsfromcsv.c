@@ -30,11 +30,43 @@ long int get_long_int_or_die(const char *instring, const char *errfmt){
 }
 
 int main(int argc, char **argv){
+  const char *keycols = NULL;
+  const char *zonecols = NULL;
+  int append = 0;
+  long long maxbytes = 0;
+  while (argc>1){
+    if (0==strcmp(argv[1],"--append")){
+      append = 1;
+      argc -= 1;
+      argv += 1;
+      continue;
+    }
+    if (argc<3)
+      break;
+    if (0==strcmp(argv[1],"--partition-by"))
+      keycols = argv[2];
+    else if (0==strcmp(argv[1],"--zonemap"))
+      zonecols = argv[2];
+    else if (0==strcmp(argv[1],"--max-shard-mb"))
+      maxbytes = 1024*1024*get_long_int_or_die(argv[2], "sqlsfromcsv: option --max-shard-mb, expected a number of megabytes, got: %s \n");
+    else
+      break;
+    argc -= 2;
+    argv += 2;
+  }
+  if ((append) && (keycols)){
+    fprintf(stderr,"%s\n","sqlsfromcsv: --append keeps the partitioning of the existing shards and can not be used with --partition-by");
+    exit(EXIT_FAILURE);
+  }
   if (argc!=7){
     fprintf(stderr,
-	    "%s\n%s\n",
-	    "Usage: sqlsfromcsv csvfile skiplines schemafile tablename dbDir shardcount",
-	    "Example: sqlsfromcsv example.csv 1 createmytable.sql mytable ./mytable 100");
+	    "%s\n%s\n%s\n%s\n%s\n%s\n",
+	    "Usage: sqlsfromcsv [--partition-by col1,col2] [--zonemap col1,col2] csvfile skiplines schemafile tablename dbDir shardcount",
+	    "       sqlsfromcsv --append [--max-shard-mb megabytes] [--zonemap col1,col2] csvfile skiplines schemafile tablename dbDir shardcount",
+	    "Example: sqlsfromcsv example.csv 1 createmytable.sql mytable ./mytable 100",
+	    "Example: sqlsfromcsv --partition-by customer example.csv 1 createmytable.sql mytable ./mytable 100",
+	    "Example: sqlsfromcsv --zonemap date,price example.csv 1 createmytable.sql mytable ./mytable 100",
+	    "Example: sqlsfromcsv --append --max-shard-mb 512 lasthour.csv 1 createmytable.sql mytable ./mytable 100");
     exit(EXIT_FAILURE);
   }
   int skiplines = 0;
@@ -55,7 +87,11 @@ int main(int argc, char **argv){
   if (shardcount<3)
     shardcount=3;
   
-  int status = mu_create_shards_from_csv(csvname,skiplines,schemaname,tablename,dbDir,shardcount);
+  int status = (append)?
+    mu_append_shards_from_csv(csvname,skiplines,schemaname,tablename,dbDir,shardcount,maxbytes):
+    mu_create_partitioned_shards_from_csv(csvname,skiplines,schemaname,tablename,dbDir,shardcount,keycols);
+  if ((0==status) && (zonecols))
+    status = mu_index_shards(dbDir,tablename,zonecols);
   const char *err = mu_error_string();
   if (err)
     fputs(err,stderr);
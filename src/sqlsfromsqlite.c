@@ -19,12 +19,30 @@ OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHE
 #include "multicoresql.h"
 
 int main(int argc, char **argv){
+  const char *zonecols = NULL;
+  int append = 0;
+  while (argc>1){
+    if (0==strcmp(argv[1],"--append")){
+      append = 1;
+      argc -= 1;
+      argv += 1;
+    } else if ((argc>2) && (0==strcmp(argv[1],"--zonemap"))){
+      zonecols = argv[2];
+      argc -= 2;
+      argv += 2;
+    } else
+      break;
+  }
   if (argc<4){
-    fprintf(stderr,"%s\n","usage: sqlsfromsqlite <dbname> <tablename> <dbdir> \n");
+    fprintf(stderr,"%s\n","usage: sqlsfromsqlite [--append] [--zonemap col1,col2] <dbname> <tablename> <dbdir> \n");
     exit(EXIT_FAILURE);
   }
 
-  int status =  mu_create_shards_from_sqlite_table(argv[1], argv[2], argv[3]);
+  int status = (append)?
+    mu_append_shards_from_sqlite_table(argv[1], argv[2], argv[3]):
+    mu_create_shards_from_sqlite_table(argv[1], argv[2], argv[3]);
+  if ((0==status) && (zonecols))
+    status = mu_index_shards(argv[3], argv[2], zonecols);
   const char *err = mu_error_string();
   if (err)
     fputs(err,stderr);
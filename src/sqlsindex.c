@@ -0,0 +1,37 @@
+/* sqlsindex.c
+   Copyright 2015 Paul Brewer <drpaulbrewer@eaftc.com> Economic and Financial Technology Consulting LLC
+   License:  MIT
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+ documentation files (the "Software"), to deal in the Software without restriction, including without limitation 
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and 
+to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO 
+THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS 
+OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+
+
+#include "multicoresql.h"
+
+int main(int argc, char **argv){
+  if ((argc!=2) && (argc!=4)){
+    fprintf(stderr,"%s\n%s\n%s\n%s\n",
+	    "usage: sqlsindex <dbdir> <tablename> <col1,col2>",
+	    "records the min, max and null count of each column in every shard, so queries can skip shards",
+	    "usage: sqlsindex <dbdir>",
+	    "rewrites the shard manifest after shard files were added, removed or changed by hand");
+    exit(EXIT_FAILURE);
+  }
+
+  int status = (2==argc)? mu_write_manifest(argv[1]): mu_index_shards(argv[1], argv[2], argv[3]);
+  const char *err = mu_error_string();
+  if (err)
+    fputs(err,stderr);
+  return status;
+}
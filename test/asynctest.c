@@ -0,0 +1,71 @@
+#include "multicoresql.h"
+#include <poll.h>
+#include <sys/time.h>
+
+/* usage: asynctest dbdir engine
+ * runs queries on the mega table through mu_submit_query() and prints one line per check:
+ *   wait <result>                         mu_submit_query() then mu_wait()
+ *   poll <result> <polls> <fd readable>  mu_poll() until done, then mu_wait()
+ *   cancel <in flight> <result> <error> <seconds>  mu_cancel() of a slow query still running
+ */
+
+static const char *mapsql = "select count(*) as c from mega;";
+static const char *reducesql = "select sum(c) from maptable;";
+static const char *slowsql = "select count(*) as c from mega a, mega b where a.n%7=b.n%5;";
+
+static double now(void){
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec+1e-6*tv.tv_usec;
+}
+
+static const char *chomp(char *s){
+  size_t n = (s)? strlen(s): 0;
+  while ((n>0) && ('\n'==s[n-1]))
+    s[--n] = 0;
+  return (s)? s: "NULL";
+}
+
+int main(int argc, char **argv){
+  if (argc<3){
+    fprintf(stderr,"%s\n","usage: asynctest dbdir engine, engine threads or process");
+    exit(EXIT_FAILURE);
+  }
+  struct mu_DBCONF *conf = mu_opendb(argv[1]);
+  if (NULL==conf){
+    fputs(mu_error_string(), stderr);
+    exit(EXIT_FAILURE);
+  }
+  conf->engine = (0==strcmp(argv[2],"process"))? MU_ENGINE_PROCESS: MU_ENGINE_THREADS;
+
+  struct mu_QUERY *q = mu_create_query(mapsql, NULL, reducesql);
+  struct mu_ASYNC *a = mu_submit_query(conf, q);
+  char *result = mu_wait(a);
+  printf("wait %s\n", chomp(result));
+  free(result);
+
+  q = mu_create_query(mapsql, NULL, reducesql);
+  a = mu_submit_query(conf, q);
+  long polls = 0;
+  while ((a) && (0==mu_poll(a))){
+    ++polls;
+    usleep(1000);
+  }
+  struct pollfd pfd = { mu_async_fd(a), POLLIN, 0 };
+  int readable = (1==poll(&pfd, 1, 0)) && (pfd.revents & POLLIN);
+  result = mu_wait(a);
+  printf("poll %s %ld %d\n", chomp(result), polls, readable);
+  free(result);
+
+  mu_error_clear();
+  q = mu_create_query(slowsql, NULL, reducesql);
+  a = mu_submit_query(conf, q);
+  usleep(300000);
+  int inflight = (a) && (0==mu_poll(a));
+  double t0 = now();
+  mu_cancel(q);
+  result = mu_wait(a);
+  printf("cancel %d %s %d %.1f\n", inflight, chomp(result), NULL!=mu_error_string(), now()-t0);
+  free(result);
+  exit(EXIT_SUCCESS);
+}
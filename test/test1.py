@@ -11,29 +11,43 @@ if not re.search(r'/(test)$', os.getcwd()):
 os.system("rm -rf ./mega")
 os.system("rm -rf ./megadata.csv");
 os.system("./numbers 1 1000000 > ./megadata.csv");
-os.putenv('LD_LIBRARY_PATH','../build')
+os.environ['LD_LIBRARY_PATH'] = '../build'
 
-def runsqls(mybin, db, mapsql, reducesql):
-    return subprocess.check_output([mybin, "-d", db, "-m", mapsql, "-r", reducesql])
+def runsqls(mybin, db, mapsql, reducesql, opts=[]):
+    args = [mybin, "-d", db]
+    if mapsql:
+        args += ["-m", mapsql]
+    if reducesql:
+        args += ["-r", reducesql]
+    return subprocess.check_output(args+opts)
 
-def test(mybin, db, mapsql, reducesql, expected, tol):
+failures = []
+
+def report(mybin, db, mapsql, reducesql, options, expected, got, ok):
     print "Test:"
     print "  bin            "+mybin
     print "  db        (-d) "+db
-    print "  mapsql    (-m) "+mapsql
-    print "  reducesql (-r) "+reducesql
-    got = runsqls(mybin,db,mapsql,reducesql).rstrip()
-    print "  expect         "+str(expected)+" +/- "+str(tol)
+    if mapsql:
+        print "  mapsql    (-m) "+mapsql
+    if reducesql:
+        print "  reducesql (-r) "+reducesql
+    if options:
+        print "  options        "+options
+    print "  expect         "+expected
     print "  got            "+got
-    gotr = float(got)
-    if (abs(gotr-float(expected))<float(tol)):
+    if ok:
         print "  result         "+"PASS"
     else:
         print "  result         "+"FAIL"
+        failures.append(expected)
     print " "
     print "-------------------------------------------------"
     print " "
-    
+
+def test(mybin, db, mapsql, reducesql, expected, tol, opts=[]):
+    got = runsqls(mybin,db,mapsql,reducesql,opts).rstrip()
+    ok = abs(float(got)-float(expected))<float(tol)
+    report(mybin, db, mapsql, reducesql, " ".join(opts), str(expected)+" +/- "+str(tol), got, ok)
 
 setupsqls = "../build/sqlsfromcsv megadata.csv 0 megadata.sql mega ./mega 20"
 print "setting up ./mega test databases with :"
@@ -42,6 +56,38 @@ if os.system(setupsqls):
     print "sqlsfromcsv failed! failed to setup ./test/mega database directory. "
     exit()
 
+os.system("rm -rf ./megap")
+if os.system("../build/sqlsfromcsv --partition-by n megadata.csv 0 megadata.sql mega ./megap 20"):
+    print "sqlsfromcsv failed! failed to setup ./test/megap database directory. "
+    exit()
+
+os.system("rm -rf ./megaz")
+if os.system("../build/sqlsfromcsv --zonemap n megadata.csv 0 megadata.sql mega ./megaz 20"):
+    print "sqlsfromcsv failed! failed to setup ./test/megaz database directory. "
+    exit()
+
+os.system("rm -rf ./megaa")
+if os.system("../build/sqlsfromcsv --partition-by n megadata.csv 0 megadata.sql mega ./megaa 20") or os.system("../build/sqlsfromcsv --append megadata.csv 0 megadata.sql mega ./megaa 20"):
+    print "sqlsfromcsv failed! failed to setup ./test/megaa database directory. "
+    exit()
+
+os.system("rm -rf ./megas ./megas.db")
+os.system("sqlite3 ./megas.db \"create table mega as with recursive c(n) as (select 1 union all select n+1 from c where n<1000000) select n, printf('s%02d', n%12) as shardid from c;\"")
+if os.system("../build/sqlsfromsqlite ./megas.db mega ./megas"):
+    print "sqlsfromsqlite failed! failed to setup ./test/megas database directory. "
+    exit()
+
+os.system("rm -rf ./quoted")
+with open("./quoted.csv","w") as f:
+    f.write("id,name,val\r\n")
+    for i in range(1,10001):
+        f.write('%d,"name %d, ""quoted""\nline two",%d\r\n' % (i,i,i))
+with open("./quoted.sql","w") as f:
+    f.write(".mode csv\ncreate table quoted (id int, name text, val int);\n")
+if os.system("../build/sqlsfromcsv quoted.csv 1 quoted.sql quoted ./quoted 5"):
+    print "sqlsfromcsv failed! failed to setup ./test/quoted database directory. "
+    exit()
+
 def suite(mybin,db):
     m0 = "select n from mega where n>=1000 and n<=2000;"
     r0 = "select sum(n) from maptable;"
@@ -74,8 +120,363 @@ def suite(mybin,db):
     test(mybin,db,m4,r4,e4,t4)
     
 
-suite("../build/sqls", "./mega")
-suite("../build/3sqls", "./mega")
+def suite_sqls(mybin,db):
+    for engine in ["process", "threads"]:
+        m5 = "select n%100 as g, count(*) as k from mega group by g;"
+        k5 = "select g, sum(k) as k from maptable group by g;"
+        r5 = "select sum(k*g) from maptable;"
+        e5 = 10000*(99*100/2)
+        t5 = 1
+        test(mybin,db,m5,r5,e5,t5,["-e",engine,"-k",k5])
+
+        q6 = "select avg(n) from mega where n>=1000 and n<=2000;"
+        e6 = 1500
+        t6 = 0.00001
+        test(mybin,db,None,None,e6,t6,["-e",engine,"-q",q6])
+
+        q7 = "select count(*) from mega group by n%10 order by 1 desc limit 1;"
+        e7 = 100000
+        t7 = 0.5
+        test(mybin,db,None,None,e7,t7,["-e",engine,"-q",q7])
+
+        # ordered by a column the select list leaves out, which the map computes for the reduce
+        q7b = "select n%7 as m from mega where n<20 order by n desc limit 1;"
+        e7b = 5
+        t7b = 0.5
+        test(mybin,db,None,None,e7b,t7b,["-e",engine,"-q",q7b])
+
+        # a reduce that modifies maptable gets a table, not a view of the cores' results
+        m7c = "select n%100 as g, count(*) as k from mega group by g;"
+        r7c = "delete from maptable where g<50; select sum(k) from maptable;"
+        e7c = 500000
+        t7c = 0.5
+        test(mybin,db,m7c,r7c,e7c,t7c,["-e",engine,"-c","4"])
+
+def suite_partition(mybin,db):
+    for engine in ["process", "threads"]:
+        q9 = "select sum(n) from mega where n = 777;"
+        e9 = 777
+        t9 = 0.5
+        test(mybin,db,None,None,e9,t9,["-e",engine,"-q",q9])
+
+        q10 = "select n from mega group by n having count(*)=1 order by n desc limit 1;"
+        e10 = 1000000
+        t10 = 0.5
+        test(mybin,db,None,None,e10,t10,["-e",engine,"-q",q10])
+
+def suite_zonemap(mybin,db):
+    for engine in ["process", "threads"]:
+        q11 = "select sum(n) from mega where n >= 1000 and n <= 2000;"
+        e11 = 1501500
+        t11 = 0.5
+        test(mybin,db,None,None,e11,t11,["-e",engine,"-q",q11])
+
+        q12 = "select count(*) from mega where n between 999990 and 2000000;"
+        e12 = 11
+        t12 = 0.5
+        test(mybin,db,None,None,e12,t12,["-e",engine,"-q",q12])
+
+def suite_cache(mybin,db):
+    os.system("rm -rf ./megacache")
+    # the second run reads every shard's map result from the cache
+    for run in ["miss", "hit"]:
+        m13 = "select sum(n) as s from mega where n%7=3;"
+        r13 = "select sum(s) from maptable;"
+        e13 = sum(range(3,1000001,7))
+        t13 = 0.5
+        test(mybin,db,m13,r13,e13,t13,["-C","./megacache"])
+
+    # a 64KB cap keeps the results of the last few shards mapped, and removes the rest
+    os.environ["MULTICORE_CACHE_MB"] = "0.0625"
+    m30 = "select sum(n) as s from mega where n%7=4;"
+    got = runsqls(mybin,db,m30,r13,["-C","./megacache"]).rstrip()
+    del os.environ["MULTICORE_CACHE_MB"]
+    kept = sum(os.path.getsize("./megacache/"+f) for f in os.listdir("./megacache") if f.endswith(".db"))
+    e30 = sum(range(4,1000001,7))
+    report(mybin, db, m30, r13, "-C ./megacache with MULTICORE_CACHE_MB=0.0625", str(e30)+" with at most 65536 bytes kept",
+           got+" with "+str(kept)+" bytes kept", (got == str(e30)) and (0 < kept <= 65536))
 
+def suite_memory(mybin,db):
+    # 64MB holds every core's results in memory, 0.01MB spills them after the first shard
+    for spill in ["64", "0.01"]:
+        m16 = "select n%100 as g, count(*) as k from mega group by g;"
+        r16 = "select sum(k*g) from maptable;"
+        e16 = 10000*(99*100/2)
+        t16 = 1
+        test(mybin,db,m16,r16,e16,t16,["-M",spill])
 
+def suite_append(mybin,db):
+    # megadata.csv imported once and appended once, keeping the partitioning by n
+    for engine in ["process", "threads"]:
+        q14 = "select count(*) from mega where n = 777;"
+        e14 = 2
+        t14 = 0.5
+        test(mybin,db,None,None,e14,t14,["-e",engine,"-q",q14])
+
+        q15 = "select sum(n) from mega;"
+        e15 = 1000000*1000001
+        t15 = 0.5
+        test(mybin,db,None,None,e15,t15,["-e",engine,"-q",q15])
+
+def suite_export(mybin,db):
+    # each core writes its own part, the manifest counts the rows of every part
+    os.system("rm -rf ./megaexport")
+    m17 = "select n, 'n,'||n as s from mega where n%3=0;"
+    e17 = sum(range(3,1000001,3))
+    subprocess.check_output([mybin, "-d", db, "-c", "4", "-m", m17, "-o", "./megaexport", "-F", "csv"])
+    got = 0
+    rows = 0
+    for line in open("./megaexport/manifest.txt"):
+        if not line.startswith("#"):
+            part = line.split("\t")
+            rows += int(part[1])
+            for row in open("./megaexport/"+part[0]):
+                n, s = row.rstrip("\n").split(",", 1)
+                if s == '"n,'+n+'"':
+                    got += int(n)
+    report(mybin, db, m17, None, "-c 4 -o ./megaexport -F csv", str(e17)+" in 333333 rows",
+           str(got)+" in "+str(rows)+" rows", (got == e17) and (rows == 333333))
+
+def suite_agents(mybin,db):
+    # two agents on localhost, each owning half of the shards of db; with -A the -d shards are not read
+    os.system("rm -rf ./megaag0 ./megaag1 && mkdir ./megaag0 ./megaag1")
+    for i in range(20):
+        os.system("cp %s/%03d ./megaag%d/" % (db, i, i%2))
+    agents = [subprocess.Popen(["../build/sqlsagent", "-d", "./megaag%d" % i, "-l", "127.0.0.1:%d" % (17630+i), "-c", "2"]) for i in range(2)]
+    import time
+    time.sleep(1)
+    try:
+        q18 = "select sum(n) from mega where n%7=3;"
+        e18 = sum(range(3,1000001,7))
+        t18 = 0.5
+        test(mybin,"./megaag0",None,None,e18,t18,["-A","127.0.0.1:17630,127.0.0.1:17631","-q",q18])
+
+        m19 = "select n%100 as g, count(*) as k from mega group by g;"
+        r19 = "select sum(k*g) from maptable;"
+        e19 = 10000*(99*100/2)
+        t19 = 1
+        test(mybin,"./megaag0",m19,r19,e19,t19,["-A","127.0.0.1:17630,127.0.0.1:17631"])
+
+        # a map request that would write to the shards is refused, and the shards are unchanged
+        import socket
+        m30 = "drop table mega;"
+        peer = socket.create_connection(("127.0.0.1", 17630))
+        peer.sendall("mapsql %d\n%s\nmap 0\n\n" % (len(m30), m30))
+        peer.shutdown(socket.SHUT_WR)
+        reply = ""
+        while True:
+            got = peer.recv(65536)
+            if not got:
+                break
+            reply += got
+        peer.close()
+        left = subprocess.Popen(["sqlite3", "./megaag0/000", "select count(*) from mega;"], stdout=subprocess.PIPE).communicate()[0].strip()
+        report(mybin, "./megaag0", m30, None, "raw map request to 127.0.0.1:17630", "error and table mega left",
+               reply.replace("\n", " ")[:120]+" rows left: "+left, reply.startswith("error ") and left.isdigit() and int(left) > 0)
+    finally:
+        for a in agents:
+            a.terminate()
+            a.wait()
+
+    # with MULTICORE_AGENT_TOKEN, an agent only answers requests carrying the same token
+    env = dict(os.environ, MULTICORE_AGENT_TOKEN="s3cret")
+    agent = subprocess.Popen(["../build/sqlsagent", "-d", "./megaag1", "-l", "127.0.0.1:17632", "-c", "2"], env=env)
+    time.sleep(1)
+    try:
+        q31 = "select count(*) from mega;"
+        e31 = sum([int(subprocess.Popen(["sqlite3", "./megaag1/%03d" % i, q31], stdout=subprocess.PIPE).communicate()[0]) for i in range(1,20,2)])
+        for token, expected in [("s3cret", str(e31)), ("guess", ""), (None, "")]:
+            runenv = dict(os.environ)
+            runenv.pop("MULTICORE_AGENT_TOKEN", None)
+            if token:
+                runenv["MULTICORE_AGENT_TOKEN"] = token
+            run = subprocess.Popen([mybin, "-A", "127.0.0.1:17632", "-q", q31], stdout=subprocess.PIPE, stderr=subprocess.PIPE, env=runenv)
+            out, err = run.communicate()
+            report(mybin, "./megaag1", q31, None, "MULTICORE_AGENT_TOKEN=%s -A 127.0.0.1:17632" % token, expected or "refused",
+                   out.strip() or err.strip()[:120], (out.strip() == expected) and ((expected != "") or ("MULTICORE_AGENT_TOKEN" in err)))
+    finally:
+        agent.terminate()
+        agent.wait()
+
+    # without a token, an agent will not listen on other interfaces
+    run = subprocess.Popen(["../build/sqlsagent", "-d", "./megaag1", "-l", "0.0.0.0:17633"], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    out, err = run.communicate()
+    report(mybin, "./megaag1", None, None, "sqlsagent -l 0.0.0.0:17633", "refused without MULTICORE_AGENT_TOKEN",
+           err.strip()[:120], (run.returncode != 0) and ("MULTICORE_AGENT_TOKEN" in err))
+
+def suite_sqlsd(mybin,db):
+    # sqlsd answers queries on a unix socket, and refuses sqlite3 shell dot commands
+    sock = "./megasqlsd.sock"
+    os.system("rm -f "+sock+" ./megasqlsd.dot")
+    server = subprocess.Popen(["../build/sqlsd", "-d", db, "-s", sock, "-c", "2"])
+    import time
+    time.sleep(1)
+    try:
+        m28 = "select sum(n) as s from mega;"
+        r28 = "select sum(s) from maptable;"
+        e28 = 1000000*1000001/2
+        t28 = 1
+        test(mybin,db,m28,r28,e28,t28,["-s",sock])
+
+        r29 = ".system touch ./megasqlsd.dot\n"+r28
+        run = subprocess.Popen([mybin, "-s", sock, "-m", m28, "-r", r29], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        out, err = run.communicate()
+        ran = os.path.exists("./megasqlsd.dot")
+        report(mybin, db, m28, r29.replace("\n", " "), "-s "+sock, "dot commands refused",
+               (err.rstrip() or out.rstrip())+("" if not ran else " and the dot command ran"),
+               (run.returncode != 0) and (out == "") and ("dot commands" in err) and not ran)
+    finally:
+        server.terminate()
+        server.wait()
+        os.system("rm -f "+sock+" ./megasqlsd.dot")
+
+def suite_budget(mybin,db):
+    # three queries at once share a host budget of 2 map slots, one of them at low priority
+    env = dict(os.environ, MULTICORE_CORE_BUDGET="2")
+    m20 = "select n%100 as g, count(*) as k from mega group by g;"
+    r20 = "select sum(k*g) from maptable;"
+    e20 = 10000*(99*100/2)
+    for engine in ["process", "threads"]:
+        opts = [["-e",engine], ["-e",engine], ["-e",engine,"-P","low"]]
+        runs = [subprocess.Popen([mybin, "-d", db, "-m", m20, "-r", r20]+o, stdout=subprocess.PIPE, env=env) for o in opts]
+        got = [r.communicate()[0].rstrip() for r in runs]
+        report(mybin, db, m20, r20, "MULTICORE_CORE_BUDGET=2 "+" | ".join([" ".join(o) for o in opts]),
+               str(e20)+" from each", " ".join(got), all(g and abs(float(g)-e20)<1 for g in got))
+
+def suite_deadline(mybin,db):
+    # a map too slow to finish is stopped at its timeout, or reduced over the shards mapped by then with -p
+    import time
+    slow = "select count(*) as n from mega a, mega b where a.n%7=b.n%5;"
+    # shards whose largest n is odd are slow, the others fast
+    half = "select count(*) as n from mega where (select max(n)%2 from mega)=0 union all select count(*) as n from mega a, mega b where (select max(n)%2 from mega)=1 and a.n%7=b.n%5;"
+    runs = [(["-e","process","-T","1"], slow), (["-e","threads","-T","1"], slow), (["-e","threads","-c","20","-T","2","-p"], half), (["-e","threads","-T","0.5","-p"], slow)]
+    for opts, m21 in runs:
+        r21 = "select sum(n) from maptable;"
+        start = time.time()
+        run = subprocess.Popen([mybin, "-d", db, "-m", m21, "-r", r21]+opts, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        out, err = run.communicate()
+        elapsed = time.time()-start
+        if ("-p" in opts) and (m21 == slow):
+            expected = "no rows from a partial result of 0 shards"
+            ok = ("partial result from 0 of" in err) and (out == "")
+        elif "-p" in opts:
+            expected = "partial sum below 1000000 and a count of shards mapped"
+            ok = ("partial result from" in err) and (0 < float(out or 0) < 1000000)
+        else:
+            expected = "timeout error"
+            ok = ("timeout" in err) and (out == "")
+        report(mybin, db, m21, r21, " ".join(opts), expected,
+               (out.rstrip() or err.rstrip())+" in %.1f seconds" % elapsed, ok and (elapsed < 10))
+
+def suite_topk(mybin,db,dbp):
+    # order by with a constant limit keeps only the top rows of each shard and core
+    for engine in ["process", "threads"]:
+        q22 = "select n from mega where n%2=1 order by n desc limit 1 offset 9;"
+        e22 = 999981
+        t22 = 0.5
+        test(mybin,db,None,None,e22,t22,["-e",engine,"-c","4","-q",q22])
+
+        m23 = "select n from mega order by n desc limit 10;"
+        r23 = "select * from maptable order by n desc limit 9, 1;"
+        e23 = 999991
+        t23 = 0.5
+        test(mybin,db,m23,r23,e23,t23,["-e",engine,"-c","4"])
+
+        # a combine query given with -k is used instead of the top k one
+        k23 = "select * from maptable where n%2=0;"
+        test(mybin,db,m23,r23,999982,t23,["-e",engine,"-c","4","-k",k23])
+
+        q24 = "select n from mega group by n order by n desc limit 1 offset 4;"
+        e24 = 999996
+        t24 = 0.5
+        test(mybin,dbp,None,None,e24,t24,["-e",engine,"-c","4","-q",q24])
+
+def suite_sort(mybin,db):
+    # a reduce that only orders merges each core's sorted run; a sorted export's parts follow each other in order
+    m25 = "select n, n%7 as m from mega where n%10=0;"
+    r25 = "select * from maptable order by m desc, n;"
+    e25 = sorted([(n%7, n) for n in range(10,1000001,10)], key=lambda r: (-r[0], r[1]))
+    got25 = [tuple(reversed([int(v) for v in line.split("|")])) for line in runsqls(mybin,db,m25,r25,["-e","threads","-c","4"]).splitlines()]
+    report(mybin, db, m25, r25, "-e threads -c 4", str(len(e25))+" rows by m desc, n", str(len(got25))+" rows", got25 == e25)
+    os.system("rm -rf ./megasort")
+    m26 = "select n%1000 as k, n from mega where n%3=0 order by k desc;"
+    subprocess.check_output([mybin, "-d", db, "-c", "4", "-m", m26, "-o", "./megasort", "-F", "tsv"])
+    keys = []
+    nparts = 0
+    for line in open("./megasort/manifest.txt"):
+        if not line.startswith("#"):
+            nparts += 1
+            for row in open("./megasort/"+line.split("\t")[0]):
+                keys.append(int(row.split("\t")[0]))
+    report(mybin, db, m26, None, "-c 4 -o ./megasort -F tsv", "333333 rows in 4 parts, by k desc",
+           str(len(keys))+" rows in "+str(nparts)+" parts",
+           (len(keys) == 333333) and (nparts == 4) and (keys == sorted(keys, reverse=True)))
+
+def suite_shuffle(mybin,db):
+    # a reduce grouping many keys runs one reducer per core, each on one hash bucket of the groups
+    m27 = "select n%200000 as g, n from mega;"
+    r27 = "select g, count(*) as c, sum(n) as s from maptable group by g having c=5;"
+    rows = [line.split("|") for line in runsqls(mybin,db,m27,r27,["-e","threads","-c","4"]).splitlines()]
+    groups = len(set(int(r[0]) for r in rows))
+    total = sum(int(r[2]) for r in rows)
+    report(mybin, db, m27, r27, "-e threads -c 4", "200000 groups of 5 summing to 500000500000",
+           str(groups)+" groups in "+str(len(rows))+" rows summing to "+str(total),
+           (groups == 200000) and (len(rows) == 200000) and (total == 500000500000))
+
+    # a window over all the groups, or select distinct across them, needs the whole maptable at once
+    r32 = "select g, count(*) over () as c from maptable group by g;"
+    rows = [line.split("|") for line in runsqls(mybin,db,m27,r32,["-e","threads","-c","4"]).splitlines()]
+    counts = set(r[1] for r in rows)
+    report(mybin, db, m27, r32, "-e threads -c 4", "200000 rows each counting 200000",
+           str(len(rows))+" rows counting "+" ".join(sorted(counts)[:4]),
+           (len(rows) == 200000) and (counts == set(["200000"])))
+
+    r33 = "select distinct count(*) from maptable group by g;"
+    got = runsqls(mybin,db,m27,r33,["-e","threads","-c","4"]).split()
+    report(mybin, db, m27, r33, "-e threads -c 4", "5", " ".join(got[:4]), got == ["5"])
+
+def suite_async(mybin,db):
+    # mu_submit_query() with mu_wait(), polling with mu_poll() until done, and mu_cancel() of a query still running
+    for engine in ["threads", "process"]:
+        run = subprocess.Popen(["./asynctest", db, engine], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        out, err = run.communicate()
+        got = dict((line.split()[0], line.split()[1:]) for line in out.splitlines() if line.strip())
+        w = got.get("wait", [])
+        report(mybin, db, None, None, "asynctest "+engine+" wait", "1000000", " ".join(w), w == ["1000000"])
+        p = got.get("poll", [])
+        report(mybin, db, None, None, "asynctest "+engine+" poll", "1000000 after polling, mu_async_fd readable",
+               " ".join(p), (len(p) == 3) and (p[0] == "1000000") and (p[2] == "1"))
+        c = got.get("cancel", [])
+        report(mybin, db, None, None, "asynctest "+engine+" cancel", "in flight, then no result and an error within 2 seconds",
+               " ".join(c), (len(c) == 4) and (c[0] == "1") and (c[1] == "NULL") and (c[2] == "1") and (float(c[3]) < 2))
+
+def suite_csv(mybin,db):
+    m8 = "select sum(val) as v, sum(name like 'name %, \"quoted\"'||char(10)||'line two') as k from quoted;"
+    r8 = "select sum(v)+sum(k) from maptable;"
+    e8 = (10000*10001/2)+10000
+    t8 = 1
+    test(mybin,db,m8,r8,e8,t8)
+
+suite("../build/sqls", "./mega")
+suite("../build/3sqls", "./mega")
+suite_sqls("../build/sqls", "./mega")
+suite_csv("../build/sqls", "./quoted")
+suite("../build/sqls", "./megas")
+suite_partition("../build/sqls", "./megap")
+suite_zonemap("../build/sqls", "./megaz")
+suite_cache("../build/sqls", "./mega")
+suite_append("../build/sqls", "./megaa")
+suite_memory("../build/sqls", "./mega")
+suite_export("../build/sqls", "./mega")
+suite_agents("../build/sqls", "./mega")
+suite_sqlsd("../build/sqls", "./mega")
+suite_budget("../build/sqls", "./mega")
+suite_deadline("../build/sqls", "./mega")
+suite_topk("../build/sqls", "./mega", "./megap")
+suite_sort("../build/sqls", "./mega")
+suite_shuffle("../build/sqls", "./mega")
+suite_async("../build/sqls", "./mega")
 
+if failures:
+    print str(len(failures))+" tests FAILED"
+    exit(1)